@@ -2,24 +2,407 @@
 // Copyright (C) 2017 lambdadroid
 
 #include "android.h"
+#include "log.h"
+#include "timing.h"
 #include <efilib.h>
 
-EFI_STATUS android_open_image(struct android_image *image) {
-    EFI_STATUS err = image_read(&image->image, 0, &image->header, sizeof(image->header));
+// Vendor ramdisks first, followed by the ramdisk and the second stage (if requested)
+static VOID android_layout_ramdisk(struct android_image *image) {
+    image->ramdisk_part_count = 0;
+    image->ramdisk_size = 0;
+
+    struct {
+        struct efi_image *image;
+        UINT64 offset;
+        UINT32 size;
+    } parts[ANDROID_MAX_RAMDISK_PARTS];
+    UINTN count = 0;
+
+    for (UINTN i = 0; i < image->vendor_ramdisk_count; ++i, ++count) {
+        parts[count].image = &image->vendor_image;
+        parts[count].offset = image->vendor_ramdisks[i].offset;
+        parts[count].size = image->vendor_ramdisks[i].size;
+    }
+
+    parts[count].image = &image->image;
+    parts[count].offset = android_ramdisk_offset(image);
+    parts[count++].size = image->header.ramdisk_size;
+
+    if (image->load_second) {
+        parts[count].image = &image->image;
+        parts[count].offset = android_second_offset(image);
+        parts[count++].size = image->header.second_size;
+    }
+
+    for (UINTN i = 0; i < count; ++i) {
+        if (!parts[i].size) {
+            continue;
+        }
+
+        struct android_ramdisk_part *part = &image->ramdisk_parts[image->ramdisk_part_count++];
+        part->image = parts[i].image;
+        part->offset = parts[i].offset;
+        part->size = parts[i].size;
+        part->load_offset = (image->ramdisk_size + ANDROID_RAMDISK_ALIGN - 1) & ~(ANDROID_RAMDISK_ALIGN - 1);
+        image->ramdisk_size = part->load_offset + part->size;
+    }
+}
+
+// The command line is split in the same way as in older header versions
+static VOID android_convert_header_v3(struct android_boot_image_header *header) {
+    struct android_boot_image_header_v3 v3;
+    CopyMem(&v3, header, sizeof(v3));
+    ZeroMem(header, sizeof(*header));
+
+    CopyMem(header->magic, v3.magic, sizeof(header->magic));
+    header->kernel_size = v3.kernel_size;
+    header->ramdisk_size = v3.ramdisk_size;
+    header->page_size = ANDROID_BOOT_V3_PAGE_SIZE;
+    header->header_version = v3.header_version;
+    header->os_version = v3.os_version;
+    CopyMem(header->cmdline, v3.cmdline, ANDROID_BOOT_ARGS_SIZE);
+    CopyMem(header->extra_cmdline, &v3.cmdline[ANDROID_BOOT_ARGS_SIZE], ANDROID_BOOT_EXTRA_ARGS_SIZE);
+}
+
+EFI_STATUS android_open_image(struct android_image *image, BOOLEAN verify, BOOLEAN load_second) {
+    mp_job_init(&image->hash_job);
+    image->vendor_open = FALSE;
+    image->vendor_ramdisk_count = 0;
+
+    // Read the header together with the beginning of the kernel to avoid
+    // a separate read for the kernel setup header
+    EFI_STATUS err = image_prefetch(&image->image, 0, ANDROID_IMAGE_PROBE_SIZE);
+    if (err) {
+        return err;
+    }
+
+    err = image_read(&image->image, 0, &image->header, sizeof(image->header));
     if (err) {
         return err;
     }
 
     if (CompareMem(image->header.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE)) {
-        Print(L"Partition does not appear to be an Android boot partition\n");
+        log_error(L"Partition does not appear to be an Android boot partition\n");
         return EFI_VOLUME_CORRUPTED;
     }
 
+    if (image->header.header_version >= 3) {
+        android_convert_header_v3(&image->header);
+    }
+
+    image->load_second = load_second;
+
+    // Newer header versions include additional sections in the digest
+    image->verify = verify;
+    if (verify && image->header.header_version) {
+        log_error(L"Cannot verify boot image with header version %d\n", image->header.header_version);
+        return EFI_UNSUPPORTED;
+    }
+
+    android_layout_ramdisk(image);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS android_add_vendor_ramdisk(struct android_image *image, UINT64 offset, UINT32 size) {
+    if (!size) {
+        return EFI_SUCCESS;
+    }
+    if (image->vendor_ramdisk_count >= ANDROID_MAX_VENDOR_RAMDISKS) {
+        log_error(L"Too many vendor ramdisks (maximum: %d)\n", ANDROID_MAX_VENDOR_RAMDISKS);
+        return EFI_UNSUPPORTED;
+    }
+
+    image->vendor_ramdisks[image->vendor_ramdisk_count].offset = offset;
+    image->vendor_ramdisks[image->vendor_ramdisk_count].size = size;
+    ++image->vendor_ramdisk_count;
+    return EFI_SUCCESS;
+}
+
+// Only the entries of the table are read, the ramdisks are read directly into the ramdisk later
+static EFI_STATUS android_read_vendor_ramdisk_table(struct android_image *image,
+        const struct android_vendor_boot_header *header, UINT64 ramdisk_offset, BOOLEAN recovery) {
+    UINTN mask = header->page_size - 1;
+    UINT64 table_offset = ramdisk_offset + ((header->vendor_ramdisk_size + mask) & ~mask)
+                          + ((header->dtb_size + mask) & ~mask);
+
+    UINT32 entry_size = header->vendor_ramdisk_table_entry_size;
+    if (entry_size < sizeof(struct android_vendor_ramdisk_table_entry)
+            || (UINT64) entry_size * header->vendor_ramdisk_table_entry_num > header->vendor_ramdisk_table_size) {
+        log_error(L"Invalid vendor ramdisk table\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    for (UINT32 i = 0; i < header->vendor_ramdisk_table_entry_num; ++i) {
+        struct android_vendor_ramdisk_table_entry entry;
+        EFI_STATUS err = image_read(&image->vendor_image, table_offset + (UINT64) i * entry_size, &entry, sizeof(entry));
+        if (err) {
+            return err;
+        }
+
+        if ((UINT64) entry.ramdisk_offset + entry.ramdisk_size > header->vendor_ramdisk_size) {
+            log_error(L"Vendor ramdisk %d is outside of the vendor ramdisk section\n", i);
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        if (entry.ramdisk_type == ANDROID_VENDOR_RAMDISK_TYPE_RECOVERY && !recovery) {
+            continue;
+        }
+
+        err = android_add_vendor_ramdisk(image, ramdisk_offset + entry.ramdisk_offset, entry.ramdisk_size);
+        if (err) {
+            return err;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS android_open_vendor_boot(struct android_image *image, EFI_HANDLE loader, EFI_HANDLE loader_device,
+                                    EFI_HANDLE partition, BOOLEAN recovery) {
+    EFI_STATUS err = image_open(&image->vendor_image, loader, loader_device, partition, NULL);
+    if (err) {
+        return err;
+    }
+    image->vendor_open = TRUE;
+    image->vendor_image.partition_source = TIMING_SOURCE_VENDOR_BOOT;
+
+    struct android_vendor_boot_header header;
+    err = image_read(&image->vendor_image, 0, &header, sizeof(header));
+    if (err) {
+        return err;
+    }
+
+    if (CompareMem(header.magic, ANDROID_VENDOR_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE)) {
+        log_error(L"Partition does not appear to be an Android vendor boot partition\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+    if (header.header_version < 3 || header.header_version > 4 || !header.page_size
+            || (header.page_size & (header.page_size - 1))) {
+        log_error(L"Unsupported vendor boot image header version %d\n", header.header_version);
+        return EFI_UNSUPPORTED;
+    }
+
+    CopyMem(image->vendor_cmdline, header.cmdline, sizeof(image->vendor_cmdline));
+
+    // The vendor ramdisk section starts at the first page after the header
+    UINTN mask = header.page_size - 1;
+    UINT64 ramdisk_offset = (header.header_size + mask) & ~mask;
+    if (header.header_version < 4) {
+        err = android_add_vendor_ramdisk(image, ramdisk_offset, header.vendor_ramdisk_size);
+    } else {
+        err = android_read_vendor_ramdisk_table(image, &header, ramdisk_offset, recovery);
+    }
+    if (err) {
+        return err;
+    }
+
+    android_layout_ramdisk(image);
+    return EFI_SUCCESS;
+}
+
+VOID android_close_image(struct android_image *image, EFI_HANDLE loader) {
+    if (image->vendor_open) {
+        image_close(&image->vendor_image, loader);
+        image->vendor_open = FALSE;
+    }
+    image_close(&image->image, loader);
+    mp_wait(&image->hash_job);
+}
+
+EFI_STATUS android_read_kernel(struct android_image *image, UINT64 offset, VOID *kernel, UINTN size) {
+    return image_read(&image->image, image->header.page_size + offset, kernel, size);
+}
+
+/*
+ * mkbootimg stores SHA-1(kernel, kernel_size, ramdisk, ramdisk_size, second, second_size)
+ * in id[] (sizes as 32-bit little endian). Each chunk is hashed on an application processor (if possible)
+ * once it has been read, while the following chunks are still being read by the firmware.
+ * Buffers that are reused must not be touched before the hash job has finished.
+ */
+
+static VOID EFIAPI android_hash_job(VOID *context) {
+    struct android_image *image = context;
+    const UINT8 *data = image->hash_buffer;
+    UINTN size = image->hash_size;
+
+    for (;;) {
+        UINTN n = size < image->hash_remaining ? size : (UINTN) image->hash_remaining;
+        sha1_update(&image->sha1, data, n);
+        data += n;
+        size -= n;
+
+        image->hash_remaining -= n;
+        if (image->hash_remaining || image->hash_index >= 3) {
+            return;
+        }
+
+        // End of section, append its size
+        sha1_update(&image->sha1, &image->hash_sizes[image->hash_index], sizeof(UINT32));
+        if (++image->hash_index < 3) {
+            image->hash_remaining = image->hash_sizes[image->hash_index];
+        }
+    }
+}
+
+static VOID android_hash(VOID *context, const VOID *buffer, UINTN size) {
+    struct android_image *image = context;
+
+    // The chunks must be hashed in order
+    mp_wait(&image->hash_job);
+    image->hash_buffer = buffer;
+    image->hash_size = size;
+    mp_start(&image->hash_job, android_hash_job, image);
+}
+
+// Hash part of the image that is not loaded into memory
+static EFI_STATUS android_hash_image(struct android_image *image, UINT64 offset, UINTN size) {
+    if (!size) {
+        return EFI_SUCCESS;
+    }
+
+    VOID *buffer = AllocatePool(size);
+    if (!buffer) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    // The cache might be refilled by the read
+    mp_wait(&image->hash_job);
+
+    // The callback hashes the data
+    EFI_STATUS err = image_read(&image->image, offset, buffer, size);
+    mp_wait(&image->hash_job);
+    FreePool(buffer);
+    return err;
+}
+
+// Parts of the ramdisk that are read from the source image (the padding in front of them is cleared)
+static UINTN android_ramdisk_regions(struct android_image *image, struct efi_image *source, VOID *ramdisk,
+                                     struct image_region *regions) {
+    UINTN count = 0;
+    UINT32 end = 0;
+    for (UINTN i = 0; i < image->ramdisk_part_count; ++i) {
+        const struct android_ramdisk_part *part = &image->ramdisk_parts[i];
+        if (part->image == source) {
+            ZeroMem((VOID*) ((UINTN) ramdisk + end), part->load_offset - end);
+
+            regions[count].offset = part->offset;
+            regions[count].buffer = (VOID*) ((UINTN) ramdisk + part->load_offset);
+            regions[count].size = part->size;
+            ++count;
+        }
+        end = part->load_offset + part->size;
+    }
+    return count;
+}
+
+// Vendor ramdisks are read in parallel to the boot image
+static EFI_STATUS android_load_vendor_ramdisks(struct android_image *image, VOID *ramdisk) {
+    if (!image->vendor_open) {
+        return EFI_SUCCESS;
+    }
+
+    struct image_region regions[ANDROID_MAX_VENDOR_RAMDISKS];
+    UINTN count = android_ramdisk_regions(image, &image->vendor_image, ramdisk, regions);
+    return image_read_regions(&image->vendor_image, regions, count);
+}
+
+EFI_STATUS android_load(struct android_image *image, UINT64 kernel_offset, VOID *kernel, VOID *ramdisk) {
+    // Everything is read in a single sequential pass over the image
+    struct image_region regions[ANDROID_MAX_RAMDISK_PARTS + 1] = {
+        { image->header.page_size + kernel_offset, kernel, image->header.kernel_size - kernel_offset },
+    };
+    UINTN count = 1;
+    if (ramdisk) {
+        count += android_ramdisk_regions(image, &image->image, ramdisk, &regions[1]);
+    }
+
+    if (image->verify) {
+        sha1_init(&image->sha1);
+        image->hash_sizes[0] = image->header.kernel_size;
+        image->hash_sizes[1] = image->header.ramdisk_size;
+        image->hash_sizes[2] = image->header.second_size;
+        image->hash_index = 0;
+        image->hash_remaining = image->header.kernel_size;
+
+        image->image.callback = android_hash;
+        image->image.callback_context = image;
+
+        // Kernel setup code is not loaded into memory
+        EFI_STATUS err = android_hash_image(image, image->header.page_size, kernel_offset);
+        if (err) {
+            return err;
+        }
+    }
+
+    // Copy the part that was already read together with the header
+    UINTN size = image_read_cached(&image->image, regions[0].offset, regions[0].buffer, regions[0].size);
+    regions[0].offset += size;
+    regions[0].buffer = (VOID*) ((UINTN) regions[0].buffer + size);
+    regions[0].size -= size;
+
+    EFI_STATUS err = image_read_regions(&image->image, regions, count);
+    if (!err && ramdisk) {
+        err = android_load_vendor_ramdisks(image, ramdisk);
+    }
+    return err;
+}
+
+EFI_STATUS android_load_ramdisk(struct android_image *image, VOID *ramdisk) {
+    struct image_region regions[ANDROID_MAX_RAMDISK_PARTS];
+    UINTN count = android_ramdisk_regions(image, &image->image, ramdisk, regions);
+    EFI_STATUS err = image_read_regions(&image->image, regions, count);
+    if (!err) {
+        err = android_load_vendor_ramdisks(image, ramdisk);
+    }
+    return err;
+}
+
+EFI_STATUS android_wait(struct android_image *image) {
+    EFI_STATUS err = image_wait(&image->image);
+    if (image->vendor_open) {
+        EFI_STATUS status = image_wait(&image->vendor_image);
+        if (!err) {
+            err = status;
+        }
+    }
+    return err;
+}
+
+EFI_STATUS android_verify(struct android_image *image) {
+    if (!image->verify) {
+        return EFI_SUCCESS;
+    }
+
+    // The second stage was already hashed if it was loaded
+    EFI_STATUS err = EFI_SUCCESS;
+    if (!image->load_second) {
+        err = android_hash_image(image, android_second_offset(image), image->header.second_size);
+    }
+    image->image.callback = NULL;
+    mp_wait(&image->hash_job);
+    if (err) {
+        return err;
+    }
+
+    // The size of the last section is only appended once it is complete
+    if (image->hash_index < 3) {
+        log_error(L"Boot image was not hashed completely\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINT8 digest[SHA1_DIGEST_SIZE];
+    sha1_final(&image->sha1, digest);
+
+    if (CompareMem(digest, image->header.id, sizeof(digest))) {
+        log_error(L"Boot image does not match its SHA-1 digest\n");
+        return EFI_SECURITY_VIOLATION;
+    }
+
     return EFI_SUCCESS;
 }
 
 EFI_STATUS android_copy_cmdline(const struct android_image *image, CHAR8* cmdline, UINTN max_length) {
-    if (max_length <= ANDROID_BOOT_ARGS_SIZE + ANDROID_BOOT_EXTRA_ARGS_SIZE) {
+    if (max_length <= ANDROID_MAX_CMDLINE_SIZE) {
         return EFI_BUFFER_TOO_SMALL;
     }
 
@@ -36,5 +419,22 @@ EFI_STATUS android_copy_cmdline(const struct android_image *image, CHAR8* cmdlin
         }
     }
 
+    if (!image->vendor_open) {
+        return EFI_SUCCESS;
+    }
+
+    // Vendor command line is appended (also not null-terminated)
+    UINTN length = strlena(cmdline);
+    UINTN vendor_length = 0;
+    while (vendor_length < ANDROID_VENDOR_BOOT_ARGS_SIZE && image->vendor_cmdline[vendor_length]) {
+        ++vendor_length;
+    }
+
+    if (length && vendor_length) {
+        cmdline[length++] = ' ';
+    }
+    CopyMem(&cmdline[length], image->vendor_cmdline, vendor_length);
+    cmdline[length + vendor_length] = 0;
+
     return EFI_SUCCESS;
 }
@@ -6,6 +6,8 @@
 
 #include <efi.h>
 #include "image.h"
+#include "sha1.h"
+#include "mp.h"
 
 #define ANDROID_BOOT_MAGIC "ANDROID!"
 #define ANDROID_BOOT_MAGIC_SIZE 8
@@ -13,6 +15,21 @@
 #define ANDROID_BOOT_ARGS_SIZE 512
 #define ANDROID_BOOT_EXTRA_ARGS_SIZE 1024
 
+// Header version 3 and later: The ramdisk is split between the boot and vendor_boot partition
+#define ANDROID_BOOT_V3_PAGE_SIZE 4096
+#define ANDROID_VENDOR_BOOT_MAGIC "VNDRBOOT"
+#define ANDROID_VENDOR_BOOT_ARGS_SIZE 2048
+#define ANDROID_VENDOR_RAMDISK_NAME_SIZE 32
+#define ANDROID_VENDOR_RAMDISK_BOARD_ID_SIZE 16
+#define ANDROID_VENDOR_RAMDISK_TYPE_RECOVERY 2
+#define ANDROID_MAX_VENDOR_RAMDISKS 16
+
+// Command line of boot and vendor_boot image, separated by a space
+#define ANDROID_MAX_CMDLINE_SIZE (ANDROID_BOOT_ARGS_SIZE + ANDROID_BOOT_EXTRA_ARGS_SIZE + 1 + ANDROID_VENDOR_BOOT_ARGS_SIZE)
+
+// Number of bytes read into the image cache together with the header (includes the kernel setup header)
+#define ANDROID_IMAGE_PROBE_SIZE 0x4000
+
 struct android_boot_image_header {
     CHAR8   magic[ANDROID_BOOT_MAGIC_SIZE];
     UINT32  kernel_size;
@@ -23,7 +40,7 @@ struct android_boot_image_header {
     UINT32  second_addr;
     UINT32  tags_addr;
     UINT32  page_size;
-    UINT32  unused;
+    UINT32  header_version;
     UINT32  os_version;
     CHAR8   name[ANDROID_BOOT_NAME_SIZE];
     CHAR8   cmdline[ANDROID_BOOT_ARGS_SIZE];
@@ -31,34 +48,134 @@ struct android_boot_image_header {
     CHAR8   extra_cmdline[ANDROID_BOOT_EXTRA_ARGS_SIZE];
 } __attribute__((packed));
 
+// Header version 3 and 4, converted to struct android_boot_image_header when the image is opened
+struct android_boot_image_header_v3 {
+    CHAR8   magic[ANDROID_BOOT_MAGIC_SIZE];
+    UINT32  kernel_size;
+    UINT32  ramdisk_size;
+    UINT32  os_version;
+    UINT32  header_size;
+    UINT32  reserved[4];
+    UINT32  header_version;
+    CHAR8   cmdline[ANDROID_BOOT_ARGS_SIZE + ANDROID_BOOT_EXTRA_ARGS_SIZE];
+    UINT32  signature_size; // Version 4
+} __attribute__((packed));
+
+struct android_vendor_boot_header {
+    CHAR8   magic[ANDROID_BOOT_MAGIC_SIZE];
+    UINT32  header_version;
+    UINT32  page_size;
+    UINT32  kernel_addr;
+    UINT32  ramdisk_addr;
+    UINT32  vendor_ramdisk_size;
+    CHAR8   cmdline[ANDROID_VENDOR_BOOT_ARGS_SIZE];
+    UINT32  tags_addr;
+    CHAR8   name[ANDROID_BOOT_NAME_SIZE];
+    UINT32  header_size;
+    UINT32  dtb_size;
+    UINT64  dtb_addr;
+
+    // Version 4
+    UINT32  vendor_ramdisk_table_size;
+    UINT32  vendor_ramdisk_table_entry_num;
+    UINT32  vendor_ramdisk_table_entry_size;
+    UINT32  bootconfig_size;
+} __attribute__((packed));
+
+struct android_vendor_ramdisk_table_entry {
+    UINT32  ramdisk_size;
+    UINT32  ramdisk_offset; // Relative to the vendor ramdisk section
+    UINT32  ramdisk_type;
+    CHAR8   ramdisk_name[ANDROID_VENDOR_RAMDISK_NAME_SIZE];
+    UINT32  board_id[ANDROID_VENDOR_RAMDISK_BOARD_ID_SIZE];
+} __attribute__((packed));
+
+// Part of the ramdisk that is read directly from one of the images into the ramdisk
+struct android_ramdisk_part {
+    struct efi_image *image;
+    UINT64 offset;
+    UINT32 size;
+    UINT32 load_offset; // Offset in the ramdisk
+};
+
+// Vendor ramdisks, ramdisk and second stage
+#define ANDROID_MAX_RAMDISK_PARTS (ANDROID_MAX_VENDOR_RAMDISKS + 2)
+
 struct android_image {
     struct efi_image image;
     struct android_boot_image_header header;
+
+    // Load the second stage as additional initrd, behind the ramdisk
+    BOOLEAN load_second;
+
+    // Vendor boot image (header version 3 and later)
+    BOOLEAN vendor_open;
+    struct efi_image vendor_image;
+    CHAR8 vendor_cmdline[ANDROID_VENDOR_BOOT_ARGS_SIZE];
+    struct {
+        UINT64 offset;
+        UINT32 size;
+    } vendor_ramdisks[ANDROID_MAX_VENDOR_RAMDISKS]; // Only the ones that are loaded
+    UINTN vendor_ramdisk_count;
+
+    // The parts are placed behind each other (aligned), in the order they are listed
+    struct android_ramdisk_part ramdisk_parts[ANDROID_MAX_RAMDISK_PARTS];
+    UINTN ramdisk_part_count;
+    UINT32 ramdisk_size;
+
+    // Verification of the SHA-1 digest in id[], computed while the image is loaded
+    BOOLEAN verify;
+    struct sha1_ctx sha1;
+    UINT32 hash_sizes[3];
+    UINTN hash_index;
+    UINT64 hash_remaining;
+
+    // Chunk that is currently hashed (possibly on another processor)
+    struct mp_job hash_job;
+    const VOID *hash_buffer;
+    UINTN hash_size;
 };
 
-EFI_STATUS android_open_image(struct android_image *image);
+EFI_STATUS android_open_image(struct android_image *image, BOOLEAN verify, BOOLEAN load_second);
+VOID android_close_image(struct android_image *image, EFI_HANDLE loader);
 
-static inline EFI_STATUS android_read_kernel(const struct android_image *image, UINT64 offset, VOID *kernel, UINTN size) {
-    return image_read(&image->image, image->header.page_size + offset, kernel, size);
+static inline BOOLEAN android_needs_vendor_boot(const struct android_image *image) {
+    return image->header.header_version >= 3;
 }
 
-static inline EFI_STATUS android_load_kernel(const struct android_image *image, UINT64 offset, VOID *kernel) {
-    return android_read_kernel(image, offset, kernel, image->header.kernel_size - offset);
-}
+// Vendor ramdisks used for recovery are skipped unless recovery is set
+EFI_STATUS android_open_vendor_boot(struct android_image *image, EFI_HANDLE loader, EFI_HANDLE loader_device,
+                                    EFI_HANDLE partition, BOOLEAN recovery);
+
+EFI_STATUS android_read_kernel(struct android_image *image, UINT64 offset, VOID *kernel, UINTN size);
 
 static inline UINT64 android_ramdisk_offset(const struct android_image *image) {
     UINTN mask = image->header.page_size - 1;
     return image->header.page_size + ((image->header.kernel_size + mask) & ~mask);
 }
 
-static inline UINT32 android_ramdisk_size(const struct android_image *image) {
-    return image->header.ramdisk_size;
+static inline UINT64 android_second_offset(const struct android_image *image) {
+    UINTN mask = image->header.page_size - 1;
+    return android_ramdisk_offset(image) + ((image->header.ramdisk_size + mask) & ~mask);
 }
 
-static inline EFI_STATUS android_load_ramdisk(const struct android_image *image, VOID *ramdisk) {
-    return image_read(&image->image, android_ramdisk_offset(image), ramdisk, android_ramdisk_size(image));
+// Each cpio archive in the initrd must start at a multiple of 4 bytes
+#define ANDROID_RAMDISK_ALIGN 4
+
+// Includes vendor ramdisks and the second stage if requested
+static inline UINT32 android_ramdisk_size(const struct android_image *image) {
+    return image->ramdisk_size;
 }
 
+// Note: Kernel and ramdisk are loaded asynchronously, see android_wait()
+EFI_STATUS android_load(struct android_image *image, UINT64 kernel_offset, VOID *kernel, VOID *ramdisk);
+// Load the ramdisk separately (if it was NULL for android_load())
+EFI_STATUS android_load_ramdisk(struct android_image *image, VOID *ramdisk);
+// Wait until all reads from boot and vendor_boot image have completed
+EFI_STATUS android_wait(struct android_image *image);
+// Must be called after android_wait() if verification was requested
+EFI_STATUS android_verify(struct android_image *image);
+
 EFI_STATUS android_copy_cmdline(const struct android_image *image, CHAR8* cmdline, UINTN max_length);
 
 #endif //ANDROID_EFI_ANDROID_H
@@ -0,0 +1,664 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "mock.h"
+#include "host.h"
+#include "../android.h"
+#include "../image.h"
+#include "../malloc.h"
+#include "../sha1.h"
+#include "../lz4.h"
+#include "../log.h"
+#include <efilib.h>
+
+/*
+ * Benchmark for loading boot images with the loader code, running on the host against
+ * the firmware mock (see mock.h). For each image size and page size a boot image is
+ * generated and loaded (kernel and ramdisk, like main.c) from each source:
+ *
+ *   partition        BlockIO/DiskIO (synchronous)
+ *   partition-async  BlockIO2/DiskIO2
+ *   file             File on a directory-backed file system
+ *   lz4              LZ4 compressed file
+ *
+ * Reported are the throughput for loading the image (mean and best run), the time for
+ * a single uncached 4 KiB read and for a small read served from the image cache.
+ * The loaded data is compared with the generated image after each run.
+ *
+ * Usage: android-efi-bench [-n iterations] [-s sizes (MiB)] [-p page sizes] [-v] [-c] [directory]
+ *   -v  Verify the SHA-1 digest while loading (--verify)
+ *   -c  Drop the image from the page cache before each run
+ */
+
+#define DEFAULT_ITERATIONS   5
+#define DEFAULT_SIZES        "16,64"
+#define DEFAULT_PAGE_SIZES   "2048,4096,16384"
+#define MAX_CONFIGS          16
+
+// Mapping used for AllocatePages (kernel and ramdisk), at least twice the largest image
+#define MIN_MEMORY_SIZE      (512ULL * 1024 * 1024)
+#define KERNEL_ALIGN         0x200000
+#define RAMDISK_MAX_ADDRESS  0xFFFFFFFF
+
+#define BLOCK_SIZE           512
+#define READ_SIZE            4096
+#define READ_CALLS           1024
+#define CACHED_READ_SIZE     64
+#define CACHED_READ_CALLS    65536
+
+#define IMAGE_NAME           "boot.img"
+#define LZ4_IMAGE_NAME       "boot.img.lz4"
+#define LZ4_BLOCK_SIZE_ID    5 // 256 KiB
+#define LZ4_HASH_BITS        14
+
+enum bench_source {
+    SOURCE_PARTITION,
+    SOURCE_PARTITION_ASYNC,
+    SOURCE_FILE,
+    SOURCE_LZ4,
+
+    SOURCE_COUNT
+};
+
+static const char *source_names[SOURCE_COUNT] = {
+    [SOURCE_PARTITION]       = "partition",
+    [SOURCE_PARTITION_ASYNC] = "partition-async",
+    [SOURCE_FILE]            = "file",
+    [SOURCE_LZ4]             = "lz4",
+};
+
+struct bench_options {
+    UINTN iterations;
+    UINTN sizes[MAX_CONFIGS];
+    UINTN size_count;
+    UINTN page_sizes[MAX_CONFIGS];
+    UINTN page_size_count;
+    BOOLEAN verify;
+    BOOLEAN cold;
+    const char *dir;
+};
+
+struct bench_state {
+    const struct bench_options *options;
+    EFI_HANDLE loader;
+    EFI_HANDLE directory;
+    EFI_HANDLE partitions[2]; // Synchronous and asynchronous
+
+    char *image_path;
+    const UINT8 *data; // Generated image
+    UINTN size;
+    VOID *disk; // Mapping of the image file
+    UINT64 disk_size;
+};
+
+static struct android_image android_image;
+
+// xorshift64*
+static UINT64 random_state = 0x9E3779B97F4A7C15ULL;
+
+static UINT64 random_next(VOID) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+// About half of the data is repeated from earlier data, so it can be compressed
+static VOID fill_data(UINT8 *data, UINTN size) {
+    for (UINTN i = 0; i < size; i += 16) {
+        UINT64 r = random_next();
+        UINTN n = size - i < 16 ? size - i : 16;
+        if (i >= 4096 && (r & 1)) {
+            CopyMem(&data[i], &data[i - 16 * (1 + (r >> 1) % 255)], n);
+        } else {
+            r = random_next();
+            CopyMem(&data[i], &r, n < 8 ? n : 8);
+            if (n > 8) {
+                r = random_next();
+                CopyMem(&data[i + 8], &r, n - 8);
+            }
+        }
+    }
+}
+
+static inline UINTN align_up(UINTN value, UINTN align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Boot image (header version 0) with kernel and ramdisk, page_size aligned, size bytes in total
+static UINT8 *create_boot_image(UINTN size, UINT32 page_size) {
+    UINT32 kernel_size = size / 4 + 123;
+    UINT32 ramdisk_size = size - 2 * page_size - align_up(kernel_size, page_size) + 1;
+
+    UINT8 *data = AllocateZeroPool(size);
+    if (!data) {
+        return NULL;
+    }
+
+    struct android_boot_image_header *header = (struct android_boot_image_header*) data;
+    CopyMem(header->magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    header->kernel_size = kernel_size;
+    header->ramdisk_size = ramdisk_size;
+    header->page_size = page_size;
+    CopyMem(header->cmdline, "console=ttyS0", sizeof("console=ttyS0"));
+
+    UINT8 *kernel = &data[page_size];
+    UINT8 *ramdisk = &data[page_size + align_up(kernel_size, page_size)];
+    fill_data(kernel, kernel_size);
+    fill_data(ramdisk, ramdisk_size);
+
+    // See android_hash()
+    UINT32 second_size = 0;
+    struct sha1_ctx sha1;
+    UINT8 digest[SHA1_DIGEST_SIZE];
+    sha1_init(&sha1);
+    sha1_update(&sha1, kernel, kernel_size);
+    sha1_update(&sha1, &kernel_size, sizeof(kernel_size));
+    sha1_update(&sha1, ramdisk, ramdisk_size);
+    sha1_update(&sha1, &ramdisk_size, sizeof(ramdisk_size));
+    sha1_update(&sha1, &second_size, sizeof(second_size));
+    sha1_final(&sha1, digest);
+    CopyMem(header->id, digest, sizeof(digest));
+
+    return data;
+}
+
+// Minimal greedy LZ4 block compressor, returns 0 if the block cannot be compressed
+static UINTN lz4_compress_block(const UINT8 *src, UINTN size, UINT8 *dst) {
+    static UINT32 table[1 << LZ4_HASH_BITS]; // Position + 1 of the last occurrence
+    ZeroMem(table, sizeof(table));
+
+    const UINT8 *ip = src, *anchor = src, *end = src + size;
+    const UINT8 *match_limit = size > 12 ? end - 12 : src; // Last match must start 12 bytes before the end
+    const UINT8 *match_end = end - 5; // Last 5 bytes are always literals
+    UINT8 *op = dst, *op_end = dst + size;
+
+    for (;;) {
+        const UINT8 *ref = NULL;
+        while (ip < match_limit) {
+            UINT32 seq;
+            CopyMem(&seq, ip, sizeof(seq));
+            UINT32 hash = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            UINT32 entry = table[hash];
+            table[hash] = ip - src + 1;
+
+            if (entry && ip - (src + entry - 1) <= 0xFFFF && !CompareMem(src + entry - 1, ip, 4)) {
+                ref = src + entry - 1;
+                break;
+            }
+            ++ip;
+        }
+
+        UINTN literals = (ref ? ip : end) - anchor;
+        UINTN match = 0;
+        if (ref) {
+            match = 4;
+            while (ip + match < match_end && ref[match] == ip[match]) {
+                ++match;
+            }
+        }
+
+        // Token, lengths, literals and offset
+        if (op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > op_end) {
+            return 0;
+        }
+
+        UINT8 *token = op++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15) {
+            UINTN len = literals - 15;
+            for (; len >= 255; len -= 255) {
+                *op++ = 255;
+            }
+            *op++ = len;
+        }
+        CopyMem(op, anchor, literals);
+        op += literals;
+
+        if (!ref) {
+            return op - dst;
+        }
+
+        UINTN offset = ip - ref;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+
+        UINTN len = match - 4;
+        *token |= len < 15 ? len : 15;
+        if (len >= 15) {
+            for (len -= 15; len >= 255; len -= 255) {
+                *op++ = 255;
+            }
+            *op++ = len;
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+}
+
+// xxHash32 of the frame descriptor (only the short input case, without 4-byte lanes)
+static UINT8 lz4_header_checksum(const UINT8 *descriptor, UINTN size) {
+    UINT32 h = 374761393U + size;
+    for (UINTN i = 0; i < size; ++i) {
+        h += descriptor[i] * 374761393U;
+        h = ((h << 11) | (h >> 21)) * 2654435761U;
+    }
+
+    h ^= h >> 15;
+    h *= 2246822519U;
+    h ^= h >> 13;
+    h *= 3266489917U;
+    h ^= h >> 16;
+    return (h >> 8) & 0xFF;
+}
+
+// Frame with independent blocks, without content size and block/content checksums
+static UINT8 *lz4_compress_frame(const UINT8 *src, UINTN size, UINTN *frame_size) {
+    UINTN block_size = 1 << (8 + 2 * LZ4_BLOCK_SIZE_ID);
+    UINTN blocks = (size + block_size - 1) / block_size;
+    UINT8 *frame = AllocatePool(LZ4_FRAME_MAX_HEADER_SIZE + blocks * (4 + block_size) + 4);
+    if (!frame) {
+        return NULL;
+    }
+
+    UINT32 magic = LZ4_FRAME_MAGIC;
+    CopyMem(frame, &magic, sizeof(magic));
+    frame[4] = 0x40 | 0x20; // Version 1, independent blocks
+    frame[5] = LZ4_BLOCK_SIZE_ID << 4;
+    frame[6] = lz4_header_checksum(&frame[4], 2);
+    UINT8 *p = &frame[7];
+
+    for (UINTN offset = 0; offset < size; offset += block_size) {
+        UINTN n = size - offset < block_size ? size - offset : block_size;
+        UINT32 compressed = lz4_compress_block(&src[offset], n, p + 4);
+        if (!compressed) {
+            compressed = n | LZ4_BLOCK_UNCOMPRESSED;
+            CopyMem(p + 4, &src[offset], n);
+        }
+
+        CopyMem(p, &compressed, sizeof(compressed));
+        p += 4 + (compressed & ~LZ4_BLOCK_UNCOMPRESSED);
+    }
+
+    ZeroMem(p, 4); // End mark
+    *frame_size = p + 4 - frame;
+    return frame;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    UINTN dir_len = strlena((const CHAR8*) dir), name_len = strlena((const CHAR8*) name);
+    char *path = AllocatePool(dir_len + 1 + name_len + 1);
+    if (path) {
+        CopyMem(path, dir, dir_len);
+        path[dir_len] = '/';
+        CopyMem(&path[dir_len + 1], name, name_len + 1);
+    }
+    return path;
+}
+
+static EFI_STATUS write_image(struct bench_state *state, const char *name, const VOID *data, UINTN size) {
+    char *path = join_path(state->options->dir, name);
+    if (!path) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    int ret = host_write_file(path, data, size);
+    FreePool(path);
+    return ret ? EFI_DEVICE_ERROR : EFI_SUCCESS;
+}
+
+static EFI_STATUS open_source(struct bench_state *state, enum bench_source source, struct efi_image *image) {
+    switch (source) {
+        case SOURCE_PARTITION:
+        case SOURCE_PARTITION_ASYNC:
+            return image_open(image, state->loader, state->directory,
+                              state->partitions[source == SOURCE_PARTITION_ASYNC], NULL);
+        case SOURCE_FILE:
+            return image_open(image, state->loader, state->directory, NULL, L"\\" IMAGE_NAME);
+        case SOURCE_LZ4:
+            return image_open(image, state->loader, state->directory, NULL, L"\\" LZ4_IMAGE_NAME);
+        default:
+            return EFI_INVALID_PARAMETER;
+    }
+}
+
+static VOID drop_cache(struct bench_state *state) {
+    if (state->options->cold) {
+        host_drop_cache(state->image_path, state->disk, state->disk_size);
+    }
+}
+
+static EFI_STATUS check_data(const struct bench_state *state, const UINT8 *kernel, const UINT8 *ramdisk) {
+    const struct android_boot_image_header *header = &android_image.header;
+    UINTN ramdisk_offset = header->page_size + align_up(header->kernel_size, header->page_size);
+    if (CompareMem(kernel, &state->data[header->page_size], header->kernel_size)
+            || CompareMem(ramdisk, &state->data[ramdisk_offset], header->ramdisk_size)) {
+        log_error(L"Loaded data does not match the image\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+    return EFI_SUCCESS;
+}
+
+// Load kernel and ramdisk like main.c, returns the time in ns (without comparing the data)
+static EFI_STATUS load_image(struct bench_state *state, enum bench_source source, UINT64 *time) {
+    struct android_image *image = &android_image;
+    drop_cache(state);
+
+    UINT64 start = host_time_ns();
+    EFI_STATUS err = open_source(state, source, &image->image);
+    if (err) {
+        return err;
+    }
+
+    err = android_open_image(image, state->options->verify, FALSE);
+    if (err) {
+        goto out;
+    }
+
+    EFI_PHYSICAL_ADDRESS kernel, ramdisk = RAMDISK_MAX_ADDRESS;
+    err = malloc_low(image->header.kernel_size, KERNEL_ALIGN, &kernel);
+    if (!err) {
+        err = malloc_high(android_ramdisk_size(image), &ramdisk);
+    }
+    if (!err) {
+        err = android_load(image, 0, (VOID*) (UINTN) kernel, (VOID*) (UINTN) ramdisk);
+    }
+
+    EFI_STATUS status = android_wait(image);
+    if (!err) {
+        err = status;
+    }
+    if (!err) {
+        err = android_verify(image);
+    }
+    *time = host_time_ns() - start;
+
+    if (!err) {
+        err = check_data(state, (const UINT8*) (UINTN) kernel, (const UINT8*) (UINTN) ramdisk);
+    }
+
+out:
+    android_close_image(image, state->loader);
+    mock_free_pages();
+    malloc_release();
+    return err;
+}
+
+// Time for single reads (uncached, scattered over the image) and small reads from the image cache
+static EFI_STATUS measure_reads(struct bench_state *state, enum bench_source source,
+                                UINT64 *read_time, UINT64 *cached_time) {
+    static UINT8 buffer[READ_SIZE] __attribute__((aligned(READ_SIZE)));
+    struct efi_image image;
+    drop_cache(state);
+
+    EFI_STATUS err = open_source(state, source, &image);
+    if (err) {
+        return err;
+    }
+
+    UINTN blocks = state->size / READ_SIZE;
+    UINT64 start = host_time_ns();
+    for (UINTN i = 0; i < READ_CALLS && !err; ++i) {
+        UINT64 offset = (UINT64) ((i * 7919) % blocks) * READ_SIZE;
+        err = image_read_async(&image, offset, buffer, READ_SIZE);
+        if (!err) {
+            err = image_wait(&image);
+        }
+    }
+    *read_time = host_time_ns() - start;
+
+    if (!err) {
+        err = image_read(&image, 0, buffer, CACHED_READ_SIZE);
+    }
+
+    start = host_time_ns();
+    for (UINTN i = 0; i < CACHED_READ_CALLS && !err; ++i) {
+        err = image_read(&image, i % (IMAGE_CACHE_BLOCK_SIZE - CACHED_READ_SIZE), buffer, CACHED_READ_SIZE);
+    }
+    *cached_time = host_time_ns() - start;
+
+    image_close(&image, state->loader);
+    return err;
+}
+
+static EFI_STATUS run_source(struct bench_state *state, enum bench_source source, UINT32 page_size) {
+    const struct bench_options *options = state->options;
+    UINT64 total = 0, best = (UINT64) -1;
+
+    for (UINTN i = 0; i < options->iterations; ++i) {
+        UINT64 time;
+        EFI_STATUS err = load_image(state, source, &time);
+        if (err) {
+            log_error(L"Failed to load image from %a: %r\n", source_names[source], err);
+            return err;
+        }
+
+        total += time;
+        if (time < best) {
+            best = time;
+        }
+    }
+
+    UINT64 read_time, cached_time;
+    EFI_STATUS err = measure_reads(state, source, &read_time, &cached_time);
+    if (err) {
+        log_error(L"Failed to read from %a: %r\n", source_names[source], err);
+        return err;
+    }
+
+    // Bytes per ns * 1000 = MB/s
+    double mean = (double) total / options->iterations;
+    host_print("%-16s %6lu %6u %10.1f %10.1f %10.2f %10.1f\n",
+               source_names[source], (unsigned long) (state->size >> 20), page_size,
+               state->size * 1000.0 / mean, state->size * 1000.0 / best,
+               read_time / 1000.0 / READ_CALLS, (double) cached_time / CACHED_READ_CALLS);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS run_config(struct bench_state *state, UINTN size, UINT32 page_size) {
+    UINTN lz4_size;
+    UINT8 *lz4 = NULL;
+    UINT8 *data = create_boot_image(size, page_size);
+    if (!data) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EFI_STATUS err = EFI_OUT_OF_RESOURCES;
+    lz4 = lz4_compress_frame(data, size, &lz4_size);
+    if (!lz4) {
+        goto out;
+    }
+
+    err = write_image(state, IMAGE_NAME, data, size);
+    if (!err) {
+        err = write_image(state, LZ4_IMAGE_NAME, lz4, lz4_size);
+    }
+    if (err) {
+        goto out;
+    }
+
+    state->disk = host_map_file(state->image_path, &state->disk_size);
+    if (!state->disk) {
+        err = EFI_DEVICE_ERROR;
+        goto out;
+    }
+
+    state->data = data;
+    state->size = size;
+    mock_change_media(state->partitions[0], state->disk, state->disk_size);
+    mock_change_media(state->partitions[1], state->disk, state->disk_size);
+
+    for (UINTN source = 0; source < SOURCE_COUNT && !err; ++source) {
+        err = run_source(state, source, page_size);
+    }
+
+    host_unmap_file(state->disk, state->disk_size);
+    state->disk = NULL;
+
+out:
+    if (lz4) {
+        FreePool(lz4);
+    }
+    FreePool(data);
+    return err;
+}
+
+static BOOLEAN str_equal(const char *a, const char *b) {
+    for (; *a == *b; ++a, ++b) {
+        if (!*a) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOLEAN parse_number(const char *s, UINTN *value) {
+    *value = 0;
+    if (!*s) {
+        return FALSE;
+    }
+
+    for (; *s; ++s) {
+        if (*s < '0' || *s > '9') {
+            return FALSE;
+        }
+        *value = *value * 10 + (*s - '0');
+    }
+    return TRUE;
+}
+
+// Comma separated list of numbers (modified while parsing)
+static BOOLEAN parse_list(char *s, UINTN *values, UINTN *count) {
+    *count = 0;
+    for (char *p = s;; ++p) {
+        if (*p != ',' && *p) {
+            continue;
+        }
+
+        BOOLEAN last = !*p;
+        *p = 0;
+        if (*count == MAX_CONFIGS || !parse_number(s, &values[(*count)++])) {
+            return FALSE;
+        }
+        if (last) {
+            return TRUE;
+        }
+        s = p + 1;
+    }
+}
+
+static BOOLEAN parse_options(int argc, char **argv, struct bench_options *options) {
+    static char sizes[] = DEFAULT_SIZES, page_sizes[] = DEFAULT_PAGE_SIZES;
+    options->iterations = DEFAULT_ITERATIONS;
+    options->verify = FALSE;
+    options->cold = FALSE;
+    options->dir = NULL;
+    parse_list(sizes, options->sizes, &options->size_count);
+    parse_list(page_sizes, options->page_sizes, &options->page_size_count);
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (arg[0] != '-') {
+            if (options->dir) {
+                return FALSE;
+            }
+            options->dir = arg;
+        } else if (str_equal(arg, "-v")) {
+            options->verify = TRUE;
+        } else if (str_equal(arg, "-c")) {
+            options->cold = TRUE;
+        } else if (i + 1 == argc) {
+            return FALSE;
+        } else if (str_equal(arg, "-n")) {
+            if (!parse_number(argv[++i], &options->iterations) || !options->iterations) {
+                return FALSE;
+            }
+        } else if (str_equal(arg, "-s")) {
+            if (!parse_list(argv[++i], options->sizes, &options->size_count)) {
+                return FALSE;
+            }
+        } else if (str_equal(arg, "-p")) {
+            if (!parse_list(argv[++i], options->page_sizes, &options->page_size_count)) {
+                return FALSE;
+            }
+        } else {
+            return FALSE;
+        }
+    }
+
+    for (UINTN i = 0; i < options->page_size_count; ++i) {
+        UINTN page_size = options->page_sizes[i];
+        if (page_size < sizeof(struct android_boot_image_header) || (page_size & (page_size - 1))) {
+            return FALSE;
+        }
+    }
+    for (UINTN i = 0; i < options->size_count; ++i) {
+        if (!options->sizes[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+int main(int argc, char **argv) {
+    struct bench_options options;
+    if (!parse_options(argc, argv, &options)) {
+        host_print("Usage: %s [-n iterations] [-s sizes (MiB)] [-p page sizes] [-v] [-c] [directory]\n", argv[0]);
+        return 2;
+    }
+
+    UINT64 memory_size = MIN_MEMORY_SIZE;
+    for (UINTN i = 0; i < options.size_count; ++i) {
+        if (2 * ((UINT64) options.sizes[i] << 20) > memory_size) {
+            memory_size = 2 * ((UINT64) options.sizes[i] << 20);
+        }
+    }
+
+    EFI_STATUS err = mock_init(memory_size);
+    if (err) {
+        return 1;
+    }
+
+    char *temp_dir = NULL;
+    if (!options.dir) {
+        temp_dir = host_temp_dir();
+        if (!temp_dir) {
+            return 1;
+        }
+        options.dir = temp_dir;
+    }
+
+    struct bench_state state = {
+        .options = &options,
+        .loader = mock_loader_handle(),
+        .directory = mock_add_directory(options.dir),
+        .partitions = {
+            mock_add_disk(NULL, 0, BLOCK_SIZE, FALSE),
+            mock_add_disk(NULL, 0, BLOCK_SIZE, TRUE),
+        },
+        .image_path = join_path(options.dir, IMAGE_NAME),
+    };
+    if (!state.directory || !state.partitions[0] || !state.partitions[1] || !state.image_path) {
+        host_print("Failed to set up firmware mock\n");
+        return 1;
+    }
+
+    host_print("%-16s %6s %6s %10s %10s %10s %10s\n", "source", "MiB", "page",
+               "MB/s", "best MB/s", "read us", "cached ns");
+
+    for (UINTN s = 0; s < options.size_count && !err; ++s) {
+        for (UINTN p = 0; p < options.page_size_count && !err; ++p) {
+            err = run_config(&state, options.sizes[s] << 20, options.page_sizes[p]);
+        }
+    }
+
+    if (temp_dir) {
+        static const char *const files[] = { IMAGE_NAME, LZ4_IMAGE_NAME };
+        host_remove_dir(temp_dir, files, sizeof(files) / sizeof(*files));
+        host_free(temp_dir);
+    }
+
+    log_flush();
+    return err ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#define _GNU_SOURCE
+#include "host.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void host_print(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    fflush(stdout);
+}
+
+uint64_t host_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void host_sleep_us(uint64_t usec) {
+    struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+void *host_alloc(size_t size) {
+    return malloc(size);
+}
+
+void *host_realloc(void *p, size_t size) {
+    return realloc(p, size);
+}
+
+void host_free(void *p) {
+    free(p);
+}
+
+#define MEMORY_LIMIT  0x100000000ULL
+
+void *host_map_memory(uint64_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_32BIT, -1, 0);
+    if (p != MAP_FAILED) {
+        return p;
+    }
+
+    // MAP_32BIT is limited to 2 GiB (usually less is available), try just below 4 GiB instead
+    if (size < MEMORY_LIMIT) {
+        p = mmap((void*) (uintptr_t) (MEMORY_LIMIT - size), size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED && (uintptr_t) p + size <= MEMORY_LIMIT) {
+            return p;
+        }
+        if (p != MAP_FAILED) {
+            munmap(p, size);
+        }
+    }
+
+    fprintf(stderr, "Failed to map %" PRIu64 " MiB below 4 GiB\n", size >> 20);
+    return NULL;
+}
+
+void *host_map_file(const char *path, uint64_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return p;
+}
+
+void host_unmap_file(void *data, uint64_t size) {
+    munmap(data, size);
+}
+
+void host_drop_cache(const char *path, void *data, uint64_t size) {
+    madvise(data, size, MADV_DONTNEED);
+
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+int host_write_file(const char *path, const void *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    int ret = fwrite(data, 1, size, file) == size ? 0 : -1;
+    if (fclose(file)) {
+        ret = -1;
+    }
+    if (ret) {
+        perror(path);
+    }
+    return ret;
+}
+
+char *host_temp_dir(void) {
+    const char *tmp = getenv("TMPDIR");
+    char *path;
+    if (asprintf(&path, "%s/android-efi-bench.XXXXXX", tmp ? tmp : "/tmp") < 0) {
+        return NULL;
+    }
+
+    if (!mkdtemp(path)) {
+        perror(path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+void host_remove_dir(const char *path, const char *const *files, size_t count) {
+    int dir = open(path, O_RDONLY | O_DIRECTORY);
+    if (dir >= 0) {
+        for (size_t i = 0; i < count; ++i) {
+            unlinkat(dir, files[i], 0);
+        }
+        close(dir);
+    }
+    rmdir(path);
+}
+
+int host_open_dir(const char *path) {
+    return open(path, O_RDONLY | O_DIRECTORY);
+}
+
+int host_open(int dir, const char *path, int write, int create) {
+    if (!*path) {
+        return dup(dir);
+    }
+
+    int flags = (write ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0);
+    int fd = openat(dir, path, flags, 0644);
+    if (fd < 0 && errno == EISDIR) {
+        // Directories can be only opened read-only
+        fd = openat(dir, path, O_RDONLY | O_DIRECTORY);
+    }
+    return fd;
+}
+
+int host_close(int fd) {
+    return close(fd);
+}
+
+int host_info(int fd, struct host_file_info *info) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        return -1;
+    }
+
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+
+    info->size = st.st_size;
+    info->directory = S_ISDIR(st.st_mode);
+    info->writable = (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY;
+    info->year = tm.tm_year + 1900;
+    info->month = tm.tm_mon + 1;
+    info->day = tm.tm_mday;
+    info->hour = tm.tm_hour;
+    info->minute = tm.tm_min;
+    info->second = tm.tm_sec;
+    info->nanosecond = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+int64_t host_read(int fd, void *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = read(fd, (char*) buffer + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (!n) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+int64_t host_write(int fd, const void *buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = write(fd, (const char*) buffer + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+int64_t host_seek(int fd, uint64_t offset) {
+    if (offset == UINT64_MAX) {
+        return lseek(fd, 0, SEEK_END);
+    }
+    return lseek(fd, offset, SEEK_SET);
+}
+
+int64_t host_tell(int fd) {
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+int host_delete(int dir, const char *path) {
+    return unlinkat(dir, path, 0);
+}
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_BENCH_HOST_H
+#define ANDROID_EFI_BENCH_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host (libc) side of the firmware mock. The gnu-efi headers cannot be mixed with most
+ * libc headers, so everything that needs libc is implemented here using plain C types.
+ */
+
+void host_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+uint64_t host_time_ns(void);
+void host_sleep_us(uint64_t usec);
+
+void *host_alloc(size_t size);
+void *host_realloc(void *p, size_t size);
+void host_free(void *p);
+
+// Memory handed out by AllocatePages: Below 4 GiB, so the address can be used as physical address
+void *host_map_memory(uint64_t size);
+
+// Read-only mapping of a disk image, NULL on errors
+void *host_map_file(const char *path, uint64_t *size);
+void host_unmap_file(void *data, uint64_t size);
+// Remove a mapped file from the page cache, so it is read from the disk again
+void host_drop_cache(const char *path, void *data, uint64_t size);
+
+int host_write_file(const char *path, const void *data, size_t size);
+
+// Temporary directory for generated images, removed with host_remove_dir() (not recursive)
+char *host_temp_dir(void);
+void host_remove_dir(const char *path, const char *const *files, size_t count);
+
+struct host_file_info {
+    uint64_t size;
+    int directory;
+    int writable;
+    uint16_t year;
+    uint8_t month, day, hour, minute, second;
+    uint32_t nanosecond;
+};
+
+// Files relative to a directory on the host (all functions return -1 on errors)
+int host_open_dir(const char *path);
+int host_open(int dir, const char *path, int write, int create);
+int host_close(int fd);
+int host_info(int fd, struct host_file_info *info);
+int64_t host_read(int fd, void *buffer, size_t size);
+int64_t host_write(int fd, const void *buffer, size_t size);
+int64_t host_seek(int fd, uint64_t offset); // UINT64_MAX seeks to the end
+int64_t host_tell(int fd);
+int host_delete(int dir, const char *path);
+
+#endif //ANDROID_EFI_BENCH_HOST_H
@@ -0,0 +1,1299 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "mock.h"
+#include "host.h"
+#include "../protocol.h"
+#include <efilib.h>
+
+#define MAX_HANDLES      16
+#define MAX_PROTOCOLS    8
+#define MAX_ALLOCATIONS  256
+
+// Firmware usually reports descriptors that are larger than EFI_MEMORY_DESCRIPTOR
+#define DESCRIPTOR_SIZE  (sizeof(EFI_MEMORY_DESCRIPTOR) + 8)
+
+#define PRINT_BUFFER_SIZE  8192
+
+#define CONTAINER_OF(ptr, type, member) ((type*) ((UINT8*) (ptr) - __builtin_offsetof(type, member)))
+
+EFI_SYSTEM_TABLE *ST;
+EFI_BOOT_SERVICES *BS;
+EFI_RUNTIME_SERVICES *RT;
+
+// Usually provided by libefi
+EFI_GUID BlockIoProtocol = BLOCK_IO_PROTOCOL;
+EFI_GUID DiskIoProtocol = DISK_IO_PROTOCOL;
+EFI_GUID FileSystemProtocol = SIMPLE_FILE_SYSTEM_PROTOCOL;
+EFI_GUID GenericFileInfo = EFI_FILE_INFO_ID;
+
+static EFI_GUID DiskIo2Protocol = EFI_DISK_IO2_PROTOCOL_GUID;
+static EFI_GUID BlockIo2Protocol = EFI_BLOCK_IO2_PROTOCOL_GUID;
+
+static inline BOOLEAN guid_equal(const EFI_GUID *a, const EFI_GUID *b) {
+    return !CompareMem(a, b, sizeof(*a));
+}
+
+// Handles
+
+struct mock_handle {
+    struct {
+        EFI_GUID *guid;
+        VOID *interface;
+    } protocols[MAX_PROTOCOLS];
+    UINTN protocol_count;
+};
+
+static struct mock_handle handles[MAX_HANDLES];
+static UINTN handle_count;
+
+static struct mock_handle *add_handle(VOID) {
+    if (handle_count == MAX_HANDLES) {
+        return NULL;
+    }
+    return &handles[handle_count++];
+}
+
+static VOID add_protocol(struct mock_handle *handle, EFI_GUID *guid, VOID *interface) {
+    handle->protocols[handle->protocol_count].guid = guid;
+    handle->protocols[handle->protocol_count].interface = interface;
+    ++handle->protocol_count;
+}
+
+static VOID *find_protocol(EFI_HANDLE handle, const EFI_GUID *guid) {
+    for (UINTN i = 0; i < handle_count; ++i) {
+        if (handle != &handles[i]) {
+            continue;
+        }
+
+        for (UINTN p = 0; p < handles[i].protocol_count; ++p) {
+            if (guid_equal(handles[i].protocols[p].guid, guid)) {
+                return handles[i].protocols[p].interface;
+            }
+        }
+    }
+    return NULL;
+}
+
+static EFI_STATUS EFIAPI mock_handle_protocol(EFI_HANDLE handle, EFI_GUID *protocol, VOID **interface) {
+    VOID *p = find_protocol(handle, protocol);
+    if (!p) {
+        return EFI_UNSUPPORTED;
+    }
+
+    *interface = p;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_open_protocol(EFI_HANDLE handle, EFI_GUID *protocol, VOID **interface,
+                                            EFI_HANDLE agent, EFI_HANDLE controller, UINT32 attributes) {
+    (VOID) agent;
+    (VOID) controller;
+    (VOID) attributes;
+
+    VOID *p = find_protocol(handle, protocol);
+    if (!p) {
+        return EFI_UNSUPPORTED;
+    }
+
+    if (interface) {
+        *interface = p;
+    }
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_close_protocol(EFI_HANDLE handle, EFI_GUID *protocol,
+                                             EFI_HANDLE agent, EFI_HANDLE controller) {
+    (VOID) agent;
+    (VOID) controller;
+    return find_protocol(handle, protocol) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+static UINTN find_handles(EFI_LOCATE_SEARCH_TYPE type, const EFI_GUID *protocol, EFI_HANDLE *buffer) {
+    UINTN count = 0;
+    for (UINTN i = 0; i < handle_count; ++i) {
+        if (type == ByProtocol && !find_protocol(&handles[i], protocol)) {
+            continue;
+        }
+
+        if (buffer) {
+            buffer[count] = &handles[i];
+        }
+        ++count;
+    }
+    return count;
+}
+
+static EFI_STATUS EFIAPI mock_locate_handle(EFI_LOCATE_SEARCH_TYPE type, EFI_GUID *protocol, VOID *key,
+                                            UINTN *buffer_size, EFI_HANDLE *buffer) {
+    (VOID) key;
+    if (type != AllHandles && type != ByProtocol) {
+        return EFI_UNSUPPORTED;
+    }
+
+    UINTN size = find_handles(type, protocol, NULL) * sizeof(EFI_HANDLE);
+    if (!size) {
+        return EFI_NOT_FOUND;
+    }
+    if (*buffer_size < size) {
+        *buffer_size = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    *buffer_size = size;
+    find_handles(type, protocol, buffer);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE type, EFI_GUID *protocol, VOID *key,
+                                                   UINTN *count, EFI_HANDLE **buffer) {
+    (VOID) key;
+    if (type != AllHandles && type != ByProtocol) {
+        return EFI_UNSUPPORTED;
+    }
+
+    *count = find_handles(type, protocol, NULL);
+    if (!*count) {
+        return EFI_NOT_FOUND;
+    }
+
+    *buffer = AllocatePool(*count * sizeof(EFI_HANDLE));
+    if (!*buffer) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    find_handles(type, protocol, *buffer);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_locate_protocol(EFI_GUID *protocol, VOID *registration, VOID **interface) {
+    (VOID) registration;
+    for (UINTN i = 0; i < handle_count; ++i) {
+        VOID *p = find_protocol(&handles[i], protocol);
+        if (p) {
+            *interface = p;
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_locate_device_path(EFI_GUID *protocol, EFI_DEVICE_PATH **device_path,
+                                                 EFI_HANDLE *device) {
+    (VOID) protocol;
+    (VOID) device_path;
+    (VOID) device;
+    return EFI_NOT_FOUND;
+}
+
+// Memory: Allocations are kept sorted by address, the rest of the mapping is free
+
+struct allocation {
+    EFI_PHYSICAL_ADDRESS start;
+    UINT64 pages;
+};
+
+static UINT8 *memory;
+static UINT64 memory_size;
+
+static struct allocation allocations[MAX_ALLOCATIONS];
+static UINTN allocation_count;
+static UINTN map_key;
+
+static inline EFI_PHYSICAL_ADDRESS memory_start(VOID) {
+    return (UINTN) memory;
+}
+
+static inline EFI_PHYSICAL_ADDRESS memory_end(VOID) {
+    return (UINTN) memory + memory_size;
+}
+
+static inline EFI_PHYSICAL_ADDRESS allocation_end(const struct allocation *a) {
+    return a->start + a->pages * EFI_PAGE_SIZE;
+}
+
+// Finds the position for a new allocation, FALSE if it overlaps with an existing one
+static BOOLEAN find_insert_position(EFI_PHYSICAL_ADDRESS start, UINT64 pages, UINTN *index) {
+    EFI_PHYSICAL_ADDRESS end = start + pages * EFI_PAGE_SIZE;
+    if (start < memory_start() || end > memory_end() || end <= start) {
+        return FALSE;
+    }
+
+    UINTN i = 0;
+    for (; i < allocation_count && allocations[i].start < end; ++i) {
+        if (allocation_end(&allocations[i]) > start) {
+            return FALSE;
+        }
+    }
+
+    *index = i;
+    return TRUE;
+}
+
+// Highest free range below max, like most firmware implementations
+static BOOLEAN find_free_pages(UINT64 pages, EFI_PHYSICAL_ADDRESS max, EFI_PHYSICAL_ADDRESS *addr) {
+    UINT64 size = pages * EFI_PAGE_SIZE;
+    EFI_PHYSICAL_ADDRESS limit = max >= memory_end() ? memory_end() : (max + 1) & ~EFI_PAGE_MASK;
+    EFI_PHYSICAL_ADDRESS end = memory_end();
+
+    for (UINTN i = allocation_count;; --i) {
+        EFI_PHYSICAL_ADDRESS start = i ? allocation_end(&allocations[i - 1]) : memory_start();
+        EFI_PHYSICAL_ADDRESS top = end < limit ? end : limit;
+        if (top > start && top - start >= size) {
+            *addr = top - size;
+            return TRUE;
+        }
+
+        if (!i) {
+            return FALSE;
+        }
+        end = allocations[i - 1].start;
+    }
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memory_type,
+                                             UINTN pages, EFI_PHYSICAL_ADDRESS *addr) {
+    (VOID) memory_type;
+    if (!pages) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (allocation_count == MAX_ALLOCATIONS) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    EFI_PHYSICAL_ADDRESS start;
+    switch (type) {
+        case AllocateAnyPages:
+            if (!find_free_pages(pages, (EFI_PHYSICAL_ADDRESS) -1, &start)) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+            break;
+        case AllocateMaxAddress:
+            if (!find_free_pages(pages, *addr, &start)) {
+                return EFI_NOT_FOUND;
+            }
+            break;
+        case AllocateAddress:
+            if (*addr & EFI_PAGE_MASK) {
+                return EFI_INVALID_PARAMETER;
+            }
+            start = *addr;
+            break;
+        default:
+            return EFI_INVALID_PARAMETER;
+    }
+
+    UINTN index;
+    if (!find_insert_position(start, pages, &index)) {
+        return EFI_NOT_FOUND;
+    }
+
+    CopyMem(&allocations[index + 1], &allocations[index], (allocation_count - index) * sizeof(*allocations));
+    allocations[index].start = start;
+    allocations[index].pages = pages;
+    ++allocation_count;
+    ++map_key;
+
+    *addr = start;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_free_pages_at(EFI_PHYSICAL_ADDRESS addr, UINTN pages) {
+    for (UINTN i = 0; i < allocation_count; ++i) {
+        if (allocations[i].start == addr && allocations[i].pages == pages) {
+            --allocation_count;
+            CopyMem(&allocations[i], &allocations[i + 1], (allocation_count - i) * sizeof(*allocations));
+            ++map_key;
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_NOT_FOUND;
+}
+
+VOID mock_free_pages(VOID) {
+    allocation_count = 0;
+    ++map_key;
+}
+
+static UINT8 *add_descriptor(UINT8 *p, EFI_MEMORY_TYPE type, EFI_PHYSICAL_ADDRESS start, EFI_PHYSICAL_ADDRESS end) {
+    EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR*) p;
+    ZeroMem(desc, DESCRIPTOR_SIZE);
+    desc->Type = type;
+    desc->PhysicalStart = start;
+    desc->NumberOfPages = (end - start) / EFI_PAGE_SIZE;
+    desc->Attribute = EFI_MEMORY_WB;
+    return p + DESCRIPTOR_SIZE;
+}
+
+static EFI_STATUS EFIAPI mock_get_memory_map(UINTN *map_size, EFI_MEMORY_DESCRIPTOR *map, UINTN *key,
+                                             UINTN *desc_size, UINT32 *desc_version) {
+    // There is at most one free range before each allocation and one at the end
+    UINTN required = (allocation_count * 2 + 1) * DESCRIPTOR_SIZE;
+    *desc_size = DESCRIPTOR_SIZE;
+    *desc_version = EFI_MEMORY_DESCRIPTOR_VERSION;
+    if (*map_size < required) {
+        *map_size = required;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    UINT8 *p = (UINT8*) map;
+    EFI_PHYSICAL_ADDRESS addr = memory_start();
+    for (UINTN i = 0; i < allocation_count; ++i) {
+        if (allocations[i].start > addr) {
+            p = add_descriptor(p, EfiConventionalMemory, addr, allocations[i].start);
+        }
+
+        addr = allocation_end(&allocations[i]);
+        p = add_descriptor(p, EfiLoaderData, allocations[i].start, addr);
+    }
+    if (memory_end() > addr) {
+        p = add_descriptor(p, EfiConventionalMemory, addr, memory_end());
+    }
+
+    *map_size = p - (UINT8*) map;
+    *key = map_key;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_allocate_pool(EFI_MEMORY_TYPE type, UINTN size, VOID **buffer) {
+    (VOID) type;
+    *buffer = AllocatePool(size);
+    return *buffer ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI mock_free_pool(VOID *buffer) {
+    FreePool(buffer);
+    return EFI_SUCCESS;
+}
+
+// Events
+
+struct mock_event {
+    BOOLEAN signaled;
+
+    // Asynchronous read that is completed when the event is waited for
+    struct efi_io2_token *token;
+    const UINT8 *source;
+    VOID *buffer;
+    UINTN size;
+};
+
+static VOID complete_event(struct mock_event *event) {
+    if (event->token) {
+        CopyMem(event->buffer, event->source, event->size);
+        event->token->transaction_status = EFI_SUCCESS;
+        event->token = NULL;
+        event->signaled = TRUE;
+    }
+}
+
+static EFI_STATUS EFIAPI mock_create_event(UINT32 type, EFI_TPL tpl, EFI_EVENT_NOTIFY notify,
+                                           VOID *context, EFI_EVENT *event) {
+    (VOID) type;
+    (VOID) tpl;
+    (VOID) context;
+    if (notify) {
+        return EFI_UNSUPPORTED;
+    }
+
+    *event = AllocateZeroPool(sizeof(struct mock_event));
+    return *event ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI mock_close_event(EFI_EVENT event) {
+    complete_event(event);
+    FreePool(event);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_signal_event(EFI_EVENT event) {
+    ((struct mock_event*) event)->signaled = TRUE;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_check_event(EFI_EVENT event) {
+    struct mock_event *e = event;
+    complete_event(e);
+    if (!e->signaled) {
+        return EFI_NOT_READY;
+    }
+
+    e->signaled = FALSE;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_wait_for_event(UINTN count, EFI_EVENT *events, UINTN *index) {
+    for (UINTN i = 0; i < count; ++i) {
+        if (!mock_check_event(events[i])) {
+            *index = i;
+            return EFI_SUCCESS;
+        }
+    }
+
+    // None of the events will ever be signaled
+    return EFI_NOT_READY;
+}
+
+static EFI_STATUS EFIAPI mock_stall(UINTN usec) {
+    host_sleep_us(usec);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_calculate_crc32(VOID *data, UINTN size, UINT32 *crc32) {
+    UINT32 crc = 0xFFFFFFFF;
+    for (const UINT8 *p = data, *end = p + size; p < end; ++p) {
+        crc ^= *p;
+        for (UINTN bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+
+    *crc32 = ~crc;
+    return EFI_SUCCESS;
+}
+
+// Variables are not stored
+
+static EFI_STATUS EFIAPI mock_get_variable(CHAR16 *name, EFI_GUID *vendor, UINT32 *attributes,
+                                           UINTN *size, VOID *data) {
+    (VOID) name;
+    (VOID) vendor;
+    (VOID) attributes;
+    (VOID) size;
+    (VOID) data;
+    return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI mock_set_variable(CHAR16 *name, EFI_GUID *vendor, UINT32 attributes,
+                                           UINTN size, VOID *data) {
+    (VOID) name;
+    (VOID) vendor;
+    (VOID) attributes;
+    (VOID) size;
+    (VOID) data;
+    return EFI_SUCCESS;
+}
+
+// Console output (UTF-8 on the host)
+
+static EFI_STATUS EFIAPI mock_output_string(SIMPLE_TEXT_OUTPUT_INTERFACE *this, CHAR16 *s) {
+    (VOID) this;
+
+    char buffer[256];
+    UINTN len = 0;
+    for (; *s; ++s) {
+        if (len > sizeof(buffer) - 4) {
+            buffer[len] = 0;
+            host_print("%s", buffer);
+            len = 0;
+        }
+
+        CHAR16 c = *s;
+        if (c < 0x80) {
+            buffer[len++] = (char) c;
+        } else if (c < 0x800) {
+            buffer[len++] = (char) (0xC0 | c >> 6);
+            buffer[len++] = (char) (0x80 | (c & 0x3F));
+        } else {
+            buffer[len++] = (char) (0xE0 | c >> 12);
+            buffer[len++] = (char) (0x80 | ((c >> 6) & 0x3F));
+            buffer[len++] = (char) (0x80 | (c & 0x3F));
+        }
+    }
+
+    buffer[len] = 0;
+    host_print("%s", buffer);
+    return EFI_SUCCESS;
+}
+
+// Block devices
+
+struct mock_disk {
+    EFI_BLOCK_IO block_io;
+    EFI_BLOCK_IO_MEDIA media;
+    EFI_DISK_IO disk_io;
+    struct efi_block_io2 block_io2;
+    struct efi_disk_io2 disk_io2;
+
+    const UINT8 *data;
+    UINT64 size;
+};
+
+static EFI_STATUS check_read(const struct mock_disk *disk, UINT32 media_id, UINT64 offset, UINTN size) {
+    if (media_id != disk->media.MediaId) {
+        return EFI_MEDIA_CHANGED;
+    }
+    if (offset > disk->size || size > disk->size - offset) {
+        return EFI_INVALID_PARAMETER;
+    }
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS check_read_blocks(const struct mock_disk *disk, UINT32 media_id, EFI_LBA lba,
+                                    UINTN size, const VOID *buffer) {
+    if (size % disk->media.BlockSize) {
+        return EFI_BAD_BUFFER_SIZE;
+    }
+    if (disk->media.IoAlign > 1 && ((UINTN) buffer & (disk->media.IoAlign - 1))) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (lba > disk->media.LastBlock) {
+        return EFI_INVALID_PARAMETER;
+    }
+    return check_read(disk, media_id, lba * disk->media.BlockSize, size);
+}
+
+// Reads with an event are completed when the event is waited for
+static EFI_STATUS submit_read(const struct mock_disk *disk, UINT64 offset, struct efi_io2_token *token,
+                              UINTN size, VOID *buffer) {
+    if (!token) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (!token->event) {
+        CopyMem(buffer, &disk->data[offset], size);
+        token->transaction_status = EFI_SUCCESS;
+        return EFI_SUCCESS;
+    }
+
+    struct mock_event *event = token->event;
+    complete_event(event);
+    event->signaled = FALSE;
+    event->token = token;
+    event->source = &disk->data[offset];
+    event->buffer = buffer;
+    event->size = size;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_read_blocks(EFI_BLOCK_IO *this, UINT32 media_id, EFI_LBA lba,
+                                          UINTN size, VOID *buffer) {
+    struct mock_disk *disk = CONTAINER_OF(this, struct mock_disk, block_io);
+    EFI_STATUS err = check_read_blocks(disk, media_id, lba, size, buffer);
+    if (!err) {
+        CopyMem(buffer, &disk->data[lba * disk->media.BlockSize], size);
+    }
+    return err;
+}
+
+static EFI_STATUS EFIAPI mock_read_disk(EFI_DISK_IO *this, UINT32 media_id, UINT64 offset,
+                                        UINTN size, VOID *buffer) {
+    struct mock_disk *disk = CONTAINER_OF(this, struct mock_disk, disk_io);
+    EFI_STATUS err = check_read(disk, media_id, offset, size);
+    if (!err) {
+        CopyMem(buffer, &disk->data[offset], size);
+    }
+    return err;
+}
+
+static EFI_STATUS EFIAPI mock_read_blocks_ex(struct efi_block_io2 *this, UINT32 media_id, EFI_LBA lba,
+                                             struct efi_io2_token *token, UINTN size, VOID *buffer) {
+    struct mock_disk *disk = CONTAINER_OF(this, struct mock_disk, block_io2);
+    EFI_STATUS err = check_read_blocks(disk, media_id, lba, size, buffer);
+    if (err) {
+        return err;
+    }
+    return submit_read(disk, lba * disk->media.BlockSize, token, size, buffer);
+}
+
+static EFI_STATUS EFIAPI mock_read_disk_ex(struct efi_disk_io2 *this, UINT32 media_id, UINT64 offset,
+                                           struct efi_io2_token *token, UINTN size, VOID *buffer) {
+    struct mock_disk *disk = CONTAINER_OF(this, struct mock_disk, disk_io2);
+    EFI_STATUS err = check_read(disk, media_id, offset, size);
+    if (err) {
+        return err;
+    }
+    return submit_read(disk, offset, token, size, buffer);
+}
+
+static VOID set_disk_data(struct mock_disk *disk, const VOID *data, UINT64 size) {
+    disk->data = data;
+    disk->size = size;
+    disk->media.LastBlock = size / disk->media.BlockSize - 1;
+}
+
+EFI_HANDLE mock_add_disk(const VOID *data, UINT64 size, UINT32 block_size, BOOLEAN async) {
+    struct mock_handle *handle = add_handle();
+    if (!handle) {
+        return NULL;
+    }
+
+    struct mock_disk *disk = AllocateZeroPool(sizeof(*disk));
+    if (!disk) {
+        return NULL;
+    }
+
+    disk->media.MediaId = 1;
+    disk->media.MediaPresent = TRUE;
+    disk->media.LogicalPartition = TRUE;
+    disk->media.ReadOnly = TRUE;
+    disk->media.BlockSize = block_size;
+    set_disk_data(disk, data, size);
+
+    disk->block_io.Revision = EFI_BLOCK_IO_INTERFACE_REVISION;
+    disk->block_io.Media = &disk->media;
+    disk->block_io.ReadBlocks = mock_read_blocks;
+    disk->disk_io.Revision = EFI_DISK_IO_INTERFACE_REVISION;
+    disk->disk_io.ReadDisk = mock_read_disk;
+    add_protocol(handle, &BlockIoProtocol, &disk->block_io);
+    add_protocol(handle, &DiskIoProtocol, &disk->disk_io);
+
+    if (async) {
+        disk->block_io2.media = &disk->media;
+        disk->block_io2.read_blocks_ex = mock_read_blocks_ex;
+        disk->disk_io2.read_disk_ex = mock_read_disk_ex;
+        add_protocol(handle, &BlockIo2Protocol, &disk->block_io2);
+        add_protocol(handle, &DiskIo2Protocol, &disk->disk_io2);
+    }
+
+    return handle;
+}
+
+VOID mock_change_media(EFI_HANDLE handle, const VOID *data, UINT64 size) {
+    EFI_BLOCK_IO *block_io = find_protocol(handle, &BlockIoProtocol);
+    if (block_io) {
+        struct mock_disk *disk = CONTAINER_OF(block_io, struct mock_disk, block_io);
+        set_disk_data(disk, data, size);
+        ++disk->media.MediaId;
+    }
+}
+
+// File system backed by a directory on the host (directories cannot be listed)
+
+struct mock_file_system {
+    EFI_FILE_IO_INTERFACE io;
+    int root;
+};
+
+struct mock_file {
+    EFI_FILE file;
+    struct mock_file_system *fs;
+    int fd;
+    char *path; // Relative to the root directory, empty for the root directory
+};
+
+static inline struct mock_file *mock_file(EFI_FILE *file) {
+    return CONTAINER_OF(file, struct mock_file, file);
+}
+
+static EFI_STATUS new_file(struct mock_file_system *fs, int fd, char *path, EFI_FILE **handle);
+
+// Converts a path (relative to dir, or absolute) to a host path relative to the root directory
+static char *file_path(const struct mock_file *dir, const CHAR16 *name) {
+    UINTN dir_len = 0;
+    if (*name != L'\\') {
+        dir_len = strlena((const CHAR8*) dir->path);
+    }
+
+    char *path = AllocatePool(dir_len + 1 + StrLen(name) + 1);
+    if (!path) {
+        return NULL;
+    }
+
+    char *p = path;
+    if (dir_len) {
+        CopyMem(p, dir->path, dir_len);
+        p += dir_len;
+        *p++ = '/';
+    }
+    for (; *name; ++name) {
+        *p++ = *name == L'\\' ? '/' : *name < 0x80 ? (char) *name : '?';
+    }
+    *p = 0;
+
+    // Host paths must stay relative to the root directory
+    UINTN skip = 0;
+    while (path[skip] == '/') {
+        ++skip;
+    }
+    CopyMem(path, &path[skip], p - path - skip + 1);
+    return path;
+}
+
+static EFI_STATUS EFIAPI mock_file_open(EFI_FILE *this, EFI_FILE **handle, CHAR16 *name,
+                                        UINT64 mode, UINT64 attributes) {
+    (VOID) attributes;
+
+    struct mock_file *dir = mock_file(this);
+    char *path = file_path(dir, name);
+    if (!path) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    int fd = host_open(dir->fs->root, path, mode & EFI_FILE_MODE_WRITE ? 1 : 0, mode & EFI_FILE_MODE_CREATE ? 1 : 0);
+    if (fd < 0) {
+        FreePool(path);
+        return EFI_NOT_FOUND;
+    }
+
+    return new_file(dir->fs, fd, path, handle);
+}
+
+static EFI_STATUS EFIAPI mock_file_close(EFI_FILE *this) {
+    struct mock_file *file = mock_file(this);
+    host_close(file->fd);
+    FreePool(file->path);
+    FreePool(file);
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_delete(EFI_FILE *this) {
+    struct mock_file *file = mock_file(this);
+    int ret = host_delete(file->fs->root, file->path);
+    mock_file_close(this);
+    return ret ? EFI_WARN_DELETE_FAILURE : EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_read(EFI_FILE *this, UINTN *size, VOID *buffer) {
+    struct mock_file *file = mock_file(this);
+    struct host_file_info info;
+    if (host_info(file->fd, &info)) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    if (info.directory) {
+        *size = 0;
+        return EFI_SUCCESS;
+    }
+
+    INT64 n = host_read(file->fd, buffer, *size);
+    if (n < 0) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    *size = n;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_write(EFI_FILE *this, UINTN *size, VOID *buffer) {
+    struct mock_file *file = mock_file(this);
+    struct host_file_info info;
+    if (host_info(file->fd, &info)) {
+        return EFI_DEVICE_ERROR;
+    }
+    if (info.directory) {
+        return EFI_UNSUPPORTED;
+    }
+    if (!info.writable) {
+        return EFI_ACCESS_DENIED;
+    }
+
+    INT64 n = host_write(file->fd, buffer, *size);
+    if (n < 0) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    *size = n;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_get_position(EFI_FILE *this, UINT64 *position) {
+    INT64 pos = host_tell(mock_file(this)->fd);
+    if (pos < 0) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    *position = pos;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_set_position(EFI_FILE *this, UINT64 position) {
+    return host_seek(mock_file(this)->fd, position) < 0 ? EFI_UNSUPPORTED : EFI_SUCCESS;
+}
+
+static VOID set_time(EFI_TIME *time, const struct host_file_info *info) {
+    ZeroMem(time, sizeof(*time));
+    time->Year = info->year;
+    time->Month = info->month;
+    time->Day = info->day;
+    time->Hour = info->hour;
+    time->Minute = info->minute;
+    time->Second = info->second;
+    time->Nanosecond = info->nanosecond;
+}
+
+static EFI_STATUS EFIAPI mock_file_get_info(EFI_FILE *this, EFI_GUID *type, UINTN *size, VOID *buffer) {
+    if (!guid_equal(type, &GenericFileInfo)) {
+        return EFI_UNSUPPORTED;
+    }
+
+    struct mock_file *file = mock_file(this);
+    struct host_file_info host_info_data;
+    if (host_info(file->fd, &host_info_data)) {
+        return EFI_DEVICE_ERROR;
+    }
+
+    // Name of the file without its directory
+    const char *name = file->path;
+    for (const char *p = file->path; *p; ++p) {
+        if (*p == '/') {
+            name = p + 1;
+        }
+    }
+
+    UINTN name_len = strlena((const CHAR8*) name);
+    UINTN required = SIZE_OF_EFI_FILE_INFO + (name_len + 1) * sizeof(CHAR16);
+    if (*size < required) {
+        *size = required;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    EFI_FILE_INFO *info = buffer;
+    ZeroMem(info, required);
+    info->Size = required;
+    info->FileSize = host_info_data.size;
+    info->PhysicalSize = host_info_data.size;
+    set_time(&info->CreateTime, &host_info_data);
+    set_time(&info->LastAccessTime, &host_info_data);
+    set_time(&info->ModificationTime, &host_info_data);
+    info->Attribute = host_info_data.directory ? EFI_FILE_DIRECTORY : 0;
+    for (UINTN i = 0; i < name_len; ++i) {
+        info->FileName[i] = (UINT8) name[i];
+    }
+
+    *size = required;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_file_set_info(EFI_FILE *this, EFI_GUID *type, UINTN size, VOID *buffer) {
+    (VOID) this;
+    (VOID) type;
+    (VOID) size;
+    (VOID) buffer;
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI mock_file_flush(EFI_FILE *this) {
+    (VOID) this;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS new_file(struct mock_file_system *fs, int fd, char *path, EFI_FILE **handle) {
+    struct mock_file *file = AllocateZeroPool(sizeof(*file));
+    if (!file) {
+        host_close(fd);
+        FreePool(path);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    file->fs = fs;
+    file->fd = fd;
+    file->path = path;
+
+    file->file.Revision = EFI_FILE_HANDLE_REVISION;
+    file->file.Open = mock_file_open;
+    file->file.Close = mock_file_close;
+    file->file.Delete = mock_file_delete;
+    file->file.Read = mock_file_read;
+    file->file.Write = mock_file_write;
+    file->file.GetPosition = mock_file_get_position;
+    file->file.SetPosition = mock_file_set_position;
+    file->file.GetInfo = mock_file_get_info;
+    file->file.SetInfo = mock_file_set_info;
+    file->file.Flush = mock_file_flush;
+
+    *handle = &file->file;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI mock_open_volume(EFI_FILE_IO_INTERFACE *this, EFI_FILE **root) {
+    struct mock_file_system *fs = CONTAINER_OF(this, struct mock_file_system, io);
+    char *path = AllocateZeroPool(1);
+    if (!path) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    int fd = host_open(fs->root, path, 0, 0);
+    if (fd < 0) {
+        FreePool(path);
+        return EFI_DEVICE_ERROR;
+    }
+
+    return new_file(fs, fd, path, root);
+}
+
+EFI_HANDLE mock_add_directory(const char *path) {
+    struct mock_handle *handle = add_handle();
+    if (!handle) {
+        return NULL;
+    }
+
+    struct mock_file_system *fs = AllocateZeroPool(sizeof(*fs));
+    if (!fs) {
+        return NULL;
+    }
+
+    fs->root = host_open_dir(path);
+    if (fs->root < 0) {
+        FreePool(fs);
+        return NULL;
+    }
+
+    fs->io.Revision = EFI_FILE_IO_INTERFACE_REVISION;
+    fs->io.OpenVolume = mock_open_volume;
+    add_protocol(handle, &FileSystemProtocol, &fs->io);
+    return handle;
+}
+
+// Firmware tables
+
+static SIMPLE_TEXT_OUTPUT_INTERFACE console = {
+    .OutputString = mock_output_string,
+};
+
+static EFI_BOOT_SERVICES boot_services = {
+    .AllocatePages = mock_allocate_pages,
+    .FreePages = mock_free_pages_at,
+    .GetMemoryMap = mock_get_memory_map,
+    .AllocatePool = mock_allocate_pool,
+    .FreePool = mock_free_pool,
+    .CreateEvent = mock_create_event,
+    .WaitForEvent = mock_wait_for_event,
+    .SignalEvent = mock_signal_event,
+    .CloseEvent = mock_close_event,
+    .CheckEvent = mock_check_event,
+    .HandleProtocol = mock_handle_protocol,
+    .LocateHandle = mock_locate_handle,
+    .LocateDevicePath = mock_locate_device_path,
+    .Stall = mock_stall,
+    .OpenProtocol = mock_open_protocol,
+    .CloseProtocol = mock_close_protocol,
+    .LocateHandleBuffer = mock_locate_handle_buffer,
+    .LocateProtocol = mock_locate_protocol,
+    .CalculateCrc32 = mock_calculate_crc32,
+};
+
+static EFI_RUNTIME_SERVICES runtime_services = {
+    .GetVariable = mock_get_variable,
+    .SetVariable = mock_set_variable,
+};
+
+static EFI_SYSTEM_TABLE system_table = {
+    .ConOut = &console,
+    .BootServices = &boot_services,
+    .RuntimeServices = &runtime_services,
+};
+
+EFI_STATUS mock_init(UINT64 size) {
+    memory = host_map_memory(size);
+    if (!memory) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    memory_size = size & ~EFI_PAGE_MASK;
+
+    ST = &system_table;
+    BS = &boot_services;
+    RT = &runtime_services;
+
+    // The first handle is the loader itself
+    handle_count = 1;
+    return EFI_SUCCESS;
+}
+
+EFI_HANDLE mock_loader_handle(VOID) {
+    return &handles[0];
+}
+
+/*
+ * Library functions (subset of libefi). libefi itself cannot be linked into a host
+ * program since it provides its own (slow) memcpy() and memset().
+ */
+
+VOID *AllocatePool(UINTN size) {
+    return host_alloc(size ? size : 1);
+}
+
+VOID *AllocateZeroPool(UINTN size) {
+    VOID *p = AllocatePool(size);
+    if (p) {
+        ZeroMem(p, size);
+    }
+    return p;
+}
+
+// Same semantics as libefi: The old pool is always freed
+VOID *ReallocatePool(VOID *old_pool, UINTN old_size, UINTN new_size) {
+    VOID *new_pool = new_size ? AllocatePool(new_size) : NULL;
+    if (old_pool) {
+        if (new_pool) {
+            CopyMem(new_pool, old_pool, old_size < new_size ? old_size : new_size);
+        }
+        FreePool(old_pool);
+    }
+    return new_pool;
+}
+
+VOID FreePool(VOID *p) {
+    host_free(p);
+}
+
+VOID CopyMem(VOID *dest, CONST VOID *src, UINTN len) {
+    __builtin_memmove(dest, src, len);
+}
+
+VOID SetMem(VOID *buffer, UINTN size, UINT8 value) {
+    __builtin_memset(buffer, value, size);
+}
+
+VOID ZeroMem(VOID *buffer, UINTN size) {
+    __builtin_memset(buffer, 0, size);
+}
+
+INTN CompareMem(CONST VOID *dest, CONST VOID *src, UINTN len) {
+    return __builtin_memcmp(dest, src, len);
+}
+
+UINTN StrLen(CONST CHAR16 *s) {
+    UINTN len = 0;
+    while (s[len]) {
+        ++len;
+    }
+    return len;
+}
+
+UINTN strlena(CONST CHAR8 *s) {
+    UINTN len = 0;
+    while (s[len]) {
+        ++len;
+    }
+    return len;
+}
+
+UINT64 MultU64x32(UINT64 multiplicand, UINTN multiplier) {
+    return multiplicand * multiplier;
+}
+
+UINT64 DivU64x32(UINT64 dividend, UINTN divisor, UINTN *remainder) {
+    if (remainder) {
+        *remainder = dividend % divisor;
+    }
+    return dividend / divisor;
+}
+
+EFI_FILE_HANDLE LibOpenRoot(EFI_HANDLE device) {
+    EFI_FILE_IO_INTERFACE *volume;
+    EFI_STATUS err = uefi_call_wrapper(BS->HandleProtocol, 3, device, &FileSystemProtocol, (VOID**) &volume);
+    if (err) {
+        return NULL;
+    }
+
+    EFI_FILE_HANDLE root;
+    err = uefi_call_wrapper(volume->OpenVolume, 2, volume, &root);
+    return err ? NULL : root;
+}
+
+EFI_STATUS LibLocateProtocol(EFI_GUID *protocol, VOID **interface) {
+    return uefi_call_wrapper(BS->LocateProtocol, 3, protocol, NULL, interface);
+}
+
+// Formatting: %d, %u, %x, %X, %p, %c, %s, %a, %r, %g (with l, width, 0 and -)
+
+struct print_state {
+    CHAR16 *str;
+    UINTN len;
+    UINTN max; // Without terminator
+};
+
+static const CHAR16 *status_strings[] = {
+    L"Success", L"Load Error", L"Invalid Parameter", L"Unsupported", L"Bad Buffer Size",
+    L"Buffer Too Small", L"Not Ready", L"Device Error", L"Write Protected", L"Out of Resources",
+    L"Volume Corrupt", L"Volume Full", L"No Media", L"Media changed", L"Not Found",
+    L"Access Denied", L"No Response", L"No mapping", L"Time out", L"Not started",
+    L"Already started", L"Aborted", L"ICMP Error", L"TFTP Error", L"Protocol Error",
+    L"Incompatible Version", L"Security Violation", L"CRC Error", L"End of Media", NULL,
+    NULL, L"End of File",
+};
+
+static inline VOID print_char(struct print_state *ps, CHAR16 c) {
+    if (ps->len < ps->max) {
+        ps->str[ps->len++] = c;
+    }
+}
+
+static UINTN format_number(CHAR16 *buffer, UINT64 value, UINTN base, BOOLEAN upper, BOOLEAN negative) {
+    const CHAR16 *digits = upper ? L"0123456789ABCDEF" : L"0123456789abcdef";
+    CHAR16 reversed[24];
+    UINTN n = 0;
+    do {
+        reversed[n++] = digits[value % base];
+        value /= base;
+    } while (value);
+
+    UINTN len = 0;
+    if (negative) {
+        buffer[len++] = L'-';
+    }
+    while (n) {
+        buffer[len++] = reversed[--n];
+    }
+    buffer[len] = 0;
+    return len;
+}
+
+static UINTN format_hex(CHAR16 *buffer, UINT64 value, UINTN digits) {
+    for (UINTN i = digits; i--;) {
+        buffer[i] = L"0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    }
+    return digits;
+}
+
+static UINTN format_guid(CHAR16 *buffer, const EFI_GUID *guid) {
+    UINTN len = format_hex(buffer, guid->Data1, 8);
+    buffer[len++] = L'-';
+    len += format_hex(&buffer[len], guid->Data2, 4);
+    buffer[len++] = L'-';
+    len += format_hex(&buffer[len], guid->Data3, 4);
+    buffer[len++] = L'-';
+    for (UINTN i = 0; i < 8; ++i) {
+        if (i == 2) {
+            buffer[len++] = L'-';
+        }
+        len += format_hex(&buffer[len], guid->Data4[i], 2);
+    }
+    buffer[len] = 0;
+    return len;
+}
+
+static UINTN format_status(CHAR16 *buffer, EFI_STATUS status) {
+    UINTN code = status & ~EFI_ERROR_MASK;
+    if ((!code || EFI_ERROR(status)) && code < sizeof(status_strings) / sizeof(*status_strings)
+            && status_strings[code]) {
+        const CHAR16 *s = status_strings[code];
+        UINTN len = StrLen(s);
+        CopyMem(buffer, s, (len + 1) * sizeof(CHAR16));
+        return len;
+    }
+    return format_hex(buffer, status, 16);
+}
+
+UINTN VSPrint(CHAR16 *str, UINTN str_size, CONST CHAR16 *fmt, va_list args) {
+    struct print_state ps = { str, 0, str_size ? str_size / sizeof(CHAR16) - 1 : (UINTN) -1 };
+
+    for (; *fmt; ++fmt) {
+        if (*fmt != L'%') {
+            print_char(&ps, *fmt);
+            continue;
+        }
+
+        BOOLEAN left = FALSE, zero = FALSE, is_long = FALSE;
+        UINTN width = 0;
+        for (++fmt;; ++fmt) {
+            if (*fmt == L'-') {
+                left = TRUE;
+            } else if (*fmt == L'0' && !width) {
+                zero = TRUE;
+            } else if (*fmt >= L'0' && *fmt <= L'9') {
+                width = width * 10 + (*fmt - L'0');
+            } else if (*fmt == L'*') {
+                width = va_arg(args, UINTN);
+            } else if (*fmt == L'l') {
+                is_long = TRUE;
+            } else if (*fmt != L',') {
+                break;
+            }
+        }
+
+        CHAR16 scratch[64];
+        const CHAR16 *s = scratch;
+        const CHAR8 *a = NULL;
+        UINTN len;
+
+        switch (*fmt) {
+            case L'd': {
+                INT64 value = is_long ? va_arg(args, INT64) : va_arg(args, INT32);
+                len = format_number(scratch, value < 0 ? -(UINT64) value : (UINT64) value, 10, FALSE, value < 0);
+                break;
+            }
+            case L'u':
+                len = format_number(scratch, is_long ? va_arg(args, UINT64) : va_arg(args, UINT32), 10, FALSE, FALSE);
+                break;
+            case L'X':
+                if (!width) {
+                    width = is_long ? 16 : 8;
+                    zero = TRUE;
+                }
+                // fallthrough
+            case L'x':
+                len = format_number(scratch, is_long ? va_arg(args, UINT64) : va_arg(args, UINT32), 16,
+                                    *fmt == L'X', FALSE);
+                break;
+            case L'p':
+                len = format_number(scratch, (UINTN) va_arg(args, VOID*), 16, FALSE, FALSE);
+                break;
+            case L'c':
+                scratch[0] = (CHAR16) va_arg(args, int);
+                scratch[1] = 0;
+                len = 1;
+                break;
+            case L's':
+                s = va_arg(args, CHAR16*);
+                if (!s) {
+                    s = L"(null)";
+                }
+                len = StrLen(s);
+                break;
+            case L'a':
+                a = va_arg(args, CHAR8*);
+                if (!a) {
+                    a = (const CHAR8*) "(null)";
+                }
+                len = strlena(a);
+                break;
+            case L'r':
+                len = format_status(scratch, va_arg(args, EFI_STATUS));
+                break;
+            case L'g':
+                len = format_guid(scratch, va_arg(args, EFI_GUID*));
+                break;
+            case L'%':
+                scratch[0] = L'%';
+                len = 1;
+                break;
+            case 0:
+                --fmt;
+                continue;
+            default:
+                // Attributes (%N, %E, ...) are ignored
+                len = 0;
+                break;
+        }
+
+        if (!left) {
+            for (UINTN i = len; i < width; ++i) {
+                print_char(&ps, zero ? L'0' : L' ');
+            }
+        }
+        for (UINTN i = 0; i < len; ++i) {
+            print_char(&ps, a ? a[i] : s[i]);
+        }
+        if (left) {
+            for (UINTN i = len; i < width; ++i) {
+                print_char(&ps, L' ');
+            }
+        }
+    }
+
+    ps.str[ps.len] = 0;
+    return ps.len;
+}
+
+UINTN SPrint(CHAR16 *str, UINTN str_size, CONST CHAR16 *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    UINTN len = VSPrint(str, str_size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+UINTN Print(CONST CHAR16 *fmt, ...) {
+    static CHAR16 buffer[PRINT_BUFFER_SIZE];
+
+    va_list args;
+    va_start(args, fmt);
+    UINTN len = VSPrint(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+
+    uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, buffer);
+    return len;
+}
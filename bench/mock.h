@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_BENCH_MOCK_H
+#define ANDROID_EFI_BENCH_MOCK_H
+
+#include <efi.h>
+
+/*
+ * Host-side mock of the parts of the firmware and gnu-efi (libefi) that are used
+ * to read boot images, so the loader code can be profiled as a normal process.
+ *
+ *   - Boot services: AllocatePages/GetMemoryMap (backed by a single mapping below 2 GiB),
+ *     pools, protocols, events, Stall and CalculateCrc32
+ *   - Runtime services: Variables are accepted but not stored
+ *   - BlockIO/DiskIO (and optionally BlockIO2/DiskIO2) over a mapped disk image
+ *   - Simple file system backed by a directory on the host
+ *
+ * Asynchronous reads are completed when their event is waited for or checked.
+ * There are no other event sources, so waiting for an event that is never signaled fails
+ * with EFI_NOT_READY instead of blocking forever.
+ */
+
+EFI_STATUS mock_init(UINT64 memory_size);
+
+// Handle of the image itself (used as agent handle when opening protocols)
+EFI_HANDLE mock_loader_handle(VOID);
+
+EFI_HANDLE mock_add_disk(const VOID *data, UINT64 size, UINT32 block_size, BOOLEAN async);
+// Replace the disk image (like a media change, the media id is incremented)
+VOID mock_change_media(EFI_HANDLE disk, const VOID *data, UINT64 size);
+EFI_HANDLE mock_add_directory(const char *path);
+
+// Free all pages allocated with AllocatePages
+VOID mock_free_pages(VOID);
+
+#endif //ANDROID_EFI_BENCH_MOCK_H
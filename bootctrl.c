@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "bootctrl.h"
+#include "log.h"
+#include <efilib.h>
+
+/*
+ * struct bootloader_control of the AOSP bootloader message (bootloader_message.h).
+ * The bit fields are decoded manually since their layout is fixed (little endian).
+ */
+
+#define BOOTCTRL_OFFSET   2048
+#define BOOTCTRL_MAGIC    0x42414342 // "BCAB"
+#define BOOTCTRL_VERSION  1
+
+#define OFFSET_MAGIC      4
+#define OFFSET_VERSION    8
+#define OFFSET_NB_SLOT    9 // nb_slot:3, recovery_tries_remaining:3, ...
+#define OFFSET_SLOT_INFO  12 // 2 bytes for each slot
+#define OFFSET_CRC32      28
+
+#define NB_SLOT_MASK          0x7
+#define SLOT_PRIORITY_MASK    0xf
+#define SLOT_TRIES_SHIFT      4
+#define SLOT_TRIES_MASK       0x7
+#define SLOT_SUCCESSFUL_BOOT  (1 << 7)
+
+EFI_STATUS bootctrl_open(struct bootctrl *ctrl, EFI_HANDLE misc) {
+    ctrl->disk_io = NULL;
+
+    EFI_BLOCK_IO *block_io;
+    EFI_DISK_IO *disk_io;
+    EFI_STATUS err = uefi_call_wrapper(BS->HandleProtocol, 3, misc, &BlockIoProtocol, (VOID**) &block_io);
+    if (!err) {
+        err = uefi_call_wrapper(BS->HandleProtocol, 3, misc, &DiskIoProtocol, (VOID**) &disk_io);
+    }
+    if (err) {
+        log_error(L"Failed to open misc partition: %r\n", err);
+        return err;
+    }
+
+    // The whole boot control block is read at once
+    UINT32 media_id = block_io->Media->MediaId;
+    err = uefi_call_wrapper(disk_io->ReadDisk, 5, disk_io, media_id, BOOTCTRL_OFFSET, sizeof(ctrl->data), ctrl->data);
+    if (err) {
+        log_error(L"Failed to read boot control block: %r\n", err);
+        return err;
+    }
+
+    UINT32 magic, expected_crc, crc;
+    CopyMem(&magic, &ctrl->data[OFFSET_MAGIC], sizeof(magic));
+    CopyMem(&expected_crc, &ctrl->data[OFFSET_CRC32], sizeof(expected_crc));
+    if (magic != BOOTCTRL_MAGIC || ctrl->data[OFFSET_VERSION] != BOOTCTRL_VERSION) {
+        log_error(L"Misc partition does not contain a boot control block\n");
+        return EFI_NOT_FOUND;
+    }
+
+    err = uefi_call_wrapper(BS->CalculateCrc32, 3, ctrl->data, OFFSET_CRC32, &crc);
+    if (err || crc != expected_crc) {
+        log_error(L"Invalid checksum of boot control block\n");
+        return EFI_CRC_ERROR;
+    }
+
+    ctrl->disk_io = disk_io;
+    ctrl->block_io = block_io;
+    ctrl->media_id = media_id;
+    return EFI_SUCCESS;
+}
+
+// Zero if the slot cannot be booted
+static UINTN slot_priority(const struct bootctrl *ctrl, UINTN slot) {
+    if (!ctrl->disk_io) {
+        return 1;
+    }
+
+    UINT8 info = ctrl->data[OFFSET_SLOT_INFO + slot * 2];
+    if (!(info & SLOT_SUCCESSFUL_BOOT) && !((info >> SLOT_TRIES_SHIFT) & SLOT_TRIES_MASK)) {
+        return 0;
+    }
+    return info & SLOT_PRIORITY_MASK;
+}
+
+UINTN bootctrl_order(const struct bootctrl *ctrl, UINTN slot_count, UINTN *order) {
+    if (ctrl->disk_io && slot_count > (ctrl->data[OFFSET_NB_SLOT] & NB_SLOT_MASK)) {
+        slot_count = ctrl->data[OFFSET_NB_SLOT] & NB_SLOT_MASK;
+    }
+    if (slot_count > BOOTCTRL_MAX_SLOTS) {
+        slot_count = BOOTCTRL_MAX_SLOTS;
+    }
+
+    UINTN count = 0;
+    for (UINTN slot = 0; slot < slot_count; ++slot) {
+        UINTN priority = slot_priority(ctrl, slot);
+        if (!priority) {
+            continue;
+        }
+
+        // Insertion sort, slots with the same priority stay in order
+        UINTN i = count++;
+        for (; i && slot_priority(ctrl, order[i - 1]) < priority; --i) {
+            order[i] = order[i - 1];
+        }
+        order[i] = slot;
+    }
+
+    return count;
+}
+
+VOID bootctrl_mark_attempt(struct bootctrl *ctrl, UINTN slot) {
+    if (!ctrl->disk_io) {
+        return;
+    }
+
+    UINT8 *info = &ctrl->data[OFFSET_SLOT_INFO + slot * 2];
+    if ((*info & SLOT_SUCCESSFUL_BOOT) || !((*info >> SLOT_TRIES_SHIFT) & SLOT_TRIES_MASK)) {
+        return;
+    }
+
+    *info -= 1 << SLOT_TRIES_SHIFT;
+
+    UINT32 crc;
+    EFI_STATUS err = uefi_call_wrapper(BS->CalculateCrc32, 3, ctrl->data, OFFSET_CRC32, &crc);
+    if (!err) {
+        CopyMem(&ctrl->data[OFFSET_CRC32], &crc, sizeof(crc));
+        err = uefi_call_wrapper(ctrl->disk_io->WriteDisk, 5, ctrl->disk_io, ctrl->media_id, BOOTCTRL_OFFSET,
+                                sizeof(ctrl->data), ctrl->data);
+    }
+    if (!err) {
+        // The kernel may be started before the firmware writes back cached blocks
+        err = uefi_call_wrapper(ctrl->block_io->FlushBlocks, 1, ctrl->block_io);
+    }
+    if (err) {
+        log_warning(L"Failed to update boot control block: %r\n", err);
+    }
+}
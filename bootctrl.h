@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_BOOTCTRL_H
+#define ANDROID_EFI_BOOTCTRL_H
+
+#include <efi.h>
+
+#define BOOTCTRL_MAX_SLOTS  4
+
+// Boot control block of A/B devices, stored in the misc partition
+struct bootctrl {
+    EFI_DISK_IO *disk_io; // NULL if the misc partition does not contain valid slot metadata
+    EFI_BLOCK_IO *block_io;
+    UINT32 media_id;
+    UINT8 data[32];
+};
+
+#define bootctrl_slot_suffix(slot)  ((CHAR8) ('a' + (slot)))
+
+EFI_STATUS bootctrl_open(struct bootctrl *ctrl, EFI_HANDLE misc);
+
+/*
+ * Sort the slots that can be booted by priority (highest first).
+ * All slots are returned in order if there is no valid metadata.
+ */
+UINTN bootctrl_order(const struct bootctrl *ctrl, UINTN slot_count, UINTN *order);
+
+// Count a boot attempt of a slot that has not booted successfully yet (writes the misc partition)
+VOID bootctrl_mark_attempt(struct bootctrl *ctrl, UINTN slot);
+
+#endif //ANDROID_EFI_BOOTCTRL_H
@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "cmdline.h"
+#include "malloc.h"
+#include "string.h"
+#include "log.h"
+#include <efilib.h>
+
+#define INITRD_OPTION  "initrd="
+
+struct cmdline_token {
+    const CHAR8 *start;
+    UINTN length;
+    UINTN key_length;
+    UINTN source;
+    BOOLEAN removed;
+};
+
+struct cmdline_tokens {
+    struct cmdline_token *tokens;
+    UINTN count;
+};
+
+static inline BOOLEAN is_space(CHAR8 c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Split the command line at spaces (outside of quotes)
+static VOID tokenize(struct cmdline_tokens *tokens, const CHAR8 *s, UINTN source) {
+    for (;;) {
+        while (is_space(*s)) {
+            ++s;
+        }
+        if (!*s) {
+            return;
+        }
+
+        struct cmdline_token *token = &tokens->tokens[tokens->count++];
+        token->start = s;
+        token->key_length = 0;
+        token->source = source;
+        token->removed = FALSE;
+
+        BOOLEAN quoted = FALSE;
+        for (; *s && (quoted || !is_space(*s)); ++s) {
+            if (*s == '"') {
+                quoted = !quoted;
+            } else if (*s == '=' && !token->key_length && !quoted) {
+                token->key_length = s - token->start;
+            }
+        }
+
+        token->length = s - token->start;
+        if (!token->key_length) {
+            token->key_length = token->length;
+        }
+    }
+}
+
+static inline BOOLEAN is_initrd(const struct cmdline_token *token) {
+    return token->key_length == STRING_LENGTH(INITRD_OPTION) - 1 &&
+           token->length > token->key_length &&
+           CompareMem(token->start, INITRD_OPTION, STRING_LENGTH(INITRD_OPTION)) == 0;
+}
+
+static inline BOOLEAN same_key(const struct cmdline_token *a, const struct cmdline_token *b) {
+    return a->key_length == b->key_length && CompareMem(a->start, b->start, a->key_length) == 0;
+}
+
+EFI_STATUS cmdline_build(CHAR8 *cmdline, UINTN max_length, const CHAR8 *image_cmdline, const CHAR8 *loader_params,
+                         const CHAR16 *params, UINTN params_length, struct cmdline_initrd **initrds) {
+    *initrds = NULL;
+
+    // Every UTF-16 code unit needs at most 3 bytes in UTF-8
+    CHAR8 *utf8_params = malloc_pool(params_length * 3 + 1);
+    if (!utf8_params) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    *str_utf16_to_utf8(utf8_params, params, params_length) = 0;
+
+    // Tokens are separated by at least one space
+    UINTN image_length = strlena(image_cmdline);
+    UINTN loader_length = loader_params ? strlena(loader_params) : 0;
+    UINTN utf8_params_length = strlena(utf8_params);
+    struct cmdline_tokens tokens = {
+        malloc_pool((image_length / 2 + loader_length / 2 + utf8_params_length / 2 + 3) * sizeof(*tokens.tokens)), 0
+    };
+    if (!tokens.tokens) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    tokenize(&tokens, image_cmdline, 0);
+    if (loader_params) {
+        tokenize(&tokens, loader_params, 1);
+    }
+    tokenize(&tokens, utf8_params, 2);
+
+    // Parameters replace parameters with the same key from previous sources
+    for (UINTN i = 0; i < tokens.count; ++i) {
+        if (is_initrd(&tokens.tokens[i])) {
+            continue;
+        }
+
+        for (UINTN j = 0; j < i && tokens.tokens[j].source < tokens.tokens[i].source; ++j) {
+            if (same_key(&tokens.tokens[i], &tokens.tokens[j])) {
+                tokens.tokens[j].removed = TRUE;
+            }
+        }
+    }
+
+    CHAR8 *p = cmdline;
+    struct cmdline_initrd **tail = initrds;
+    for (UINTN i = 0; i < tokens.count; ++i) {
+        struct cmdline_token *token = &tokens.tokens[i];
+        if (token->removed) {
+            continue;
+        }
+
+        UINTN separator = p != cmdline;
+        if ((UINTN) (p - cmdline) + separator + token->length > max_length) {
+            log_error(L"Kernel command line is too long (maximum: %d)\n", max_length);
+            return EFI_BUFFER_TOO_SMALL;
+        }
+
+        if (separator) {
+            *p++ = ' ';
+        }
+        CopyMem(p, token->start, token->length);
+
+        if (is_initrd(token)) {
+            struct cmdline_initrd *initrd = malloc_pool(sizeof(*initrd));
+            if (!initrd) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+
+            initrd->next = NULL;
+            initrd->path = p + STRING_LENGTH(INITRD_OPTION);
+            initrd->length = token->length - STRING_LENGTH(INITRD_OPTION);
+            *tail = initrd;
+            tail = &initrd->next;
+        }
+
+        p += token->length;
+    }
+
+    *p = 0;
+    return EFI_SUCCESS;
+}
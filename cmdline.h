@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_CMDLINE_H
+#define ANDROID_EFI_CMDLINE_H
+
+#include <efi.h>
+
+// initrd= parameters, in the order they appear on the command line
+struct cmdline_initrd {
+    struct cmdline_initrd *next;
+    const CHAR8 *path; // Not null-terminated
+    UINTN length;
+};
+
+/*
+ * Build the kernel command line from the command line of the boot image, parameters added by the
+ * loader (optional, e.g. the slot suffix) and additional parameters from the user, in that order.
+ * Parameters replace parameters of previous sources with the same key (e.g. "key=value"),
+ * except initrd= which may be used multiple times.
+ *
+ * initrds points into the command line and is allocated using malloc_pool().
+ */
+EFI_STATUS cmdline_build(CHAR8 *cmdline, UINTN max_length, const CHAR8 *image_cmdline, const CHAR8 *loader_params,
+                         const CHAR16 *params, UINTN params_length, struct cmdline_initrd **initrds);
+
+#endif //ANDROID_EFI_CMDLINE_H
@@ -4,26 +4,330 @@
 #include "graphics.h"
 #include <efilib.h>
 
+// Runs of at least this length are filled directly instead of being copied from the row buffer
+#define MIN_FILL_LENGTH  64
+
 static inline UINTN center(UINTN i, UINTN max) {
     return i < max ? (max - i) / 2 : 0;
 }
 
-EFI_STATUS graphics_display_image(const struct graphics_image *image) {
+// Size of a pixel in the image data: palette index or BGR color
+static inline UINTN pixel_size(const struct graphics_image *image) {
+    return image->palette ? 1 : 3;
+}
+
+static inline EFI_GRAPHICS_OUTPUT_BLT_PIXEL read_pixel(const struct graphics_image *image, const UINT8 *p) {
+    if (image->palette) {
+        return image->palette[*p];
+    }
+    return (EFI_GRAPHICS_OUTPUT_BLT_PIXEL) { .Blue = p[0], .Green = p[1], .Red = p[2] };
+}
+
+static inline BOOLEAN same_pixel(const UINT8 *a, const UINT8 *b, UINTN size) {
+    for (UINTN i = 0; i < size; ++i) {
+        if (a[i] != b[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+struct graphics_blitter {
     EFI_GRAPHICS_OUTPUT_PROTOCOL *graphics_output;
-    EFI_STATUS err = LibLocateProtocol(&GraphicsOutputProtocol, (VOID**) &graphics_output);
+    UINTN x, y;
+
+    // Rows that consist of a single color are combined into a single rectangle
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL fill;
+    const UINT8 *fill_pixel; // Encoded pixel of the fill color
+    UINTN fill_y, fill_height;
+};
+
+static inline EFI_STATUS blt_fill(struct graphics_blitter *blitter, EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+                                  UINTN x, UINTN y, UINTN width, UINTN height) {
+    return uefi_call_wrapper(blitter->graphics_output->Blt, 10, blitter->graphics_output, color, EfiBltVideoFill,
+                             0, 0, blitter->x + x, blitter->y + y, width, height, 0);
+}
+
+static EFI_STATUS flush_fill(struct graphics_blitter *blitter, UINTN width) {
+    if (!blitter->fill_height) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS err = blt_fill(blitter, &blitter->fill, 0, blitter->fill_y, width, blitter->fill_height);
+    blitter->fill_height = 0;
+    return err;
+}
+
+// Returns the end of the row if it consists of runs with a single color, NULL otherwise
+static const UINT8 *single_color_row(const struct graphics_image *image, const UINT8 *p, const UINT8 **pixel) {
+    UINTN size = pixel_size(image);
+    *pixel = &p[1];
+    for (UINTN x = 0; x < image->width; p += 1 + size) {
+        if (!(p[0] & GRAPHICS_RUN_FLAG) || !same_pixel(&p[1], *pixel, size)) {
+            return NULL;
+        }
+        x += GRAPHICS_RUN_LENGTH(p[0]);
+    }
+    return p;
+}
+
+// Decode a single row: Long runs are filled directly, everything else is copied from the row buffer
+static EFI_STATUS display_row(struct graphics_blitter *blitter, const struct graphics_image *image,
+                              const UINT8 **data, UINTN y, EFI_GRAPHICS_OUTPUT_BLT_PIXEL *row) {
+    const UINT8 *p = *data;
+    UINTN size = pixel_size(image);
+
+    const UINT8 *pixel;
+    const UINT8 *end = single_color_row(image, p, &pixel);
+    if (end) {
+        *data = end;
+
+        if (blitter->fill_height && same_pixel(blitter->fill_pixel, pixel, size)) {
+            ++blitter->fill_height;
+            return EFI_SUCCESS;
+        }
+
+        EFI_STATUS err = flush_fill(blitter, image->width);
+        blitter->fill = read_pixel(image, pixel);
+        blitter->fill_pixel = pixel;
+        blitter->fill_y = y;
+        blitter->fill_height = 1;
+        return err;
+    }
+
+    EFI_STATUS err = flush_fill(blitter, image->width);
     if (err) {
         return err;
     }
 
-    // Clear screen before displaying image
-    err = uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+    UINTN start = 0; // Start of the pixels in the row buffer that were not displayed yet
+    for (UINTN x = 0; x < image->width;) {
+        UINT8 header = *p++;
+        UINTN length = GRAPHICS_RUN_LENGTH(header);
+
+        if (!(header & GRAPHICS_RUN_FLAG)) {
+            if (image->palette) {
+                for (UINTN end = x + length; x < end; ++x) {
+                    row[x] = image->palette[*p++];
+                }
+            } else {
+                for (UINTN end = x + length; x < end; ++x, p += 3) {
+                    row[x] = read_pixel(image, p);
+                }
+            }
+            continue;
+        }
+
+        EFI_GRAPHICS_OUTPUT_BLT_PIXEL color = read_pixel(image, p);
+        p += size;
+        if (length < MIN_FILL_LENGTH) {
+            for (UINTN end = x + length; x < end; ++x) {
+                row[x] = color;
+            }
+            continue;
+        }
+
+        if (start < x) {
+            err = uefi_call_wrapper(blitter->graphics_output->Blt, 10, blitter->graphics_output, row,
+                                    EfiBltBufferToVideo, start, 0, blitter->x + start, blitter->y + y,
+                                    x - start, 1, 0);
+            if (err) {
+                return err;
+            }
+        }
+
+        err = blt_fill(blitter, &color, x, y, length, 1);
+        if (err) {
+            return err;
+        }
+
+        x += length;
+        start = x;
+    }
+
+    if (start < image->width) {
+        err = uefi_call_wrapper(blitter->graphics_output->Blt, 10, blitter->graphics_output, row,
+                                EfiBltBufferToVideo, start, 0, blitter->x + start, blitter->y + y,
+                                image->width - start, 1, 0);
+    }
+
+    *data = p;
+    return err;
+}
+
+/*
+ * The image can be displayed in the background using a timer, so the display work
+ * overlaps with reading the boot image (the timer is handled while waiting for reads).
+ */
+
+// Number of rows displayed each time the timer is signaled
+#define ASYNC_ROWS    32
+// Timer period (in 100 ns units)
+#define ASYNC_PERIOD  (1 * 10 * 1000)
+
+struct graphics_display {
+    const struct graphics_image *image;
+    struct graphics_blitter blitter;
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *row;
+
+    const UINT8 *data;
+    UINTN y;
+    BOOLEAN cleared;
+    EFI_STATUS err;
+
+    EFI_EVENT timer;
+};
+
+static struct graphics_display display;
+
+static const struct graphics_image *select_image(const struct graphics_image *images, UINTN count,
+                                                UINTN width, UINTN height) {
+    const struct graphics_image *best = NULL, *smallest = &images[0];
+    for (UINTN i = 0; i < count; ++i) {
+        const struct graphics_image *image = &images[i];
+        UINTN area = image->width * image->height;
+
+        if (area < smallest->width * smallest->height) {
+            smallest = image;
+        }
+
+        if (image->width <= width && image->height <= height && (!best || area > best->width * best->height)) {
+            best = image;
+        }
+    }
+
+    return best ? best : smallest;
+}
+
+static EFI_STATUS display_begin(const struct graphics_image *images, UINTN count) {
+    if (!count) {
+        return EFI_NOT_FOUND;
+    }
+
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *graphics_output;
+    EFI_STATUS err = LibLocateProtocol(&GraphicsOutputProtocol, (VOID**) &graphics_output);
     if (err) {
         return err;
     }
 
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info = graphics_output->Mode->Info;
+    const struct graphics_image *image = select_image(images, count,
+                                                      info->HorizontalResolution, info->VerticalResolution);
+
+    display.row = AllocatePool(image->width * sizeof(*display.row));
+    if (!display.row) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
     // Calculate position of image
-    UINTN x = center(image->width, graphics_output->Mode->Info->HorizontalResolution);
-    UINTN y = center(image->height, graphics_output->Mode->Info->VerticalResolution);
-    return uefi_call_wrapper(graphics_output->Blt, 10, graphics_output, image->blt, EfiBltBufferToVideo,
-                             0, 0, x, y, image->width, image->height, 0);
+    display.blitter = (struct graphics_blitter) {
+        .graphics_output = graphics_output,
+        .x = center(image->width, info->HorizontalResolution),
+        .y = center(image->height, info->VerticalResolution),
+    };
+
+    display.image = image;
+    display.data = image->data;
+    display.y = 0;
+    display.cleared = FALSE;
+    display.err = EFI_SUCCESS;
+    return EFI_SUCCESS;
+}
+
+// Returns TRUE once the image was displayed completely (or an error occurred)
+static BOOLEAN display_rows(UINTN count) {
+    if (display.err || display.y == display.image->height) {
+        return TRUE;
+    }
+
+    if (!display.cleared) {
+        // Clear screen before displaying image
+        display.err = uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+        display.cleared = TRUE;
+        if (display.err) {
+            return TRUE;
+        }
+    }
+
+    for (UINTN end = display.y + count; display.y < end && display.y < display.image->height; ++display.y) {
+        display.err = display_row(&display.blitter, display.image, &display.data, display.y, display.row);
+        if (display.err) {
+            return TRUE;
+        }
+    }
+
+    if (display.y < display.image->height) {
+        return FALSE;
+    }
+
+    display.err = flush_fill(&display.blitter, display.image->width);
+    return TRUE;
+}
+
+static EFI_STATUS display_end(VOID) {
+    FreePool(display.row);
+    display.row = NULL;
+    display.image = NULL;
+    return display.err;
+}
+
+static VOID EFIAPI display_notify(EFI_EVENT event, VOID *context) {
+    (VOID) context;
+    if (display_rows(ASYNC_ROWS)) {
+        uefi_call_wrapper(BS->SetTimer, 3, event, TimerCancel, 0);
+    }
+}
+
+EFI_STATUS graphics_display_image(const struct graphics_image *images, UINTN count) {
+    EFI_STATUS err = display_begin(images, count);
+    if (err) {
+        return err;
+    }
+
+    display_rows(display.image->height);
+    return display_end();
+}
+
+EFI_STATUS graphics_display_image_async(const struct graphics_image *images, UINTN count) {
+    EFI_STATUS err = display_begin(images, count);
+    if (err) {
+        return err;
+    }
+
+    err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+                            display_notify, NULL, &display.timer);
+    if (err) {
+        goto sync;
+    }
+
+    err = uefi_call_wrapper(BS->SetTimer, 3, display.timer, TimerPeriodic, ASYNC_PERIOD);
+    if (err) {
+        uefi_call_wrapper(BS->CloseEvent, 1, display.timer);
+        goto sync;
+    }
+
+    return EFI_SUCCESS;
+
+sync:
+    // Display the image immediately if timers are not available
+    display.timer = NULL;
+    display_rows(display.image->height);
+    return display_end();
+}
+
+EFI_STATUS graphics_wait(VOID) {
+    if (!display.image) {
+        return EFI_SUCCESS;
+    }
+
+    // Prevent the timer from running while the remaining rows are displayed
+    EFI_TPL tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+    uefi_call_wrapper(BS->CloseEvent, 1, display.timer);
+    display.timer = NULL;
+
+    display_rows(display.image->height);
+    EFI_STATUS err = display_end();
+
+    uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+    return err;
 }
@@ -6,12 +6,32 @@
 
 #include <efi.h>
 
+/*
+ * Images are stored as palette and run-length encoded palette indices (generated by png2efi).
+ * Each row is a sequence of runs, starting with a header byte:
+ *   - 0x80 | (n - 1): n pixels with the color of the following palette index
+ *   - (n - 1): n pixels with the colors of the following n palette indices
+ * Images with more than 256 colors have no palette (NULL), the runs contain
+ * BGR colors (3 bytes) instead of palette indices.
+ */
+#define GRAPHICS_RUN_FLAG        0x80
+#define GRAPHICS_RUN_LENGTH(h)   ((UINTN) ((h) & ~GRAPHICS_RUN_FLAG) + 1)
+
 struct graphics_image {
     UINTN width;
     UINTN height;
-    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+    EFI_GRAPHICS_OUTPUT_BLT_PIXEL *palette;
+    const UINT8 *data;
 };
 
-EFI_STATUS graphics_display_image(const struct graphics_image *image);
+/*
+ * The image is chosen from multiple resolutions of the same image: The largest one that fits on
+ * the screen is displayed (or the smallest one if none of them fits).
+ */
+EFI_STATUS graphics_display_image(const struct graphics_image *images, UINTN count);
+
+// Display the image in the background, graphics_wait() must be called before exiting boot services
+EFI_STATUS graphics_display_image_async(const struct graphics_image *images, UINTN count);
+EFI_STATUS graphics_wait(VOID);
 
 #endif //ANDROID_EFI_GRAPHICS_H
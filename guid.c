@@ -4,6 +4,9 @@
 #include "guid.h"
 #include <efilib.h>
 
+EFI_GUID AndroidEfiVendorGuid =
+    { 0x519f7227, 0x0d7f, 0x4826, { 0xb2, 0xf8, 0x17, 0x0e, 0x6f, 0x99, 0x15, 0xd3 } };
+
 #define DECLARE_PARSE_HEX(n)\
 static BOOLEAN parse_hex##n(const CHAR16 **input, UINT##n *u) {\
     for (unsigned i = 0; i < sizeof(UINT##n) * 2; ++i) {\
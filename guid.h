@@ -6,6 +6,9 @@
 
 #include <efi.h>
 
+// Vendor GUID used for EFI variables of android-efi
+extern EFI_GUID AndroidEfiVendorGuid;
+
 BOOLEAN guid_parse(EFI_GUID *guid, const CHAR16 *input, UINTN length);
 
 #endif //ANDROID_EFI_GUID_H
@@ -2,71 +2,306 @@
 // Copyright (C) 2017 lambdadroid
 
 #include "image.h"
+#include "lz4.h"
+#include "string.h"
+#include "timing.h"
+#include "trace.h"
+#include "log.h"
 #include <efilib.h>
 
-static EFI_STATUS partition_find(EFI_GUID *guid, EFI_HANDLE *handle) {
-    UINTN handle_count;
-    EFI_HANDLE *handles;
-    EFI_STATUS err = LibLocateHandleByDiskSignature(MBR_TYPE_EFI_PARTITION_TABLE_HEADER, SIGNATURE_TYPE_GUID,
-                                                    guid, &handle_count, &handles);
+// Size of a single asynchronous read
+#define PARTITION_CHUNK_SIZE  (1024 * 1024)
+
+static EFI_GUID DiskIo2Protocol = EFI_DISK_IO2_PROTOCOL_GUID;
+static EFI_GUID BlockIo2Protocol = EFI_BLOCK_IO2_PROTOCOL_GUID;
+
+static VOID partition_open_async(struct efi_image *image, EFI_HANDLE loader) {
+    struct efi_image_partition *partition = &image->partition;
+    partition->queue_head = partition->queue_size = 0;
+
+    // DiskIO2 and BlockIO2 are optional, reads are synchronous if they are not available
+    EFI_STATUS err = uefi_call_wrapper(BS->OpenProtocol, 6, image->partition_handle, &DiskIo2Protocol,
+                                       (VOID**) &partition->disk_io2, loader, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
     if (err) {
-        goto out;
+        partition->disk_io2 = NULL;
     }
 
-    if (handle_count != 1) {
-        if (handle_count == 0) {
-            Print(L"Partition not found: %g\n", guid);
-            err = EFI_NO_MEDIA;
-        } else {
-            Print(L"Ambiguous partition GUID: %g\n", guid);
-            err = EFI_VOLUME_CORRUPTED;
-        }
+    err = uefi_call_wrapper(BS->OpenProtocol, 6, image->partition_handle, &BlockIo2Protocol,
+                            (VOID**) &partition->block_io2, loader, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+    if (err) {
+        partition->block_io2 = NULL;
+    }
 
-        goto out;
+    if (!partition->disk_io2 && !partition->block_io2) {
+        return;
     }
 
-    *handle = handles[0];
+    for (UINTN i = 0; i < PARTITION_QUEUE_DEPTH; ++i) {
+        err = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &partition->queue[i].event);
+        if (err) {
+            while (i--) {
+                uefi_call_wrapper(BS->CloseEvent, 1, partition->queue[i].event);
+            }
 
-    out:
-    FreePool(handles);
-    return err;
+            if (partition->disk_io2) {
+                uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &DiskIo2Protocol, loader, NULL);
+                partition->disk_io2 = NULL;
+            }
+            if (partition->block_io2) {
+                uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &BlockIo2Protocol, loader, NULL);
+                partition->block_io2 = NULL;
+            }
+            return;
+        }
+    }
 }
 
 static EFI_STATUS partition_open(struct efi_image *image, EFI_HANDLE loader) {
     EFI_STATUS err = uefi_call_wrapper(BS->OpenProtocol, 6, image->partition_handle, &BlockIoProtocol,
                             (VOID**) &image->partition.block_io, loader, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
     if (err) {
-        Print(L"Failed to open BlockIO protocol\n");
+        log_error(L"Failed to open BlockIO protocol\n");
         return err;
     }
 
     err = uefi_call_wrapper(BS->OpenProtocol, 6, image->partition_handle, &DiskIoProtocol,
                             (VOID**) &image->partition.disk_io, loader, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
     if (err) {
-        Print(L"Failed to open DiskIO protocol\n");
+        log_error(L"Failed to open DiskIO protocol\n");
         return err;
     }
 
+    // Whole blocks can be only read directly with BlockIO if the block size is a power of two
+    struct efi_image_partition *partition = &image->partition;
+    EFI_BLOCK_IO_MEDIA *media = partition->block_io->Media;
+    partition->block_shift = 0;
+    if (media->BlockSize && !(media->BlockSize & (media->BlockSize - 1))) {
+        while ((1U << partition->block_shift) < media->BlockSize) {
+            ++partition->block_shift;
+        }
+    }
+    partition->io_align_mask = media->IoAlign > 1 ? media->IoAlign - 1 : 0;
+
+    partition_open_async(image, loader);
     return EFI_SUCCESS;
 }
 
-static inline EFI_STATUS partition_read(const struct efi_image_partition *partition, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+static inline EFI_STATUS partition_read_disk(const struct efi_image_partition *partition, UINT64 offset,
+                                             VOID *buffer, UINTN buffer_size) {
     return uefi_call_wrapper(partition->disk_io->ReadDisk, 5, partition->disk_io, partition->block_io->Media->MediaId,
                              offset, buffer_size, buffer);
 }
 
-static inline VOID partition_close(const struct efi_image *image, EFI_HANDLE loader) {
-    EFI_STATUS err = uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &DiskIoProtocol, loader, NULL);
+static inline EFI_STATUS partition_read_blocks(const struct efi_image_partition *partition, UINT64 offset,
+                                               VOID *buffer, UINTN buffer_size) {
+    return uefi_call_wrapper(partition->block_io->ReadBlocks, 5, partition->block_io,
+                             partition->block_io->Media->MediaId, offset >> partition->block_shift,
+                             buffer_size, buffer);
+}
+
+static VOID image_callback(struct efi_image *image, const VOID *buffer, UINTN size) {
+    UINT64 start = timing_read_tsc();
+    image->callback(image->callback_context, buffer, size);
+    image->callback_ticks += timing_read_tsc() - start;
+}
+
+static EFI_STATUS partition_complete(struct efi_image *image) {
+    struct efi_image_partition *partition = &image->partition;
+    UINTN head = partition->queue_head;
+    struct efi_io2_token *token = &partition->queue[head];
+
+    UINTN index;
+    EFI_STATUS err = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &token->event, &index);
+    if (!err) {
+        err = token->transaction_status;
+    }
+
+    partition->queue_head = (head + 1) % PARTITION_QUEUE_DEPTH;
+    --partition->queue_size;
+
+    // The chunks complete in order, so the last one marks the end of the read
+    trace_complete(partition->pending[head].trace_id, timing_read_tsc());
+
+    if (!err && image->callback) {
+        image_callback(image, partition->pending[head].buffer, partition->pending[head].size);
+    }
+    return err;
+}
+
+static EFI_STATUS partition_wait(struct efi_image *image) {
+    EFI_STATUS err = EFI_SUCCESS;
+
+    // Wait for all reads, even if one of them has failed
+    while (image->partition.queue_size) {
+        EFI_STATUS status = partition_complete(image);
+        if (!err) {
+            err = status;
+        }
+    }
+
+    return err;
+}
+
+static EFI_STATUS partition_submit(struct efi_image *image, BOOLEAN blocks, UINT64 offset,
+                                   VOID *buffer, UINTN buffer_size) {
+    struct efi_image_partition *partition = &image->partition;
+    if (!buffer_size) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS err;
+    if (blocks ? !partition->block_io2 : !partition->disk_io2) {
+        err = blocks ? partition_read_blocks(partition, offset, buffer, buffer_size)
+                     : partition_read_disk(partition, offset, buffer, buffer_size);
+        if (!err && image->callback) {
+            // Previous asynchronous reads must be completed first to keep the order
+            err = partition_wait(image);
+            if (!err) {
+                image_callback(image, buffer, buffer_size);
+            }
+        }
+        return err;
+    }
+
+    // Split read into multiple chunks so the firmware can work on the next one
+    // while the previous one is being completed
+    while (buffer_size) {
+        UINTN size = buffer_size < PARTITION_CHUNK_SIZE ? buffer_size : PARTITION_CHUNK_SIZE;
+
+        if (partition->queue_size == PARTITION_QUEUE_DEPTH) {
+            // Wait until the oldest read has completed
+            err = partition_complete(image);
+            if (err) {
+                return err;
+            }
+        }
+
+        UINTN tail = (partition->queue_head + partition->queue_size) % PARTITION_QUEUE_DEPTH;
+        struct efi_io2_token *token = &partition->queue[tail];
+        token->transaction_status = EFI_SUCCESS;
+        partition->pending[tail].buffer = buffer;
+        partition->pending[tail].size = size;
+        partition->pending[tail].trace_id = partition->trace_id;
+
+        UINT32 media_id = partition->block_io->Media->MediaId;
+        if (blocks) {
+            err = uefi_call_wrapper(partition->block_io2->read_blocks_ex, 6, partition->block_io2, media_id,
+                                    offset >> partition->block_shift, token, size, buffer);
+        } else {
+            err = uefi_call_wrapper(partition->disk_io2->read_disk_ex, 6, partition->disk_io2, media_id,
+                                    offset, token, size, buffer);
+        }
+        if (err) {
+            return err;
+        }
+
+        ++partition->queue_size;
+
+        offset += size;
+        buffer = (VOID*) ((UINTN) buffer + size);
+        buffer_size -= size;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS partition_read_async(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    struct efi_image_partition *partition = &image->partition;
+    partition->trace_id = trace_next_id(); // Recorded by image_read_async() afterwards
+    if (partition->block_shift) {
+        UINTN block_mask = (1U << partition->block_shift) - 1;
+
+        // Read all complete blocks directly into the buffer using BlockIO (if the buffer is aligned properly).
+        // DiskIO is only used for the unaligned head and tail to avoid copying everything through a bounce buffer.
+        UINTN head = (UINTN) (-offset) & block_mask;
+        if (head > buffer_size) {
+            head = buffer_size;
+        }
+
+        UINTN body = (buffer_size - head) & ~block_mask;
+        if (body && !(((UINTN) buffer + head) & partition->io_align_mask)) {
+            EFI_STATUS err = partition_submit(image, FALSE, offset, buffer, head);
+            if (err) {
+                return err;
+            }
+
+            err = partition_submit(image, TRUE, offset + head, (VOID*) ((UINTN) buffer + head), body);
+            if (err) {
+                return err;
+            }
+
+            offset += head + body;
+            buffer = (VOID*) ((UINTN) buffer + head + body);
+            buffer_size -= head + body;
+        }
+    }
+
+    return partition_submit(image, FALSE, offset, buffer, buffer_size);
+}
+
+static inline VOID partition_close(struct efi_image *image, EFI_HANDLE loader) {
+    EFI_STATUS err;
+    struct efi_image_partition *partition = &image->partition;
+    if (partition->disk_io2 || partition->block_io2) {
+        // Only wait for the reads, they are not needed anymore
+        image->callback = NULL;
+        partition_wait(image);
+
+        for (UINTN i = 0; i < PARTITION_QUEUE_DEPTH; ++i) {
+            uefi_call_wrapper(BS->CloseEvent, 1, partition->queue[i].event);
+        }
+    }
+
+    if (partition->disk_io2) {
+        err = uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &DiskIo2Protocol, loader, NULL);
+        if (err) {
+            log_warning(L"Failed to close DiskIO2 protocol: %r\n", err);
+        }
+    }
+
+    if (partition->block_io2) {
+        err = uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &BlockIo2Protocol, loader, NULL);
+        if (err) {
+            log_warning(L"Failed to close BlockIO2 protocol: %r\n", err);
+        }
+    }
+
+    err = uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &DiskIoProtocol, loader, NULL);
     if (err) {
-        Print(L"Failed to close DiskIO protocol: %r\n", err);
+        log_warning(L"Failed to close DiskIO protocol: %r\n", err);
     }
 
     err = uefi_call_wrapper(BS->CloseProtocol, 4, image->partition_handle, &BlockIoProtocol, loader, NULL);
     if (err) {
-        Print(L"Failed to close BlockIO protocol: %r\n", err);
+        log_warning(L"Failed to close BlockIO protocol: %r\n", err);
     }
 }
 
+static EFI_STATUS lz4_open(struct efi_image_file *file);
+static VOID lz4_close(struct efi_image_file *file);
+
+#define LZ4_EXTENSION  L".lz4"
+
+static BOOLEAN is_lz4_path(const CHAR16 *path) {
+    UINTN len = StrLen(path);
+    if (len < STRING_LENGTH(LZ4_EXTENSION)) {
+        return FALSE;
+    }
+
+    path += len - STRING_LENGTH(LZ4_EXTENSION);
+    for (const CHAR16 *ext = LZ4_EXTENSION; *ext; ++ext, ++path) {
+        CHAR16 c = *path;
+        if (c >= L'A' && c <= L'Z') {
+            c += L'a' - L'A';
+        }
+        if (c != *ext) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 static EFI_STATUS file_open(struct efi_image *image, EFI_HANDLE loader_device, CHAR16 *path) {
     EFI_STATUS err;
     EFI_HANDLE handle = image->partition_handle;
@@ -79,68 +314,547 @@ static EFI_STATUS file_open(struct efi_image *image, EFI_HANDLE loader_device, C
 
     image->file.dir = LibOpenRoot(handle);
     if (!image->file.dir) {
-        Print(L"Failed to open root directory of partition\n");
+        log_error(L"Failed to open root directory of partition\n");
         return EFI_VOLUME_CORRUPTED;
     }
 
     err = uefi_call_wrapper(image->file.dir->Open, 5, image->file.dir, &image->file.file, path, EFI_FILE_MODE_READ, 0);
     if (err) {
-        Print(L"Failed to open boot image file\n");
+        log_error(L"Failed to open boot image file\n");
         return err;
     }
 
+    image->file.position = 0;
+    image->file.lz4 = NULL;
+
+    if (is_lz4_path(path)) {
+        return lz4_open(&image->file);
+    }
+
     return EFI_SUCCESS;
 }
 
-static inline EFI_STATUS file_read(const struct efi_image_file *file, UINT64 offset, VOID *buffer, UINTN buffer_size) {
-    EFI_STATUS err = uefi_call_wrapper(file->file->SetPosition, 2, file->file, offset);
-    if (err) {
-        return err;
+// buffer_size is updated with the number of bytes that were read (less at the end of the file)
+static EFI_STATUS file_read_partial(struct efi_image_file *file, UINT64 offset, VOID *buffer, UINTN *buffer_size) {
+    EFI_STATUS err;
+    if (offset != file->position) {
+        err = uefi_call_wrapper(file->file->SetPosition, 2, file->file, offset);
+        if (err) {
+            return err;
+        }
     }
 
-    return uefi_call_wrapper(file->file->Read, 3, file->file, &buffer_size, buffer);
+    err = uefi_call_wrapper(file->file->Read, 3, file->file, buffer_size, buffer);
+    file->position = err ? (UINT64) -1 : offset + *buffer_size;
+    return err;
+}
+
+static inline EFI_STATUS file_read(struct efi_image_file *file, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    return file_read_partial(file, offset, buffer, &buffer_size);
 }
 
-static inline VOID file_close(const struct efi_image_file *file) {
+static inline VOID file_close(struct efi_image_file *file) {
+    if (file->lz4) {
+        lz4_close(file);
+    }
+
     EFI_STATUS err = uefi_call_wrapper(file->file->Close, 1, file->file);
     if (err) {
-        Print(L"Failed to close image file: %r\n", err);
+        log_warning(L"Failed to close image file: %r\n", err);
     }
 
     err = uefi_call_wrapper(file->dir->Close, 1, file->dir);
     if (err) {
-        Print(L"Failed to close image directory: %r\n", err);
+        log_warning(L"Failed to close image directory: %r\n", err);
     }
 }
 
-EFI_STATUS image_open(struct efi_image *image, EFI_HANDLE loader, EFI_HANDLE loader_device,
-                      EFI_GUID *partition_guid, CHAR16 *path) {
-    EFI_STATUS err;
-    if (partition_guid) {
-        err = partition_find(partition_guid, &image->partition_handle);
-        if (err) {
-            return err;
+/*
+ * LZ4 compressed images: The blocks of the LZ4 frame are indexed when opening the image,
+ * so random reads only need to decompress the blocks that are actually requested.
+ */
+
+#define LZ4_NO_BLOCK  ((UINTN) -1)
+
+// Block headers are read in chunks (the compressed size of a block may be much smaller than the block size)
+#define LZ4_INDEX_CHUNK_SIZE  0x1000
+
+struct lz4_block {
+    UINT64 offset;
+    UINT32 size;
+};
+
+struct efi_image_lz4 {
+    struct lz4_frame frame;
+
+    struct lz4_block *blocks;
+    UINTN block_count;
+
+    UINT8 *compressed;
+
+    // Last decompressed block (for reads that do not cover a full block)
+    UINT8 *cache;
+    UINTN cache_index;
+    UINTN cache_size;
+};
+
+static VOID lz4_close(struct efi_image_file *file) {
+    struct efi_image_lz4 *lz4 = file->lz4;
+    if (lz4->blocks) {
+        FreePool(lz4->blocks);
+    }
+    if (lz4->compressed) {
+        FreePool(lz4->compressed);
+    }
+    if (lz4->cache) {
+        FreePool(lz4->cache);
+    }
+
+    FreePool(lz4);
+    file->lz4 = NULL;
+}
+
+// The buffer for compressed blocks is used to read the block headers
+static EFI_STATUS lz4_index_blocks(struct efi_image_file *file) {
+    struct efi_image_lz4 *lz4 = file->lz4;
+    UINT8 *chunk = lz4->compressed;
+    UINT64 chunk_offset = 0;
+    UINTN chunk_size = 0;
+    UINT64 offset = lz4->frame.header_size;
+    UINTN capacity = 0;
+
+    for (;;) {
+        // Read the next chunk if the block header is not part of the current one
+        if (offset + sizeof(UINT32) > chunk_offset + chunk_size) {
+            chunk_offset = offset;
+            chunk_size = LZ4_INDEX_CHUNK_SIZE;
+            EFI_STATUS err = file_read_partial(file, offset, chunk, &chunk_size);
+            if (err) {
+                return err;
+            }
+            if (chunk_size < sizeof(UINT32)) {
+                log_error(L"Truncated LZ4 frame (missing end mark)\n");
+                return EFI_END_OF_FILE;
+            }
         }
-    } else {
-        image->partition_handle = NULL;
+
+        UINT32 size;
+        CopyMem(&size, &chunk[offset - chunk_offset], sizeof(size));
+        if (!size) {
+            return EFI_SUCCESS; // End mark
+        }
+
+        UINTN data_size = size & ~LZ4_BLOCK_UNCOMPRESSED;
+        if (data_size > lz4->frame.block_size) {
+            log_error(L"Invalid LZ4 block size: %d\n", data_size);
+            return EFI_VOLUME_CORRUPTED;
+        }
+
+        if (lz4->block_count == capacity) {
+            UINTN new_capacity = capacity ? capacity * 2 : 16;
+            lz4->blocks = ReallocatePool(lz4->blocks, capacity * sizeof(*lz4->blocks),
+                                         new_capacity * sizeof(*lz4->blocks));
+            if (!lz4->blocks) {
+                return EFI_OUT_OF_RESOURCES;
+            }
+            capacity = new_capacity;
+        }
+
+        offset += sizeof(size);
+        lz4->blocks[lz4->block_count].offset = offset;
+        lz4->blocks[lz4->block_count++].size = size;
+
+        offset += data_size;
+        if (lz4->frame.block_checksum) {
+            offset += sizeof(UINT32);
+        }
+    }
+}
+
+static EFI_STATUS lz4_open(struct efi_image_file *file) {
+    struct efi_image_lz4 *lz4 = AllocateZeroPool(sizeof(*lz4));
+    if (!lz4) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    file->lz4 = lz4;
+    lz4->cache_index = LZ4_NO_BLOCK;
+
+    UINT8 header[LZ4_FRAME_MAX_HEADER_SIZE];
+    UINTN header_size = sizeof(header);
+    EFI_STATUS err = file_read_partial(file, 0, header, &header_size);
+    if (err) {
+        goto err;
+    }
+
+    err = lz4_parse_frame(header, header_size, &lz4->frame);
+    if (err) {
+        goto err;
+    }
+
+    // The block size is at least 64 KiB, so blocks headers can be read into the buffer for compressed blocks
+    lz4->compressed = AllocatePool(lz4->frame.block_size);
+    lz4->cache = AllocatePool(lz4->frame.block_size);
+    if (!lz4->compressed || !lz4->cache) {
+        err = EFI_OUT_OF_RESOURCES;
+        goto err;
+    }
+
+    err = lz4_index_blocks(file);
+    if (err) {
+        goto err;
+    }
+
+    return EFI_SUCCESS;
+
+err:
+    log_error(L"Failed to open LZ4 compressed boot image: %r\n", err);
+    lz4_close(file);
+    return err;
+}
+
+static EFI_STATUS lz4_load_block(struct efi_image_file *file, UINTN index, VOID *buffer, UINTN *size) {
+    struct efi_image_lz4 *lz4 = file->lz4;
+    const struct lz4_block *block = &lz4->blocks[index];
+    UINTN data_size = block->size & ~LZ4_BLOCK_UNCOMPRESSED;
+    BOOLEAN uncompressed = block->size & LZ4_BLOCK_UNCOMPRESSED;
+
+    UINTN read_size = data_size;
+    EFI_STATUS err = file_read_partial(file, block->offset, uncompressed ? buffer : lz4->compressed, &read_size);
+    if (err) {
+        return err;
+    }
+    if (read_size != data_size) {
+        log_error(L"Truncated LZ4 block: %d\n", index);
+        return EFI_END_OF_FILE;
     }
 
+    if (uncompressed) {
+        *size = data_size;
+        return EFI_SUCCESS;
+    }
+
+    *size = lz4->frame.block_size;
+    err = lz4_decompress(lz4->compressed, data_size, buffer, size);
+    if (err) {
+        return err;
+    }
+
+    // Offsets can be only mapped to blocks if all blocks (except the last) are complete
+    if (index + 1 < lz4->block_count && *size != lz4->frame.block_size) {
+        log_error(L"Incomplete LZ4 block: %d\n", index);
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS lz4_read(struct efi_image_file *file, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    struct efi_image_lz4 *lz4 = file->lz4;
+
+    while (buffer_size) {
+        UINTN index = (UINTN) (offset >> lz4->frame.block_shift);
+        UINTN block_offset = (UINTN) offset & (lz4->frame.block_size - 1);
+        if (index >= lz4->block_count) {
+            return EFI_END_OF_FILE;
+        }
+
+        UINTN size = lz4->frame.block_size - block_offset;
+        if (size > buffer_size) {
+            size = buffer_size;
+        }
+
+        EFI_STATUS err;
+        if (size == lz4->frame.block_size && index != lz4->cache_index) {
+            // Decompress full blocks directly into the buffer
+            err = lz4_load_block(file, index, buffer, &size);
+            if (err) {
+                return err;
+            }
+        } else {
+            if (index != lz4->cache_index) {
+                lz4->cache_index = LZ4_NO_BLOCK;
+                err = lz4_load_block(file, index, lz4->cache, &lz4->cache_size);
+                if (err) {
+                    return err;
+                }
+                lz4->cache_index = index;
+            }
+
+            if (block_offset >= lz4->cache_size) {
+                return EFI_END_OF_FILE;
+            }
+            if (size > lz4->cache_size - block_offset) {
+                size = lz4->cache_size - block_offset;
+            }
+
+            CopyMem(buffer, &lz4->cache[block_offset], size);
+        }
+
+        offset += size;
+        buffer = (VOID*) ((UINTN) buffer + size);
+        buffer_size -= size;
+    }
+
+    return EFI_SUCCESS;
+}
+
+#define IMAGE_CACHE_NONE        ((UINT64) -1)
+#define IMAGE_CACHE_BLOCK_MASK  (IMAGE_CACHE_BLOCK_SIZE - 1)
+
+static VOID cache_open(struct efi_image_cache *cache) {
+    cache->data = AllocatePool(IMAGE_CACHE_BLOCKS * IMAGE_CACHE_BLOCK_SIZE);
+    for (UINTN i = 0; i < IMAGE_CACHE_BLOCKS; ++i) {
+        cache->offset[i] = IMAGE_CACHE_NONE;
+    }
+    cache->next = 0;
+    cache->hits = cache->misses = 0;
+}
+
+static VOID cache_close(struct efi_image_cache *cache) {
+    timing_record_cache(cache->hits, cache->misses);
+
+    if (cache->data) {
+        FreePool(cache->data);
+        cache->data = NULL;
+    }
+}
+
+// Read consecutive blocks into the cache, the image must not have any reads in progress
+static EFI_STATUS cache_fill(struct efi_image *image, UINT64 offset, UINTN count) {
+    struct efi_image_cache *cache = &image->cache;
+    UINTN size = count * IMAGE_CACHE_BLOCK_SIZE;
+
+    if (image->partition_handle) {
+        // Avoid reading beyond the end of the partition
+        EFI_BLOCK_IO_MEDIA *media = image->partition.block_io->Media;
+        if (offset + size > MultU64x32(media->LastBlock + 1, media->BlockSize)) {
+            return EFI_END_OF_MEDIA;
+        }
+    }
+
+    if (cache->next + count > IMAGE_CACHE_BLOCKS) {
+        cache->next = 0;
+    }
+
+    UINTN first = cache->next;
+    for (UINTN i = first; i < first + count; ++i) {
+        cache->offset[i] = IMAGE_CACHE_NONE;
+    }
+
+    // The callback should only see the data that was actually requested
+    image_read_callback callback = image->callback;
+    image->callback = NULL;
+
+    ++cache->misses;
+    EFI_STATUS err = image_read_async(image, offset, &cache->data[first * IMAGE_CACHE_BLOCK_SIZE], size);
+    EFI_STATUS status = image_wait(image);
+    image->callback = callback;
+    if (err == EFI_END_OF_FILE) {
+        // Compressed images are not read beyond their end, like partitions
+        return EFI_END_OF_MEDIA;
+    }
+    if (err || status) {
+        return err ? err : status;
+    }
+
+    for (UINTN i = 0; i < count; ++i) {
+        cache->offset[first + i] = offset + i * IMAGE_CACHE_BLOCK_SIZE;
+    }
+    cache->next = first + count;
+    return EFI_SUCCESS;
+}
+
+static UINT8 *cache_lookup(struct efi_image_cache *cache, UINT64 block) {
+    for (UINTN i = 0; i < IMAGE_CACHE_BLOCKS; ++i) {
+        if (cache->offset[i] == block) {
+            return &cache->data[i * IMAGE_CACHE_BLOCK_SIZE];
+        }
+    }
+    return NULL;
+}
+
+EFI_STATUS image_prefetch(struct efi_image *image, UINT64 offset, UINTN size) {
+    if (!image->cache.data || !size) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS err = image_wait(image);
+    if (err) {
+        return err;
+    }
+
+    UINT64 block = offset & ~IMAGE_CACHE_BLOCK_MASK;
+    UINTN count = (UINTN) ((offset + size - block + IMAGE_CACHE_BLOCK_MASK) / IMAGE_CACHE_BLOCK_SIZE);
+    if (count > IMAGE_CACHE_BLOCKS) {
+        count = IMAGE_CACHE_BLOCKS;
+    }
+
+    err = cache_fill(image, block, count);
+    return err == EFI_END_OF_MEDIA ? EFI_SUCCESS : err;
+}
+
+static inline enum timing_source image_source(const struct efi_image *image) {
+    if (image->partition_handle) {
+        return image->partition_source;
+    }
+    return image->file.lz4 ? TIMING_SOURCE_LZ4 : TIMING_SOURCE_FILE;
+}
+
+UINTN image_read_cached(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    struct efi_image_cache *cache = &image->cache;
+    if (!cache->data) {
+        return 0;
+    }
+
+    UINT64 start = timing_read_tsc();
+    UINT64 start_offset = offset;
+    UINT8 *p = buffer;
+    while (buffer_size) {
+        UINT8 *data = cache_lookup(cache, offset & ~IMAGE_CACHE_BLOCK_MASK);
+        if (!data) {
+            break;
+        }
+        ++cache->hits;
+
+        UINTN block_offset = (UINTN) offset & IMAGE_CACHE_BLOCK_MASK;
+        UINTN size = IMAGE_CACHE_BLOCK_SIZE - block_offset;
+        if (size > buffer_size) {
+            size = buffer_size;
+        }
+
+        CopyMem(p, &data[block_offset], size);
+        offset += size;
+        p += size;
+        buffer_size -= size;
+    }
+
+    UINTN copied = (UINTN) (p - (UINT8*) buffer);
+    if (copied) {
+        trace_cache_hit(image_source(image), start_offset, buffer, copied, start, timing_read_tsc() - start);
+        if (image->callback) {
+            image_callback(image, buffer, copied);
+        }
+    }
+    return copied;
+}
+
+EFI_STATUS image_open(struct efi_image *image, EFI_HANDLE loader, EFI_HANDLE loader_device,
+                      EFI_HANDLE partition, CHAR16 *path) {
+    EFI_STATUS err;
+    image->callback = NULL;
+    image->callback_context = NULL;
+    image->callback_ticks = 0;
+    image->partition_handle = partition;
+    image->partition_source = TIMING_SOURCE_PARTITION;
+
     if (path) {
-        return file_open(image, loader_device, path);
+        err = file_open(image, loader_device, path);
     } else {
-        return partition_open(image, loader);
+        err = partition_open(image, loader);
+    }
+
+    if (!err) {
+        cache_open(&image->cache);
+    }
+    return err;
+}
+
+EFI_STATUS image_read(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    // Pending reads must be completed first so the callback sees all data in order
+    EFI_STATUS err = image_wait(image);
+    if (err) {
+        return err;
+    }
+
+    while (buffer_size) {
+        UINTN size = image_read_cached(image, offset, buffer, buffer_size);
+        if (!size) {
+            // Only small reads are worth caching
+            if (!image->cache.data || buffer_size > IMAGE_CACHE_BLOCK_SIZE) {
+                break;
+            }
+
+            err = cache_fill(image, offset & ~IMAGE_CACHE_BLOCK_MASK, 1);
+            if (err == EFI_END_OF_MEDIA) {
+                break;
+            }
+            if (err) {
+                return err;
+            }
+            continue;
+        }
+
+        offset += size;
+        buffer = (VOID*) ((UINTN) buffer + size);
+        buffer_size -= size;
+    }
+
+    if (!buffer_size) {
+        return EFI_SUCCESS;
     }
+
+    err = image_read_async(image, offset, buffer, buffer_size);
+    EFI_STATUS status = image_wait(image);
+    return err ? err : status;
 }
 
-EFI_STATUS image_read(const struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+EFI_STATUS image_read_async(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size) {
+    UINT64 start = timing_read_tsc();
+    UINT64 callback_ticks = image->callback_ticks;
+    enum timing_source source = image_source(image);
+    EFI_STATUS err;
+
     if (image->partition_handle) {
-        return partition_read(&image->partition, offset, buffer, buffer_size);
+        err = partition_read_async(image, offset, buffer, buffer_size);
+    } else if (image->file.lz4) {
+        err = lz4_read(&image->file, offset, buffer, buffer_size);
     } else {
-        return file_read(&image->file, offset, buffer, buffer_size);
+        err = file_read(&image->file, offset, buffer, buffer_size);
+    }
+
+    if (!err && !image->partition_handle && image->callback) {
+        // Files are read synchronously
+        image_callback(image, buffer, buffer_size);
     }
+
+    UINT64 ticks = timing_read_tsc() - start - (image->callback_ticks - callback_ticks);
+    timing_record_read(source, 1, err ? 0 : buffer_size, ticks);
+    trace_read(source, offset, buffer, buffer_size, start, ticks);
+    return err;
 }
 
-VOID image_close(const struct efi_image *image, EFI_HANDLE loader) {
+EFI_STATUS image_read_regions(struct efi_image *image, const struct image_region *regions, UINTN count) {
+    for (UINTN i = 0; i < count; ++i) {
+        if (!regions[i].size) {
+            continue;
+        }
+
+        EFI_STATUS err = image_read_async(image, regions[i].offset, regions[i].buffer, regions[i].size);
+        if (err) {
+            return err;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS image_wait(struct efi_image *image) {
+    if (!image->partition_handle) {
+        return EFI_SUCCESS;
+    }
+
+    UINT64 start = timing_read_tsc();
+    UINT64 callback_ticks = image->callback_ticks;
+    EFI_STATUS err = partition_wait(image);
+    timing_record_read(image->partition_source, 0, 0,
+                       timing_read_tsc() - start - (image->callback_ticks - callback_ticks));
+    return err;
+}
+
+VOID image_close(struct efi_image *image, EFI_HANDLE loader) {
+    cache_close(&image->cache);
+
     if (image->partition_handle) {
         partition_close(image, loader);
     } else {
@@ -5,19 +5,67 @@
 #define ANDROID_EFI_IMAGE_H
 
 #include <efi.h>
+#include "protocol.h"
+#include "timing.h"
+
+#define PARTITION_QUEUE_DEPTH  4
 
 struct efi_image_partition {
     EFI_BLOCK_IO  *block_io;
     EFI_DISK_IO   *disk_io;
+    struct efi_disk_io2 *disk_io2;   // Optional, used for asynchronous reads
+    struct efi_block_io2 *block_io2; // Optional, used for asynchronous reads of whole blocks
+
+    UINTN block_shift; // Zero if blocks cannot be read directly
+    UINTN io_align_mask;
+
+    // Ring buffer of reads that are currently in flight
+    struct efi_io2_token queue[PARTITION_QUEUE_DEPTH];
+    struct {
+        VOID *buffer;
+        UINTN size;
+        UINT32 trace_id; // Trace entry of the read the chunk belongs to
+    } pending[PARTITION_QUEUE_DEPTH];
+    UINTN queue_head, queue_size;
+    UINT32 trace_id; // Trace entry of the read being submitted
 };
 
+struct efi_image_lz4;
+
 struct efi_image_file {
     EFI_FILE_HANDLE dir;
     EFI_FILE_HANDLE file;
+    UINT64 position;
+
+    struct efi_image_lz4 *lz4; // Set for LZ4 compressed images
+};
+
+// Small reads (e.g. headers) are served from a cache of aligned blocks
+#define IMAGE_CACHE_BLOCK_SIZE  0x1000
+#define IMAGE_CACHE_BLOCKS      8
+
+struct efi_image_cache {
+    UINT8 *data; // NULL if the cache could not be allocated
+    UINT64 offset[IMAGE_CACHE_BLOCKS]; // Image offset of each cached block
+    UINTN next; // Next block to replace
+
+    UINTN hits;   // Blocks served from the cache
+    UINTN misses; // Reads to fill the cache
 };
 
+// Called for each completed read, in the order the reads were started
+typedef VOID (*image_read_callback)(VOID *context, const VOID *buffer, UINTN size);
+
 struct efi_image {
     EFI_HANDLE partition_handle;
+    enum timing_source partition_source; // Recorded for reads from the partition
+
+    // Optional, e.g. to hash the data while the next reads are still in progress
+    image_read_callback callback;
+    VOID *callback_context;
+    UINT64 callback_ticks; // TSC ticks spent in the callback, excluded from the read statistics
+
+    struct efi_image_cache cache;
 
     union {
         struct efi_image_partition partition;
@@ -25,9 +73,38 @@ struct efi_image {
     };
 };
 
+// The image is read from the partition, or from the file at path (on the partition or the loader device)
 EFI_STATUS image_open(struct efi_image *image, EFI_HANDLE loader, EFI_HANDLE loader_device,
-                      EFI_GUID *partition_guid, CHAR16 *path);
-EFI_STATUS image_read(const struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size);
-VOID image_close(const struct efi_image *image, EFI_HANDLE loader);
+                      EFI_HANDLE partition, CHAR16 *path);
+EFI_STATUS image_read(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size);
+VOID image_close(struct efi_image *image, EFI_HANDLE loader);
+
+/*
+ * Asynchronous reads: The buffer must not be accessed until image_wait()
+ * returns. Falls back to synchronous reads if not supported by the firmware.
+ */
+EFI_STATUS image_read_async(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size);
+EFI_STATUS image_wait(struct efi_image *image);
+
+// Read a range of the image into the cache at once (limited to the size of the cache)
+EFI_STATUS image_prefetch(struct efi_image *image, UINT64 offset, UINTN size);
+
+/*
+ * Copy the beginning of a range that is available in the cache, without reading from the image.
+ * Returns the number of bytes copied. Asynchronous reads must be completed first.
+ */
+UINTN image_read_cached(struct efi_image *image, UINT64 offset, VOID *buffer, UINTN buffer_size);
+
+struct image_region {
+    UINT64 offset;
+    VOID *buffer;
+    UINTN size;
+};
+
+/*
+ * Read multiple regions of the image asynchronously, each directly into its own buffer.
+ * The regions must be sorted by offset so the image is read sequentially.
+ */
+EFI_STATUS image_read_regions(struct efi_image *image, const struct image_region *regions, UINTN count);
 
 #endif //ANDROID_EFI_IMAGE_H
@@ -3,6 +3,7 @@
 
 #include "linux.h"
 #include "malloc.h"
+#include "log.h"
 #include <efilib.h>
 
 #define SETUP_BOOT_FLAG        0xAA55
@@ -10,12 +11,36 @@
 #define MIN_KERNEL_VERSION     0x20c       /* For EFI Handover protocol */
 #define ANDROID_EFI_LOADER_ID  0xFF
 
+#define XLF_CAN_BE_LOADED_ABOVE_4G  (1<<1)
+
 #ifdef __x86_64__
 #define XLF_EFI_HANDOVER       (1<<3)      /* XLF_EFI_HANDOVER_64 */
 #else
 #define XLF_EFI_HANDOVER       (1<<2)      /* XLF_EFI_HANDOVER_32 */
 #endif
 
+// Ramdisk and command line can be placed anywhere in memory if supported by the kernel
+static EFI_PHYSICAL_ADDRESS max_address(const struct linux_setup_header *header, EFI_PHYSICAL_ADDRESS max) {
+#ifdef __x86_64__
+    if (header->xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G) {
+        return UINT64_MAX;
+    }
+#else
+    (VOID) header;
+#endif
+    return max;
+}
+
+// Store the upper 32 bits in the boot parameters and return the lower 32 bits
+static inline UINT32 set_ext_value(struct linux_setup_header *header, UINTN offset, UINT64 value) {
+    *linux_boot_params_ext(header, offset) = (UINT32) (value >> 32);
+    return (UINT32) value;
+}
+
+static inline EFI_STATUS free_pages(EFI_PHYSICAL_ADDRESS addr, UINTN size) {
+    return uefi_call_wrapper(BS->FreePages, 2, addr, EFI_SIZE_TO_PAGES(size));
+}
+
 EFI_STATUS linux_allocate_boot_params(VOID **boot_params) {
     EFI_PHYSICAL_ADDRESS addr;
     EFI_STATUS err = malloc_low(LINUX_BOOT_PARAMS_SIZE, 0x1, &addr);
@@ -31,20 +56,20 @@ EFI_STATUS linux_allocate_boot_params(VOID **boot_params) {
 EFI_STATUS linux_check_kernel_header(const struct linux_setup_header *header) {
     // Check that this is actually a kernel header
     if (header->boot_flag != SETUP_BOOT_FLAG || header->header != SETUP_HEADER_MAGIC) {
-        Print(L"Kernel does not contain a valid setup header. Boot flag: 0x%x, header: 0x%x\n",
-              header->boot_flag, header->header);
+        log_error(L"Kernel does not contain a valid setup header. Boot flag: 0x%x, header: 0x%x\n",
+                  header->boot_flag, header->header);
         return EFI_VOLUME_CORRUPTED;
     }
 
     // Check setup header version
     if (header->version < MIN_KERNEL_VERSION) {
-        Print(L"Kernel version too old: 0x%x\n", header->version);
+        log_error(L"Kernel version too old: 0x%x\n", header->version);
         return EFI_UNSUPPORTED;
     }
 
     // Check that kernel supports the EFI handover protocol
     if (!(header->xloadflags & XLF_EFI_HANDOVER)) {
-        Print(L"Kernel does not support the EFI handover protocol. xloadflags: 0x%x\n", header->xloadflags);
+        log_error(L"Kernel does not support the EFI handover protocol. xloadflags: 0x%x\n", header->xloadflags);
         return EFI_UNSUPPORTED;
     }
 
@@ -54,11 +79,10 @@ EFI_STATUS linux_check_kernel_header(const struct linux_setup_header *header) {
 EFI_STATUS linux_allocate_kernel(struct linux_setup_header *header) {
     // Attempt to allocate preferred address
     EFI_PHYSICAL_ADDRESS addr = header->pref_address;
-    EFI_STATUS err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData,
-                                       EFI_SIZE_TO_PAGES(header->init_size), &addr);
+    EFI_STATUS err = malloc_at(header->init_size, addr);
     if (err) {
         if (!header->relocatable_kernel) {
-            Print(L"Failed to allocate preferred kernel address for non relocatable kernel: 0x%x\n", header->pref_address);
+            log_error(L"Failed to allocate preferred kernel address for non relocatable kernel: 0x%x\n", header->pref_address);
             return err;
         }
 
@@ -69,30 +93,37 @@ EFI_STATUS linux_allocate_kernel(struct linux_setup_header *header) {
         }
     }
 
+    // The EFI handover entry point is located using the 32-bit code32_start
+    if (addr + header->init_size > UINT32_MAX) {
+        log_error(L"Kernel was allocated above 4 GiB\n");
+        free_pages(addr, header->init_size);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
     header->code32_start = (UINT32) addr;
     return EFI_SUCCESS;
 }
 
-EFI_STATUS linux_allocate_ramdisk(struct linux_setup_header *header, UINT32 size) {
-    EFI_PHYSICAL_ADDRESS addr = header->initrd_addr_max;
+EFI_STATUS linux_allocate_ramdisk(struct linux_setup_header *header, UINTN size) {
+    EFI_PHYSICAL_ADDRESS addr = max_address(header, header->initrd_addr_max);
     EFI_STATUS err = malloc_high(size, &addr);
     if (err) {
         return err;
     }
 
-    header->ramdisk_image = (UINT32) addr;
-    header->ramdisk_size = size;
+    header->ramdisk_image = set_ext_value(header, LINUX_EXT_RAMDISK_IMAGE, addr);
+    header->ramdisk_size = set_ext_value(header, LINUX_EXT_RAMDISK_SIZE, size);
     return EFI_SUCCESS;
 }
 
 EFI_STATUS linux_allocate_cmdline(struct linux_setup_header *header) {
-    EFI_PHYSICAL_ADDRESS addr = UINT32_MAX;
-    EFI_STATUS err = malloc_high(LINUX_CMDLINE_SIZE, &addr);
+    EFI_PHYSICAL_ADDRESS addr = max_address(header, UINT32_MAX);
+    EFI_STATUS err = malloc_high(linux_cmdline_size(header), &addr);
     if (err) {
         return err;
     }
 
-    header->cmd_line_ptr = (UINT32) addr;
+    header->cmd_line_ptr = set_ext_value(header, LINUX_EXT_CMD_LINE_PTR, addr);
     return EFI_SUCCESS;
 }
 
@@ -120,8 +151,62 @@ VOID linux_efi_boot(EFI_HANDLE image, VOID *boot_params) {
     handover(image, ST, boot_params);
 }
 
-static inline EFI_STATUS free_pages(EFI_PHYSICAL_ADDRESS addr, UINTN size) {
-    return uefi_call_wrapper(BS->FreePages, 2, addr, EFI_SIZE_TO_PAGES(size));
+// Initrd media
+
+static EFI_GUID LoadFile2Protocol = EFI_LOAD_FILE2_PROTOCOL_GUID;
+
+static struct {
+    VENDOR_DEVICE_PATH vendor;
+    EFI_DEVICE_PATH end;
+} __attribute__((packed)) initrd_media_path = {
+    {
+        { MEDIA_DEVICE_PATH, MEDIA_VENDOR_DP, { sizeof(VENDOR_DEVICE_PATH), 0 } },
+        { 0x5568e427, 0x68fc, 0x4f3d, { 0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68 } }
+    },
+    { END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE, { sizeof(EFI_DEVICE_PATH), 0 } }
+};
+
+static EFI_STATUS EFIAPI initrd_media_load_file(struct efi_load_file2 *this, EFI_DEVICE_PATH *file_path,
+                                                BOOLEAN boot_policy, UINTN *buffer_size, VOID *buffer) {
+    struct linux_initrd_media *media = (struct linux_initrd_media*) this;
+    (VOID) file_path;
+
+    if (!buffer_size) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if (boot_policy) {
+        return EFI_UNSUPPORTED;
+    }
+
+    // The kernel asks for the size first
+    if (!buffer || *buffer_size < media->size) {
+        *buffer_size = media->size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    *buffer_size = media->size;
+    return media->load(media->context, buffer);
+}
+
+EFI_STATUS linux_install_initrd_media(struct linux_initrd_media *media, UINTN size,
+                                      linux_initrd_load load, VOID *context) {
+    media->load_file.load_file = initrd_media_load_file;
+    media->handle = NULL;
+    media->size = size;
+    media->load = load;
+    media->context = context;
+
+    // Fails if another loader has installed the device path already
+    return uefi_call_wrapper(BS->InstallMultipleProtocolInterfaces, 6, &media->handle,
+                             &DevicePathProtocol, &initrd_media_path, &LoadFile2Protocol, &media->load_file, NULL);
+}
+
+VOID linux_uninstall_initrd_media(struct linux_initrd_media *media) {
+    if (media->handle) {
+        uefi_call_wrapper(BS->UninstallMultipleProtocolInterfaces, 5, media->handle,
+                          &DevicePathProtocol, &initrd_media_path, &LoadFile2Protocol, &media->load_file, NULL);
+        media->handle = NULL;
+    }
 }
 
 VOID linux_free(VOID *boot_params) {
@@ -129,11 +214,12 @@ VOID linux_free(VOID *boot_params) {
     if (header->code32_start) {
         free_pages(header->code32_start, header->init_size);
     }
-    if (header->ramdisk_image) {
-        free_pages(header->ramdisk_image, header->ramdisk_size);
+    if (linux_ramdisk_pointer(header)) {
+        free_pages((UINTN) linux_ramdisk_pointer(header),
+                   linux_ext_value(header, LINUX_EXT_RAMDISK_SIZE, header->ramdisk_size));
     }
-    if (header->cmd_line_ptr) {
-        free_pages(header->cmd_line_ptr, header->cmdline_size);
+    if (linux_cmdline_pointer(header)) {
+        free_pages((UINTN) linux_cmdline_pointer(header), linux_cmdline_size(header));
     }
 
     free_pages((EFI_PHYSICAL_ADDRESS) boot_params, LINUX_BOOT_PARAMS_SIZE);
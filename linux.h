@@ -5,11 +5,16 @@
 #define ANDROID_EFI_LINUX_H
 
 #include <efi.h>
+#include "protocol.h"
 
 #define LINUX_BOOT_PARAMS_SIZE     0x4000
 #define LINUX_SETUP_HEADER_OFFSET  0x01f1
 #define LINUX_SETUP_SECT_SIZE      512
-#define LINUX_CMDLINE_SIZE         EFI_PAGE_SIZE
+
+// Upper 32 bits of addresses and sizes in struct boot_params (for kernels loaded above 4 GiB)
+#define LINUX_EXT_RAMDISK_IMAGE    0x0c0
+#define LINUX_EXT_RAMDISK_SIZE     0x0c4
+#define LINUX_EXT_CMD_LINE_PTR     0x0c8
 
 /*
  * Taken from the Linux kernel: (GPL-2.0)
@@ -59,7 +64,7 @@ struct linux_setup_header {
 EFI_STATUS linux_allocate_boot_params(VOID **boot_params);
 EFI_STATUS linux_check_kernel_header(const struct linux_setup_header *header);
 EFI_STATUS linux_allocate_kernel(struct linux_setup_header *header);
-EFI_STATUS linux_allocate_ramdisk(struct linux_setup_header *header, UINT32 size);
+EFI_STATUS linux_allocate_ramdisk(struct linux_setup_header *header, UINTN size);
 EFI_STATUS linux_allocate_cmdline(struct linux_setup_header *header);
 VOID linux_efi_boot(EFI_HANDLE image, VOID *boot_params);
 
@@ -75,14 +80,48 @@ static inline VOID* linux_kernel_pointer(const struct linux_setup_header *header
     return (VOID*) (UINTN) header->code32_start;
 }
 
+// The setup header is always part of the boot parameters
+static inline UINT32* linux_boot_params_ext(const struct linux_setup_header *header, UINTN offset) {
+    return (UINT32*) ((UINTN) header - LINUX_SETUP_HEADER_OFFSET + offset);
+}
+
+static inline UINT64 linux_ext_value(const struct linux_setup_header *header, UINTN offset, UINT32 low) {
+    return (UINT64) *linux_boot_params_ext(header, offset) << 32 | low;
+}
+
 static inline VOID* linux_ramdisk_pointer(const struct linux_setup_header *header) {
-    return (VOID*) (UINTN) header->ramdisk_image;
+    return (VOID*) (UINTN) linux_ext_value(header, LINUX_EXT_RAMDISK_IMAGE, header->ramdisk_image);
+}
+
+// Size of the command line buffer (cmdline_size does not include the null terminator)
+static inline UINTN linux_cmdline_size(const struct linux_setup_header *header) {
+    return (UINTN) header->cmdline_size + 1;
 }
 
 static inline CHAR8* linux_cmdline_pointer(const struct linux_setup_header *header) {
-    return (CHAR8*) (UINTN) header->cmd_line_ptr;
+    return (CHAR8*) (UINTN) linux_ext_value(header, LINUX_EXT_CMD_LINE_PTR, header->cmd_line_ptr);
 }
 
+/*
+ * Newer kernels (5.8+) load the initrd themselves through the LoadFile2 protocol installed on a
+ * vendor media device path (LINUX_EFI_INITRD_MEDIA_GUID), into memory allocated by the kernel.
+ */
+
+typedef EFI_STATUS (*linux_initrd_load)(VOID *context, VOID *buffer);
+
+struct linux_initrd_media {
+    struct efi_load_file2 load_file;
+    EFI_HANDLE handle;
+    UINTN size;
+
+    linux_initrd_load load;
+    VOID *context;
+};
+
+EFI_STATUS linux_install_initrd_media(struct linux_initrd_media *media, UINTN size,
+                                      linux_initrd_load load, VOID *context);
+VOID linux_uninstall_initrd_media(struct linux_initrd_media *media);
+
 VOID linux_free(VOID *boot_params);
 
 #endif //ANDROID_EFI_LINUX_H
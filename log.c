@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "log.h"
+#include "guid.h"
+#include <efilib.h>
+
+#define LOG_VARIABLE         L"LoaderLog"
+#define VARIABLE_ATTRIBUTES  (EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS)
+
+static BOOLEAN verbose;
+
+// Ring buffer, length is the total number of characters written so far
+static CHAR16 buffer[LOG_BUFFER_SIZE];
+static UINTN length;
+static UINTN printed; // Characters that were already printed
+
+// Linear copy of the ring buffer for printing or exporting
+static CHAR16 output[LOG_BUFFER_SIZE + 1];
+
+VOID log_set_verbose(BOOLEAN enable) {
+    verbose = enable;
+    if (verbose) {
+        log_flush();
+    }
+}
+
+static VOID append(const CHAR16 *s, UINTN len) {
+    for (UINTN i = 0; i < len; ++i) {
+        buffer[length++ % LOG_BUFFER_SIZE] = s[i];
+    }
+}
+
+// Copy the characters written after start (limited to the ring buffer) and terminate the string
+static UINTN copy_since(CHAR16 *dest, UINTN start) {
+    if (length - start > LOG_BUFFER_SIZE) {
+        start = length - LOG_BUFFER_SIZE;
+    }
+
+    UINTN len = 0;
+    for (UINTN i = start; i < length; ++i) {
+        dest[len++] = buffer[i % LOG_BUFFER_SIZE];
+    }
+    dest[len] = 0;
+    return len;
+}
+
+VOID EFIAPI log_print(enum log_level level, const CHAR16 *fmt, ...) {
+    if (level == LOG_DEBUG && !verbose) {
+        return;
+    }
+
+    CHAR16 line[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, fmt);
+    UINTN len = VSPrint(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    append(line, len);
+
+    if (verbose) {
+        log_flush();
+    }
+}
+
+VOID log_flush(VOID) {
+    if (printed == length) {
+        return;
+    }
+
+    copy_since(output, printed);
+    printed = length;
+    Print(L"%s", output);
+}
+
+VOID log_export(VOID) {
+    if (!length) {
+        return;
+    }
+
+    UINTN len = copy_since(output, 0);
+    uefi_call_wrapper(RT->SetVariable, 5, LOG_VARIABLE, &AndroidEfiVendorGuid, VARIABLE_ATTRIBUTES,
+                      (len + 1) * sizeof(*output), output);
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_LOG_H
+#define ANDROID_EFI_LOG_H
+
+#include <efi.h>
+
+/*
+ * Messages are collected in a ring buffer instead of writing them to the console directly,
+ * which can be very slow (e.g. on serial consoles). By default (quiet), they are only printed
+ * if booting fails (log_flush()). In verbose mode, all messages are printed immediately.
+ *
+ * Note: Must not be used from jobs on application processors (see mp.h).
+ */
+
+#define LOG_BUFFER_SIZE  4096 // Characters
+#define LOG_LINE_SIZE    256
+
+enum log_level {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG, // Only recorded in verbose mode
+};
+
+VOID log_set_verbose(BOOLEAN verbose);
+
+VOID EFIAPI log_print(enum log_level level, const CHAR16 *fmt, ...);
+
+#define log_error(...)    log_print(LOG_ERROR, __VA_ARGS__)
+#define log_warning(...)  log_print(LOG_WARNING, __VA_ARGS__)
+#define log_info(...)     log_print(LOG_INFO, __VA_ARGS__)
+#define log_debug(...)    log_print(LOG_DEBUG, __VA_ARGS__)
+
+// Print all messages that were not printed yet
+VOID log_flush(VOID);
+// Store the buffered messages in an EFI variable
+VOID log_export(VOID);
+
+#endif //ANDROID_EFI_LOG_H
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "lz4.h"
+#include "log.h"
+#include <efilib.h>
+
+/*
+ * Minimal decoder for the LZ4 frame format (only independent blocks are supported).
+ * See: https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+ */
+
+#define FLG_VERSION_MASK      0xC0
+#define FLG_VERSION           0x40
+#define FLG_BLOCK_INDEPENDENT (1 << 5)
+#define FLG_BLOCK_CHECKSUM    (1 << 4)
+#define FLG_CONTENT_SIZE      (1 << 3)
+#define FLG_DICT_ID           (1 << 0)
+#define BD_BLOCK_SIZE_SHIFT   4
+#define BD_BLOCK_SIZE_MASK    0x7
+
+#define MIN_MATCH             4
+
+EFI_STATUS lz4_parse_frame(const VOID *header, UINTN size, struct lz4_frame *frame) {
+    const UINT8 *h = header;
+    if (size < 7 || *((const UINT32*) h) != LZ4_FRAME_MAGIC) {
+        log_error(L"Image is not a LZ4 frame\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    UINT8 flg = h[4], bd = h[5];
+    if ((flg & FLG_VERSION_MASK) != FLG_VERSION) {
+        log_error(L"Unsupported LZ4 frame version\n");
+        return EFI_UNSUPPORTED;
+    }
+
+    // Random access is only possible if all blocks can be decompressed independently
+    if (!(flg & FLG_BLOCK_INDEPENDENT) || (flg & FLG_DICT_ID)) {
+        log_error(L"LZ4 frame must consist of independent blocks without dictionary\n");
+        return EFI_UNSUPPORTED;
+    }
+
+    UINTN block_size_id = (bd >> BD_BLOCK_SIZE_SHIFT) & BD_BLOCK_SIZE_MASK;
+    if (block_size_id < 4) {
+        log_error(L"Invalid LZ4 block size: %d\n", block_size_id);
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    frame->block_shift = 8 + 2 * block_size_id; // 64 KiB, 256 KiB, 1 MiB or 4 MiB
+    frame->block_size = 1 << frame->block_shift;
+    frame->block_checksum = flg & FLG_BLOCK_CHECKSUM ? TRUE : FALSE;
+
+    // Magic, FLG, BD, optional content size and header checksum
+    frame->header_size = 4 + 2 + (flg & FLG_CONTENT_SIZE ? 8 : 0) + 1;
+    return EFI_SUCCESS;
+}
+
+static inline BOOLEAN read_length(const UINT8 **ip, const UINT8 *end, UINTN *len) {
+    UINT8 b;
+    do {
+        if (*ip >= end) {
+            return FALSE;
+        }
+
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 0xFF);
+    return TRUE;
+}
+
+EFI_STATUS lz4_decompress(const VOID *src, UINTN src_size, VOID *dst, UINTN *dst_size) {
+    const UINT8 *ip = src, *ip_end = ip + src_size;
+    UINT8 *op = dst, *op_end = op + *dst_size;
+
+    while (ip < ip_end) {
+        UINT8 token = *ip++;
+
+        // Literals
+        UINTN len = token >> 4;
+        if (len == 0xF && !read_length(&ip, ip_end, &len)) {
+            goto err;
+        }
+        if ((UINTN) (ip_end - ip) < len || (UINTN) (op_end - op) < len) {
+            goto err;
+        }
+
+        CopyMem(op, ip, len);
+        ip += len;
+        op += len;
+
+        if (ip == ip_end) {
+            break; // Last sequence does not have a match
+        }
+
+        // Match
+        if (ip_end - ip < 2) {
+            goto err;
+        }
+
+        UINTN offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!offset || offset > (UINTN) (op - (UINT8*) dst)) {
+            goto err;
+        }
+
+        len = token & 0xF;
+        if (len == 0xF && !read_length(&ip, ip_end, &len)) {
+            goto err;
+        }
+
+        len += MIN_MATCH;
+        if ((UINTN) (op_end - op) < len) {
+            goto err;
+        }
+
+        // Matches may overlap with the output, so they need to be copied byte by byte
+        const UINT8 *match = op - offset;
+        while (len--) {
+            *op++ = *match++;
+        }
+    }
+
+    *dst_size = op - (UINT8*) dst;
+    return EFI_SUCCESS;
+
+err:
+    log_error(L"Invalid LZ4 compressed data\n");
+    return EFI_VOLUME_CORRUPTED;
+}
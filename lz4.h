@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_LZ4_H
+#define ANDROID_EFI_LZ4_H
+
+#include <efi.h>
+
+#define LZ4_FRAME_MAGIC             0x184D2204
+#define LZ4_FRAME_MAX_HEADER_SIZE   19
+#define LZ4_BLOCK_UNCOMPRESSED      (1U << 31)
+
+struct lz4_frame {
+    UINTN header_size;
+    UINTN block_shift;
+    UINTN block_size; // Maximum size of a decompressed block
+    BOOLEAN block_checksum;
+};
+
+EFI_STATUS lz4_parse_frame(const VOID *header, UINTN size, struct lz4_frame *frame);
+EFI_STATUS lz4_decompress(const VOID *src, UINTN src_size, VOID *dst, UINTN *dst_size);
+
+#endif //ANDROID_EFI_LZ4_H
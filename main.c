@@ -6,21 +6,47 @@
 
 #include "string.h"
 #include "guid.h"
+#include "cmdline.h"
+#include "partition.h"
+#include "bootctrl.h"
 #include "android.h"
 #include "linux.h"
+#include "ramdisk_cache.h"
 #include "graphics.h"
+#include "malloc.h"
+#include "timing.h"
+#include "trace.h"
+#include "log.h"
 
 #ifndef ANDROID_EFI_VERSION
 #define ANDROID_EFI_VERSION  "unknown"
 #endif
 
-struct android_efi_options {
+struct image_partition {
     EFI_GUID guid;
-    EFI_GUID *partition_guid;
+    const CHAR16 *label; // Points into the command line, NULL if the partition is specified by GUID
+    UINTN label_length;
+};
+
+struct android_efi_options {
+    // Multiple partitions are used as slots (A/B) in the order they were specified
+    struct image_partition partitions[BOOTCTRL_MAX_SLOTS];
+    UINTN partition_count;
     CHAR16 *path;
 
     const CHAR16 *kernel_parameters;
     UINTN kernel_parameters_length;
+
+    BOOLEAN verify;
+    BOOLEAN no_splash;
+    BOOLEAN second_initrd;
+    BOOLEAN recovery;
+    BOOLEAN update_bootctrl;
+    BOOLEAN initrd_media;
+    BOOLEAN initrd_cache;
+    BOOLEAN trace;
+    BOOLEAN verbose;
+    BOOLEAN log_variable;
 };
 
 enum command_line_argument {
@@ -35,21 +61,109 @@ enum command_line_argument {
 
 #define is_flag(flag, len, f) ((len) == STRING_LENGTH(f) && CompareMem(flag, f, STRING_LENGTH(f)) == 0)
 
-static EFI_STATUS parse_flag(const CHAR16 *flag, UINTN len) {
+static EFI_STATUS parse_flag(struct android_efi_options *options, const CHAR16 *flag, UINTN len) {
     if (is_flag(flag, len, L"--version")) {
         Print(L"android-efi version " ANDROID_EFI_VERSION "\n");
         return EFI_ABORTED;
     }
 
+    if (is_flag(flag, len, L"--verify")) {
+        options->verify = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--no-splash")) {
+        options->no_splash = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--second-initrd")) {
+        options->second_initrd = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--recovery")) {
+        options->recovery = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--update-bootctrl")) {
+        options->update_bootctrl = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--initrd-media")) {
+        options->initrd_media = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--initrd-cache")) {
+        options->initrd_cache = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--trace")) {
+        options->trace = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--verbose")) {
+        options->verbose = TRUE;
+        return EFI_SUCCESS;
+    }
+
+    if (is_flag(flag, len, L"--log-variable")) {
+        options->log_variable = TRUE;
+        return EFI_SUCCESS;
+    }
+
     CHAR16 *copy = StrnDuplicate(flag, len);
-    Print(L"Unknown command line flag: %s\n", copy);
+    log_error(L"Unknown command line flag: %s\n", copy);
     FreePool(copy);
     return EFI_INVALID_PARAMETER;
 }
 
+// Comma separated list of partition GUIDs or labels
+static EFI_STATUS parse_partitions(struct android_efi_options *options, const CHAR16 *opt, UINTN len) {
+    for (UINTN start = 0, i = 0; i <= len; ++i) {
+        if (i < len && opt[i] != L',') {
+            continue;
+        }
+
+        if (options->partition_count == BOOTCTRL_MAX_SLOTS) {
+            log_error(L"Too many partitions (maximum: %d)\n", BOOTCTRL_MAX_SLOTS);
+            return EFI_INVALID_PARAMETER;
+        }
+
+        struct image_partition *partition = &options->partitions[options->partition_count++];
+        UINTN length = i - start;
+        if (!guid_parse(&partition->guid, &opt[start], length)) {
+            if (!length || length > PARTITION_LABEL_LENGTH) {
+                CHAR16 *s = StrnDuplicate(&opt[start], length);
+                log_error(L"Expected valid partition GUID or label, got '%s'\n", s);
+                FreePool(s);
+                return EFI_INVALID_PARAMETER;
+            }
+
+            partition->label = &opt[start];
+            partition->label_length = length;
+        }
+
+        start = i + 1;
+    }
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS parse_image(struct android_efi_options *options, const CHAR16 *opt, UINTN len, UINTN path) {
     if (path) {
-        options->path = StrnDuplicate(opt, len);
+        options->path = malloc_pool((len + 1) * sizeof(CHAR16));
+        if (!options->path) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+
+        CopyMem(options->path, opt, len * sizeof(CHAR16));
+        options->path[len] = 0;
 
         // Clean path (replace forward slashes with backward slashes)
         for (UINTN i = 0; i < len; ++i) {
@@ -58,13 +172,7 @@ static EFI_STATUS parse_image(struct android_efi_options *options, const CHAR16
             }
         }
     } else if (len) {
-        options->partition_guid = &options->guid;
-        if (!guid_parse(options->partition_guid, opt, len)) {
-            CHAR16 *guid = StrnDuplicate(opt, len);
-            Print(L"Expected valid partition GUID, got '%s'\n", guid);
-            FreePool(guid);
-            return EFI_INVALID_PARAMETER;
-        }
+        return parse_partitions(options, opt, len);
     }
 
     return EFI_SUCCESS;
@@ -160,7 +268,7 @@ static EFI_STATUS parse_command_line(EFI_LOADED_IMAGE_PROTOCOL *loaded_image, st
                 goto out; // Break the loop
 
             case FLAG:
-                err = parse_flag(&opt[start], len);
+                err = parse_flag(options, &opt[start], len);
                 if (err) {
                     goto end;
                 }
@@ -188,191 +296,564 @@ static EFI_STATUS parse_command_line(EFI_LOADED_IMAGE_PROTOCOL *loaded_image, st
     }
 
 out:
-    if (!options->partition_guid && !options->path) {
+    if (!options->partition_count && !options->path) {
+        err = EFI_INVALID_PARAMETER;
+        log_error(L"Usage: android.efi <Boot Partition GUID/Label[,...]/Path> [-- Additional Kernel Parameters...]\n");
+    }
+
+    // The ramdisk is only read by the kernel after it was started, too late to reject a corrupted image
+    if (!err && options->verify && options->initrd_media) {
         err = EFI_INVALID_PARAMETER;
-        Print(L"Usage: android.efi <Boot Partition GUID/Path> [-- Additional Kernel Parameters...]\n");
+        log_error(L"--verify cannot be used together with --initrd-media\n");
     }
 
 end:
+    return err;
+}
+
+#define NO_SLOT  ((UINTN) -1)
+#define MISC_PARTITION_LABEL         L"misc"
+#define VENDOR_BOOT_PARTITION_LABEL  L"vendor_boot"
+#define SLOT_SUFFIX_PARAM            "androidboot.slot_suffix=_"
+#define FORCE_NORMAL_BOOT_PARAM      "androidboot.force_normal_boot=1"
+
+struct boot_slot {
+    EFI_HANDLE partition; // NULL to load the image from the loader device
+    UINTN slot; // NO_SLOT if the partition was not selected from multiple slots
+};
+
+static EFI_STATUS find_partition(const struct partition_index *index, const struct image_partition *partition,
+                                 EFI_HANDLE *handle) {
+    const struct partition_entry *entry;
+    if (partition->label) {
+        entry = partition_index_find_label(index, partition->label, partition->label_length);
+    } else {
+        entry = partition_index_find(index, &partition->guid);
+    }
+
+    if (!entry || !entry->handle) {
+        if (partition->label) {
+            CHAR16 *label = StrnDuplicate(partition->label, partition->label_length);
+            log_error(L"Partition not found (or ambiguous): %s\n", label);
+            FreePool(label);
+        } else {
+            log_error(L"Partition not found: %g\n", &partition->guid);
+        }
+        return EFI_NO_MEDIA;
+    }
+
+    if (entry->ambiguous) {
+        log_error(L"Ambiguous partition GUID: %g\n", &entry->guid);
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    *handle = entry->handle;
+    return EFI_SUCCESS;
+}
+
+/*
+ * Find the partitions to boot from, in the order they should be tried. The partitions of all disks are
+ * enumerated only once, so falling back to another slot does not require searching them again.
+ * The index is only built if needed (entries is NULL otherwise).
+ */
+static EFI_STATUS find_boot_slots(const struct android_efi_options *options, struct partition_index *index,
+                                  struct bootctrl *bootctrl, struct boot_slot *slots, UINTN *count) {
+    index->entries = NULL;
+    bootctrl->disk_io = NULL;
+    slots[0].partition = NULL;
+    slots[0].slot = NO_SLOT;
+    *count = 1;
+
+    if (!options->partition_count) {
+        return EFI_SUCCESS;
+    }
+    if (options->partition_count == 1 && !options->partitions[0].label) {
+        return partition_find((EFI_GUID*) &options->partitions[0].guid, &slots[0].partition);
+    }
+
+    EFI_STATUS err = partition_index_build(index);
     if (err) {
-        FreePool(options->path);
+        return err;
     }
-    return err;
+
+    if (options->partition_count == 1) {
+        return find_partition(index, &options->partitions[0], &slots[0].partition);
+    }
+
+    // Without valid slot metadata in the misc partition all slots are tried in order
+    const struct partition_entry *misc = partition_index_find_label(index, MISC_PARTITION_LABEL,
+                                                                    STRING_LENGTH(MISC_PARTITION_LABEL));
+    if (misc && misc->handle && !misc->ambiguous) {
+        bootctrl_open(bootctrl, misc->handle);
+    }
+
+    UINTN order[BOOTCTRL_MAX_SLOTS];
+    UINTN order_count = bootctrl_order(bootctrl, options->partition_count, order);
+
+    *count = 0;
+    for (UINTN i = 0; i < order_count; ++i) {
+        struct boot_slot *slot = &slots[*count];
+        slot->slot = order[i];
+        if (!find_partition(index, &options->partitions[order[i]], &slot->partition)) {
+            ++*count;
+        }
+    }
+
+    if (!*count) {
+        log_error(L"No bootable slot found\n");
+        return EFI_NOT_FOUND;
+    }
+    return EFI_SUCCESS;
+}
+
+// The vendor_boot partition of the slot (e.g. vendor_boot_a), found by its label
+static EFI_STATUS find_vendor_boot(struct partition_index *index, const struct boot_slot *slot, EFI_HANDLE *handle) {
+    if (!index->entries) {
+        EFI_STATUS err = partition_index_build(index);
+        if (err) {
+            return err;
+        }
+    }
+
+    CHAR16 label[] = VENDOR_BOOT_PARTITION_LABEL L"_x";
+    struct image_partition partition = { .label = label, .label_length = STRING_LENGTH(VENDOR_BOOT_PARTITION_LABEL) };
+    if (slot->slot != NO_SLOT) {
+        label[partition.label_length + 1] = bootctrl_slot_suffix(slot->slot);
+        partition.label_length += 2;
+    }
+
+    return find_partition(index, &partition, handle);
 }
 
 static EFI_STATUS prepare_cmdline(struct linux_setup_header *kernel_header, const struct android_image *android_image,
-        const struct android_efi_options *options) {
+        const struct android_efi_options *options, const struct boot_slot *slot, struct cmdline_initrd **initrds) {
     EFI_STATUS err = linux_allocate_cmdline(kernel_header);
     if (err) {
         return err;
     }
 
-    CHAR8 *cmdline = linux_cmdline_pointer(kernel_header);
-    CHAR8 *cmdline_end = cmdline + LINUX_CMDLINE_SIZE;
+    CHAR8 image_cmdline[ANDROID_MAX_CMDLINE_SIZE + 1];
+    err = android_copy_cmdline(android_image, image_cmdline, sizeof(image_cmdline));
+    if (err) {
+        return err;
+    }
 
-    if (options->kernel_parameters) {
-        // TODO: Check extra kernel parameters length?
+    CHAR8 loader_params[sizeof(SLOT_SUFFIX_PARAM) + 1 + sizeof(FORCE_NORMAL_BOOT_PARAM)];
+    CHAR8 *p = loader_params;
 
-        // Prepend extra kernel parameters
-        cmdline = str_utf16_to_utf8(cmdline, options->kernel_parameters, options->kernel_parameters_length);
+    // The slot suffix tells Android which slot was booted
+    if (slot->slot != NO_SLOT) {
+        CopyMem(p, SLOT_SUFFIX_PARAM, STRING_LENGTH(SLOT_SUFFIX_PARAM));
+        p += STRING_LENGTH(SLOT_SUFFIX_PARAM);
+        *p++ = bootctrl_slot_suffix(slot->slot);
+        *p++ = ' ';
+    }
 
-        if (!cmdline[-1]) {
-            // Replace null terminator with space
-            cmdline[-1] = ' ';
-        } else {
-            *cmdline++ = ' ';
-        }
+    // Recovery is part of the generic ramdisk since header version 3
+    if (android_needs_vendor_boot(android_image) && !options->recovery) {
+        CopyMem(p, FORCE_NORMAL_BOOT_PARAM, STRING_LENGTH(FORCE_NORMAL_BOOT_PARAM));
+        p += STRING_LENGTH(FORCE_NORMAL_BOOT_PARAM);
     }
+    *p = 0;
 
-    return android_copy_cmdline(android_image, cmdline, cmdline_end - cmdline);
+    return cmdline_build(linux_cmdline_pointer(kernel_header), kernel_header->cmdline_size, image_cmdline,
+                         p != loader_params ? loader_params : NULL, options->kernel_parameters, options->kernel_parameters_length, initrds);
 }
 
-#define RAMDISK_OPTION       "initrd="
-#define MAX_RAMDISK_COUNT    4
-#define MAX_PATH_LENGTH      256
+static EFI_STATUS get_file_info(EFI_FILE_HANDLE file, UINTN path_length, UINTN *size, EFI_TIME *modification_time) {
+    // The file name is never longer than the path used to open the file
+    UINTN info_size = SIZE_OF_EFI_FILE_INFO + (path_length + 1) * sizeof(CHAR16);
+    EFI_FILE_INFO *info = malloc_pool(info_size);
+    if (!info) {
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-static const CHAR8 *find_initrd_option(const CHAR8 *cmdline) {
-    const CHAR8 *tail = cmdline;
-    for (const CHAR8 *first = cmdline + STRING_LENGTH(RAMDISK_OPTION); cmdline < first && *cmdline; ++cmdline);
-    for (; *cmdline; ++cmdline, ++tail) {
-        if (CompareMem(tail, RAMDISK_OPTION, STRING_LENGTH(RAMDISK_OPTION)) == 0) {
-            return cmdline;
+    EFI_STATUS err = uefi_call_wrapper(file->GetInfo, 4, file, &GenericFileInfo, &info_size, info);
+    if (err == EFI_BUFFER_TOO_SMALL) {
+        // info_size now contains the required size
+        info = malloc_pool(info_size);
+        if (!info) {
+            return EFI_OUT_OF_RESOURCES;
         }
+
+        err = uefi_call_wrapper(file->GetInfo, 4, file, &GenericFileInfo, &info_size, info);
+    }
+
+    if (!err) {
+        *size = info->FileSize;
+        *modification_time = info->ModificationTime;
     }
-    return NULL;
+    return err;
 }
 
-static EFI_STATUS load_ramdisk_cmdline(EFI_HANDLE loader_device, const CHAR8 *cmdline,
-        struct linux_setup_header *kernel_header, const struct android_image *android_image) {
-    EFI_FILE_HANDLE dir = LibOpenRoot(loader_device);
-    if (!dir) {
-        Print(L"Failed to open root directory\n");
+struct initrd_file {
+    struct initrd_file *next;
+    EFI_FILE_HANDLE handle;
+    UINTN size;
+    EFI_TIME modification_time;
+
+    // Used for asynchronous reads (event is NULL otherwise)
+    struct efi_file_io_token token;
+};
+
+struct initrd_files {
+    EFI_FILE_HANDLE dir;
+    UINTN size;
+
+    // All files are allocated using malloc_pool()
+    struct initrd_file *files;
+};
+
+static EFI_STATUS open_initrd_files(EFI_HANDLE loader_device, const struct cmdline_initrd *initrds,
+                                    struct initrd_files *initrd) {
+    initrd->dir = NULL;
+    initrd->size = 0;
+    initrd->files = NULL;
+
+    if (!initrds) {
+        return EFI_SUCCESS;
+    }
+
+    initrd->dir = LibOpenRoot(loader_device);
+    if (!initrd->dir) {
+        log_error(L"Failed to open root directory\n");
         return EFI_VOLUME_CORRUPTED;
     }
 
-    UINT32 size = android_ramdisk_size(android_image);
+    // All files are opened first so the total size is known before reading them
+    struct initrd_file **tail = &initrd->files;
+    for (; initrds; initrds = initrds->next) {
+        const CHAR8 *name = initrds->path;
+        UINTN len = initrds->length;
 
-    EFI_STATUS err;
-    struct {
-        EFI_FILE_HANDLE handle;
-        UINTN size;
-    } files[MAX_RAMDISK_COUNT];
-    UINTN n;
-    for (n = 0; n < MAX_RAMDISK_COUNT; ++n) {
         // Skip leading slashes
-        while (*cmdline == '/' || *cmdline == '\\')
-            ++cmdline;
+        while (len && (*name == '/' || *name == '\\')) {
+            ++name;
+            --len;
+        }
 
         // Convert to long char
-        CHAR16 path[MAX_PATH_LENGTH];
-        CHAR16 *p = path, *p_last = path + MAX_PATH_LENGTH - 1;
-        for (; *cmdline && *cmdline != ' ' && *cmdline != '\n'; ++cmdline) {
-            if (p >= p_last) {
-                continue;
-            }
+        CHAR16 *path = malloc_pool((len + 1) * sizeof(CHAR16));
+        struct initrd_file *file = malloc_pool(sizeof(*file));
+        if (!path || !file) {
+            return EFI_OUT_OF_RESOURCES;
+        }
 
-            if (*cmdline == '/') {
-                *p++ = '\\';
-            } else {
-                *p++ = *cmdline;
-            }
+        for (UINTN i = 0; i < len; ++i) {
+            path[i] = name[i] == '/' ? '\\' : name[i];
         }
-        *p = 0;
+        path[len] = 0;
 
-        err = uefi_call_wrapper(dir->Open, 5, dir, &files[n].handle, path, EFI_FILE_MODE_READ, 0);
+        EFI_STATUS err = uefi_call_wrapper(initrd->dir->Open, 5, initrd->dir, &file->handle, path,
+                                           EFI_FILE_MODE_READ, 0);
         if (err) {
-            --n;
-            Print(L"Failed to open initrd '%s'\n", path);
-            goto err;
+            log_error(L"Failed to open initrd '%s'\n", path);
+            return err;
         }
 
-        EFI_FILE_INFO *info = LibFileInfo(files[n].handle);
-        if (!info) {
-            Print(L"Failed to get file info for initrd '%s'\n", path);
-            goto err;
+        err = get_file_info(file->handle, len, &file->size, &file->modification_time);
+        if (err) {
+            uefi_call_wrapper(file->handle->Close, 1, file->handle);
+            log_error(L"Failed to get file info for initrd '%s'\n", path);
+            return err;
         }
-        files[n].size = info->FileSize;
-        size += info->FileSize;
-        FreePool(info);
 
-        cmdline = find_initrd_option(cmdline);
-        if (!cmdline) {
-            break;
+        file->next = NULL;
+        file->token.event = NULL;
+        *tail = file;
+        tail = &file->next;
+        initrd->size += file->size;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Start reading the file using ReadEx() if supported by the file system, or read it synchronously otherwise
+static EFI_STATUS read_initrd_file(struct initrd_file *file, VOID *buffer) {
+    UINT64 start = timing_read_tsc();
+    EFI_STATUS err;
+
+    struct efi_file2 *file2 = (struct efi_file2*) file->handle;
+    if (file->handle->Revision >= EFI_FILE_PROTOCOL_REVISION2) {
+        err = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &file->token.event);
+        if (!err) {
+            file->token.status = EFI_SUCCESS;
+            file->token.buffer_size = file->size;
+            file->token.buffer = buffer;
+
+            err = uefi_call_wrapper(file2->read_ex, 2, file2, &file->token);
+            if (!err) {
+                UINT64 ticks = timing_read_tsc() - start;
+                timing_record_read(TIMING_SOURCE_INITRD, 1, file->size, ticks);
+                trace_read(TIMING_SOURCE_INITRD, 0, buffer, file->size, start, ticks);
+                return EFI_SUCCESS;
+            }
+
+            uefi_call_wrapper(BS->CloseEvent, 1, file->token.event);
         }
+
+        file->token.event = NULL;
     }
-    if (n == MAX_RAMDISK_COUNT) {
-        --n;
-        Print(L"Too many ramdisks listed as 'initrd=' option. Maximum supported are: %d\n", MAX_RAMDISK_COUNT);
-        err = EFI_OUT_OF_RESOURCES;
-        goto err;
+
+    UINTN size = file->size;
+    err = uefi_call_wrapper(file->handle->Read, 3, file->handle, &size, buffer);
+    UINT64 ticks = timing_read_tsc() - start;
+    timing_record_read(TIMING_SOURCE_INITRD, 1, err ? 0 : size, ticks);
+    trace_read(TIMING_SOURCE_INITRD, 0, buffer, size, start, ticks);
+    return err;
+}
+
+static EFI_STATUS wait_initrd_file(struct initrd_file *file) {
+    if (!file->token.event) {
+        return EFI_SUCCESS;
     }
 
-    err = linux_allocate_ramdisk(kernel_header, size);
-    if (err) {
-        goto err;
+    UINT64 start = timing_read_tsc();
+    UINTN index;
+    EFI_STATUS err = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &file->token.event, &index);
+    timing_record_read(TIMING_SOURCE_INITRD, 0, 0, timing_read_tsc() - start);
+    if (!err) {
+        err = file->token.status;
     }
 
-    // Load cmdline ramdisks
-    UINTN ramdisk = (UINTN) linux_ramdisk_pointer(kernel_header);
-    for (UINTN i = 0; i <= n; ++i) {
-        err = uefi_call_wrapper(files[i].handle->Read, 3, files[i].handle, &files[i].size, (VOID*) ramdisk);
+    uefi_call_wrapper(BS->CloseEvent, 1, file->token.event);
+    file->token.event = NULL;
+    return err;
+}
+
+static EFI_STATUS read_initrd_files(struct initrd_files *initrd, UINTN ramdisk) {
+    // Start all reads first, so multiple files can be read at the same time
+    UINTN i = 0;
+    for (struct initrd_file *file = initrd->files; file; file = file->next, ++i) {
+        // The files are read again if the kernel loads the initrd multiple times
+        EFI_STATUS err = uefi_call_wrapper(file->handle->SetPosition, 2, file->handle, 0);
+        if (!err) {
+            err = read_initrd_file(file, (VOID*) ramdisk);
+        }
+        if (err) {
+            log_error(L"Failed to read initrd %d\n", i);
+            return err;
+        }
+
+        ramdisk += file->size;
+    }
+
+    i = 0;
+    for (struct initrd_file *file = initrd->files; file; file = file->next, ++i) {
+        EFI_STATUS err = wait_initrd_file(file);
         if (err) {
-            Print(L"Failed to read initrd %d\n", i);
-            goto err;
+            log_error(L"Failed to read initrd %d\n", i);
+            return err;
         }
+    }
 
-        ramdisk += files[i].size;
+    return EFI_SUCCESS;
+}
+
+static VOID close_initrd_files(struct initrd_files *initrd) {
+    for (struct initrd_file *file = initrd->files; file; file = file->next) {
+        // Make sure no reads are in progress
+        wait_initrd_file(file);
+        uefi_call_wrapper(file->handle->Close, 1, file->handle);
+    }
+    if (initrd->dir) {
+        uefi_call_wrapper(initrd->dir->Close, 1, initrd->dir);
     }
 
-    err = android_load_ramdisk(android_image, (VOID*) ramdisk);
+    initrd->files = NULL;
+    initrd->dir = NULL;
+}
 
-err:
-    for (UINTN i = 0; i <= n; ++i) {
-        uefi_call_wrapper(files[i].handle->Close, 1, files[i].handle);
+// Kept until the kernel is started if the kernel loads the initrd itself
+struct boot_state {
+    struct android_image android_image;
+    struct initrd_files initrd;
+    struct linux_initrd_media initrd_media; // Handle is NULL if not installed
+    struct ramdisk_cache ramdisk_cache; // File is NULL if not used
+};
+
+// Only used with additional initrd files (the ramdisk alone is read faster from the boot image).
+// Cached data cannot be verified, so the cache is not used with --verify.
+static VOID open_ramdisk_cache(struct boot_state *state, const struct cmdline_initrd *initrds, BOOLEAN load_second) {
+    const struct android_image *android_image = &state->android_image;
+    struct initrd_files *initrd = &state->initrd;
+    if (!initrd->files || android_image->verify) {
+        return;
+    }
+
+    // The boot image cannot be identified without id[]
+    UINT32 id = 0;
+    for (UINTN i = 0; i < sizeof(android_image->header.id) / sizeof(*android_image->header.id); ++i) {
+        id |= android_image->header.id[i];
+    }
+    if (!id) {
+        return;
+    }
+
+    struct ramdisk_cache_key key;
+    ramdisk_cache_init_key(&key, android_image->header.id, load_second ? RAMDISK_CACHE_SECOND : 0,
+                           initrd->size + android_ramdisk_size(android_image));
+
+    struct initrd_file *file = initrd->files;
+    for (; file; file = file->next, initrds = initrds->next) {
+        if (!ramdisk_cache_add_input(&key, initrds->path, initrds->length, file->size, &file->modification_time)) {
+            return;
+        }
+    }
+
+    ramdisk_cache_open(&state->ramdisk_cache, initrd->dir, &key);
+}
+
+// Load initrd files and the ramdisk from the boot image, or from the ramdisk cache
+static EFI_STATUS load_ramdisk(struct boot_state *state, UINTN ramdisk) {
+    if (ramdisk_cache_hit(&state->ramdisk_cache) && !ramdisk_cache_read(&state->ramdisk_cache, (VOID*) ramdisk)) {
+        return EFI_SUCCESS;
+    }
+
+    EFI_STATUS err = android_load_ramdisk(&state->android_image, (VOID*) (ramdisk + state->initrd.size));
+    if (!err) {
+        err = read_initrd_files(&state->initrd, ramdisk);
     }
-    uefi_call_wrapper(dir->Close, 1, dir);
     return err;
 }
 
-static EFI_STATUS load_ramdisk(EFI_HANDLE loader_device,
-        struct linux_setup_header *kernel_header, const struct android_image *android_image) {
-    const CHAR8 *initrd = find_initrd_option(linux_cmdline_pointer(kernel_header));
-    if (initrd) {
-        return load_ramdisk_cmdline(loader_device, initrd, kernel_header, android_image);
+// Called by the kernel to load initrd files and ramdisk into memory allocated by the kernel.
+// Everything is read again on each call, the image is never verified (--verify is rejected).
+static EFI_STATUS load_initrd_media(VOID *context, VOID *buffer) {
+    struct boot_state *state = context;
+    struct android_image *android_image = &state->android_image;
+
+    EFI_STATUS err = load_ramdisk(state, (UINTN) buffer);
+    EFI_STATUS status = android_wait(android_image);
+    if (!err) {
+        err = status;
     }
 
-    EFI_STATUS err = linux_allocate_ramdisk(kernel_header, android_ramdisk_size(android_image));
     if (err) {
-        return err;
+        log_error(L"Failed to load initrd: %r\n", err);
+    } else {
+        ramdisk_cache_write(&state->ramdisk_cache, buffer);
     }
+    return err;
+}
 
-    return android_load_ramdisk(android_image, linux_ramdisk_pointer(kernel_header));
+static VOID close_initrd_media(struct boot_state *state, EFI_HANDLE loader) {
+    if (state->initrd_media.handle) {
+        linux_uninstall_initrd_media(&state->initrd_media);
+        close_initrd_files(&state->initrd);
+        ramdisk_cache_close(&state->ramdisk_cache);
+        android_close_image(&state->android_image, loader);
+    }
 }
 
-static EFI_STATUS load_kernel(EFI_HANDLE loader, EFI_HANDLE loader_device,
-                              const struct android_efi_options *options, VOID **boot_params) {
-    struct android_image android_image;
-    EFI_STATUS err = image_open(&android_image.image, loader, loader_device, options->partition_guid, options->path);
-    if (options->path) {
-        FreePool(options->path);
+static EFI_STATUS load_kernel_ramdisk(EFI_HANDLE loader_device, struct linux_setup_header *kernel_header,
+        struct boot_state *state, const struct cmdline_initrd *initrds, const struct android_efi_options *options) {
+    struct android_image *android_image = &state->android_image;
+    struct initrd_files *initrd = &state->initrd;
+
+    timing_start(TIMING_LOAD_RAMDISK);
+
+    EFI_STATUS err = open_initrd_files(loader_device, initrds, initrd);
+    if (err) {
+        goto out;
+    }
+
+    if (options->initrd_cache) {
+        open_ramdisk_cache(state, initrds, options->second_initrd);
+    }
+
+    // The ramdisk is not loaded before starting the kernel if the kernel can load it itself
+    UINTN ramdisk_size = initrd->size + android_ramdisk_size(android_image);
+    if (options->initrd_media && ramdisk_size) {
+        err = linux_install_initrd_media(&state->initrd_media, ramdisk_size, load_initrd_media, state);
+        if (!err) {
+            timing_end(TIMING_LOAD_RAMDISK);
+            timing_start(TIMING_LOAD_KERNEL);
+
+            err = android_load(android_image, linux_kernel_offset(kernel_header), linux_kernel_pointer(kernel_header),
+                               NULL);
+
+            timing_end(TIMING_LOAD_KERNEL);
+            return err;
+        }
+
+        log_warning(L"Failed to install initrd media: %r\n", err);
     }
+
+    err = linux_allocate_ramdisk(kernel_header, ramdisk_size);
+    if (err) {
+        goto out;
+    }
+
+    timing_end(TIMING_LOAD_RAMDISK);
+    timing_start(TIMING_LOAD_KERNEL);
+
+    // Additional initrds are placed in front of the ramdisk from the boot image
+    // Only the kernel is read from the boot image if the ramdisk is cached
+    UINTN ramdisk = (UINTN) linux_ramdisk_pointer(kernel_header);
+    BOOLEAN cached = ramdisk_cache_hit(&state->ramdisk_cache);
+    err = android_load(android_image, linux_kernel_offset(kernel_header), linux_kernel_pointer(kernel_header),
+                       cached ? NULL : (VOID*) (ramdisk + initrd->size));
+    if (err) {
+        goto out;
+    }
+
+    timing_end(TIMING_LOAD_KERNEL);
+    timing_start(TIMING_LOAD_RAMDISK);
+
+    // The boot image is read in the background while loading the additional initrds
+    err = cached ? load_ramdisk(state, ramdisk) : read_initrd_files(initrd, ramdisk);
+
+    timing_end(TIMING_LOAD_RAMDISK);
+
+out:
+    close_initrd_files(initrd);
+    return err;
+}
+
+static EFI_STATUS load_kernel(EFI_HANDLE loader, EFI_HANDLE loader_device, const struct android_efi_options *options,
+                              struct partition_index *index, const struct boot_slot *slot, struct boot_state *state,
+                              VOID **boot_params) {
+    timing_start(TIMING_OPEN_IMAGE);
+
+    struct android_image *android_image = &state->android_image;
+    state->initrd_media.handle = NULL;
+    state->ramdisk_cache.file = NULL;
+
+    EFI_STATUS err = image_open(&android_image->image, loader, loader_device, slot->partition, options->path);
     if (err) {
         return err;
     }
 
+    timing_end(TIMING_OPEN_IMAGE);
+    timing_start(TIMING_READ_HEADER);
+
     // Read Android boot image header
-    err = android_open_image(&android_image);
+    // The image must be closed on errors so another slot can be tried
+    err = android_open_image(android_image, options->verify, options->second_initrd);
     if (err) {
-        return err;
+        goto close;
+    }
+
+    // Both partitions are only opened once, the ramdisk is read from both directly into the ramdisk
+    if (android_needs_vendor_boot(android_image)) {
+        EFI_HANDLE vendor_boot;
+        err = find_vendor_boot(index, slot, &vendor_boot);
+        if (!err) {
+            err = android_open_vendor_boot(android_image, loader, loader_device, vendor_boot, options->recovery);
+        }
+        if (err) {
+            goto close;
+        }
     }
 
     err = linux_allocate_boot_params(boot_params);
     if (err) {
-        return err;
+        goto close;
     }
 
     struct linux_setup_header *kernel_header = linux_kernel_header(*boot_params);
-    err = android_read_kernel(&android_image, LINUX_SETUP_HEADER_OFFSET, (VOID*) kernel_header, sizeof(*kernel_header));
+    err = android_read_kernel(android_image, LINUX_SETUP_HEADER_OFFSET, (VOID*) kernel_header, sizeof(*kernel_header));
     if (err) {
         goto err;
     }
@@ -382,67 +863,174 @@ static EFI_STATUS load_kernel(EFI_HANDLE loader, EFI_HANDLE loader_device,
         goto err;
     }
 
+    timing_end(TIMING_READ_HEADER);
+
     err = linux_allocate_kernel(kernel_header);
     if (err) {
         goto err;
     }
 
-    err = android_load_kernel(&android_image, linux_kernel_offset(kernel_header), linux_kernel_pointer(kernel_header));
+    timing_start(TIMING_PREPARE_CMDLINE);
+
+    struct cmdline_initrd *initrds;
+    err = prepare_cmdline(kernel_header, android_image, options, slot, &initrds);
     if (err) {
         goto err;
     }
 
-    err = prepare_cmdline(kernel_header, &android_image, options);
+    timing_end(TIMING_PREPARE_CMDLINE);
+
+    err = load_kernel_ramdisk(loader_device, kernel_header, state, initrds, options);
     if (err) {
         goto err;
     }
 
-    err = load_ramdisk(loader_device, kernel_header, &android_image);
+    timing_start(TIMING_LOAD_KERNEL);
+
+    err = android_wait(android_image);
     if (err) {
+        log_error(L"Failed to read boot image: %r\n", err);
         goto err;
     }
 
+    // The image is still needed when the kernel loads the initrd
+    if (state->initrd_media.handle) {
+        timing_end(TIMING_LOAD_KERNEL);
+        return EFI_SUCCESS;
+    }
+
+    err = android_verify(android_image);
+    if (err) {
+        goto err;
+    }
+
+    timing_end(TIMING_LOAD_KERNEL);
+
+    ramdisk_cache_write(&state->ramdisk_cache, linux_ramdisk_pointer(kernel_header));
+    ramdisk_cache_close(&state->ramdisk_cache);
+
     // Close image (not needed anymore)
-    image_close(&android_image.image, loader);
+    android_close_image(android_image, loader);
 
     return EFI_SUCCESS;
 
 err:
+    // Make sure no reads are in progress before freeing the memory
+    if (state->initrd_media.handle) {
+        close_initrd_media(state, loader);
+    } else {
+        ramdisk_cache_close(&state->ramdisk_cache);
+        android_close_image(android_image, loader);
+    }
     linux_free(*boot_params);
     return err;
+
+close:
+    android_close_image(android_image, loader);
+    return err;
 }
 
-extern const struct graphics_image splash_image;
+extern const struct graphics_image splash_images[];
+extern const UINTN splash_image_count;
 
 EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *system_table) {
+    timing_init();
     InitializeLib(image, system_table);
 
     EFI_LOADED_IMAGE_PROTOCOL *loaded_image;
     EFI_STATUS err = uefi_call_wrapper(BS->OpenProtocol, 6, image, &LoadedImageProtocol, (VOID**) &loaded_image,
                                        image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
     if (err) {
-        Print(L"Failed to open LoadedImageProtocol\n");
+        log_error(L"Failed to open LoadedImageProtocol\n");
+        log_flush();
         return err;
     }
 
+    timing_start(TIMING_PARSE_COMMAND_LINE);
+
     struct android_efi_options options = {0};
     err = parse_command_line(loaded_image, &options);
     if (err) {
+        log_flush();
+        malloc_release();
         return err;
     }
 
-    // Display splash image
-    graphics_display_image(&splash_image);
+    log_set_verbose(options.verbose);
+
+    if (options.trace) {
+        trace_enable();
+    }
+
+    timing_end(TIMING_PARSE_COMMAND_LINE);
+    timing_start(TIMING_DISPLAY_SPLASH);
+
+    // Display splash image in the background while loading the kernel
+    if (!options.no_splash) {
+        graphics_display_image_async(splash_images, splash_image_count);
+    }
+
+    timing_end(TIMING_DISPLAY_SPLASH);
+
+    timing_start(TIMING_OPEN_IMAGE);
+
+    struct partition_index index;
+    struct bootctrl bootctrl;
+    struct boot_slot slots[BOOTCTRL_MAX_SLOTS];
+    UINTN slot_count;
+    err = find_boot_slots(&options, &index, &bootctrl, slots, &slot_count);
 
+    timing_end(TIMING_OPEN_IMAGE);
+
+    // Fall back to the next slot if the boot image cannot be loaded
+    struct boot_state state;
     VOID *boot_params;
-    err = load_kernel(image, loaded_image->DeviceHandle, &options, &boot_params);
+    for (UINTN i = 0; !err && i < slot_count; ++i) {
+        if (options.update_bootctrl && slots[i].slot != NO_SLOT) {
+            bootctrl_mark_attempt(&bootctrl, slots[i].slot);
+        }
+
+        err = load_kernel(image, loaded_image->DeviceHandle, &options, &index, &slots[i], &state, &boot_params);
+        if (err && i + 1 < slot_count) {
+            log_warning(L"Failed to load slot %c: %r\n", bootctrl_slot_suffix(slots[i].slot), err);
+            err = EFI_SUCCESS;
+        } else {
+            break;
+        }
+    }
+
+    timing_start(TIMING_DISPLAY_SPLASH);
+    graphics_wait();
+    timing_end(TIMING_DISPLAY_SPLASH);
+
+    timing_start(TIMING_HANDOVER);
+
+    // Also written if the kernel could not be loaded
+    trace_export(loaded_image->DeviceHandle);
+
     if (err) {
-        Print(L"Failed to load kernel: %r\n", err);
+        malloc_release();
+        log_error(L"Failed to load kernel: %r\n", err);
+        log_flush();
+        if (options.log_variable) {
+            log_export();
+        }
         uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
         return err;
     }
 
+    // The initrd files are still needed if the kernel loads the initrd itself
+    if (!state.initrd_media.handle) {
+        malloc_release();
+    }
+
+    timing_export();
+    if (options.log_variable) {
+        log_export();
+    }
     linux_efi_boot(image, boot_params);
+    close_initrd_media(&state, image);
+    malloc_release();
     linux_free(boot_params);
     uefi_call_wrapper(BS->CloseProtocol, 4, image, &LoadedImageProtocol, image, NULL);
     return EFI_SUCCESS;
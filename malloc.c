@@ -2,44 +2,79 @@
 // Copyright (C) 2017 lambdadroid
 
 #include "malloc.h"
+#include "log.h"
 #include <efilib.h>
 
 #define EFI_PAGE_ALIGN(a) (((a) + EFI_PAGE_MASK) & ~EFI_PAGE_MASK)
 
+// Reserved for descriptors created while allocating the memory map buffer
+#define MEMORY_MAP_EXTRA_DESCRIPTORS  8
+// Reserved for ranges that are split by allocations
+#define FREE_RANGES_EXTRA             16
+
 static EFI_STATUS load_memory_map(EFI_MEMORY_DESCRIPTOR **buf, UINTN *map_size, UINTN *desc_size) {
     EFI_STATUS err;
     UINTN map_key;
     UINT32 desc_version;
 
-    *map_size = sizeof(**buf) * 32;
+    *buf = NULL;
+    *map_size = 0;
 
-get_map:
-    err = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, *map_size, (VOID**) buf);
-    if (err) {
-        return err;
-    }
+    for (;;) {
+        err = uefi_call_wrapper(BS->GetMemoryMap, 5, map_size, *buf, &map_key, desc_size, &desc_version);
+        if (err != EFI_BUFFER_TOO_SMALL) {
+            break;
+        }
 
-    err = uefi_call_wrapper(BS->GetMemoryMap, 5, map_size, *buf, &map_key, desc_size, &desc_version);
-    if (err) {
-        FreePool(*buf);
-        if (err == EFI_BUFFER_TOO_SMALL) {
-            // We might create a new descriptor by allocating memory
-            *map_size += sizeof(**buf);
-            goto get_map;
+        // map_size now contains the required size
+        if (*buf) {
+            FreePool(*buf);
+        }
+
+        *map_size += MEMORY_MAP_EXTRA_DESCRIPTORS * *desc_size;
+        err = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, *map_size, (VOID**) buf);
+        if (err) {
+            *buf = NULL;
+            return err;
         }
     }
 
+    if (err && *buf) {
+        FreePool(*buf);
+    }
     return err;
 }
 
 /*
- * The following methods were originally based on parts of the Linux kernel: (GPL-2.0)
- *   drivers/firmware/efi/libstub/efi-stub-helper.c (efi_high_alloc/efi_low_alloc)
- *
- * Simplified quite a bit for use in android-efi.
+ * All allocations are planned using a single snapshot of the memory map:
+ * The free (conventional) memory ranges are sorted by address and updated
+ * after each allocation, so the memory map only needs to be loaded again
+ * if it turns out to be outdated.
  */
 
-EFI_STATUS malloc_high(UINTN size, EFI_PHYSICAL_ADDRESS *addr) {
+struct memory_range {
+    EFI_PHYSICAL_ADDRESS start;
+    EFI_PHYSICAL_ADDRESS end;
+};
+
+static struct memory_range *free_ranges;
+static UINTN free_range_count, free_range_capacity;
+
+static VOID free_memory_ranges(VOID) {
+    if (free_ranges) {
+        FreePool(free_ranges);
+        free_ranges = NULL;
+    }
+    free_range_count = free_range_capacity = 0;
+}
+
+static EFI_STATUS load_memory_ranges(BOOLEAN reload) {
+    if (free_ranges && !reload) {
+        return EFI_SUCCESS;
+    }
+
+    free_memory_ranges();
+
     EFI_MEMORY_DESCRIPTOR *buf;
     UINTN map_size, desc_size;
     EFI_STATUS err = load_memory_map(&buf, &map_size, &desc_size);
@@ -47,75 +82,172 @@ EFI_STATUS malloc_high(UINTN size, EFI_PHYSICAL_ADDRESS *addr) {
         return err;
     }
 
-    // Align size to EFI_PAGE_SIZE
-    size = EFI_PAGE_ALIGN(size);
-    UINTN nr_pages = size / EFI_PAGE_SIZE;
-
-    // Align max to EFI_PAGE_SIZE (round down) and subtract aligned size
-    EFI_PHYSICAL_ADDRESS max = (*addr & ~EFI_PAGE_MASK) - size;
-
-    err = EFI_NOT_FOUND;
+    free_range_capacity = map_size / desc_size + FREE_RANGES_EXTRA;
+    free_ranges = AllocatePool(free_range_capacity * sizeof(*free_ranges));
+    if (!free_ranges) {
+        FreePool(buf);
+        return EFI_OUT_OF_RESOURCES;
+    }
 
-    for (UINTN d = (UINTN) buf + map_size; d >= (UINTN) buf; d -= desc_size) {
+    for (UINTN d = (UINTN) buf, map_end = d + map_size; d < map_end; d += desc_size) {
         EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR*) d;
-        if (desc->Type != EfiConventionalMemory || desc->NumberOfPages < nr_pages) {
+        if (desc->Type != EfiConventionalMemory || !desc->NumberOfPages) {
             continue;
         }
 
-        *addr = desc->PhysicalStart + (desc->NumberOfPages * EFI_PAGE_SIZE) - size;
-        if (*addr > max) {
-            *addr = max;
+        struct memory_range range = {
+            desc->PhysicalStart,
+            desc->PhysicalStart + desc->NumberOfPages * EFI_PAGE_SIZE
+        };
+
+        // Insertion sort (the memory map is usually sorted already)
+        UINTN i = free_range_count++;
+        for (; i && free_ranges[i - 1].start > range.start; --i) {
+            free_ranges[i] = free_ranges[i - 1];
+        }
+        free_ranges[i] = range;
+    }
+
+    FreePool(buf);
+
+    // Merge adjacent ranges
+    UINTN n = 0;
+    for (UINTN i = 0; i < free_range_count; ++i) {
+        if (n && free_ranges[n - 1].end == free_ranges[i].start) {
+            free_ranges[n - 1].end = free_ranges[i].end;
+        } else {
+            free_ranges[n++] = free_ranges[i];
         }
+    }
+    free_range_count = n;
 
-        // Make sure we're still in the memory region
-        if (*addr && *addr >= desc->PhysicalStart) {
-            err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, nr_pages, addr);
-            if (err) {
-                Print(L"Cannot allocate at %d: %r\n", *addr, err);
-            }
+    return EFI_SUCCESS;
+}
 
-            if (err == EFI_SUCCESS) {
-                goto done;
+// Remove an allocated range from the free memory ranges
+static VOID reserve_memory_range(EFI_PHYSICAL_ADDRESS start, UINTN size) {
+    EFI_PHYSICAL_ADDRESS end = start + size;
+
+    for (UINTN i = 0; i < free_range_count; ++i) {
+        struct memory_range *range = &free_ranges[i];
+        if (end <= range->start || start >= range->end) {
+            continue;
+        }
+
+        if (start <= range->start && end >= range->end) {
+            // Range is used completely
+            --free_range_count;
+            CopyMem(range, range + 1, (free_range_count - i) * sizeof(*range));
+            --i;
+        } else if (start <= range->start) {
+            range->start = end;
+        } else if (end >= range->end) {
+            range->end = start;
+        } else {
+            // Split range (if there is no space left, forget about the upper part)
+            if (free_range_count < free_range_capacity) {
+                CopyMem(range + 2, range + 1, (free_range_count - i - 1) * sizeof(*range));
+                range[1].start = end;
+                range[1].end = range->end;
+                ++free_range_count;
             }
+
+            range->end = start;
+            return;
         }
     }
-
-done:
-    FreePool(buf);
-    return err;
 }
 
-EFI_STATUS malloc_low(UINTN size, UINTN align, EFI_PHYSICAL_ADDRESS *addr) {
-    EFI_MEMORY_DESCRIPTOR *buf;
-    UINTN map_size, desc_size;
-    EFI_STATUS err = load_memory_map(&buf, &map_size, &desc_size);
+static inline EFI_STATUS allocate_pages(UINTN size, EFI_PHYSICAL_ADDRESS addr) {
+    EFI_STATUS err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData,
+                                       EFI_SIZE_TO_PAGES(size), &addr);
     if (err) {
+        log_debug(L"Cannot allocate at %d: %r\n", addr, err);
         return err;
     }
 
-    UINTN align_mask;
-    if (align < EFI_PAGE_SIZE) {
-        // Need to align to at least the EFI page size
-        align = EFI_PAGE_SIZE;
-        align_mask = EFI_PAGE_MASK;
-    } else {
-        align_mask = align - 1;
+    reserve_memory_range(addr, size);
+    return EFI_SUCCESS;
+}
+
+static VOID print_fragmentation(UINTN size) {
+    UINT64 total = 0, largest = 0;
+    for (UINTN i = 0; i < free_range_count; ++i) {
+        UINT64 range_size = free_ranges[i].end - free_ranges[i].start;
+        total += range_size;
+        if (range_size > largest) {
+            largest = range_size;
+        }
+    }
+
+    log_error(L"Failed to allocate %d KiB: %d KiB free in %d ranges, largest: %d KiB\n",
+              size / 1024, (UINTN) (total / 1024), free_range_count, (UINTN) (largest / 1024));
+}
+
+/*
+ * The following methods were originally based on parts of the Linux kernel: (GPL-2.0)
+ *   drivers/firmware/efi/libstub/efi-stub-helper.c (efi_high_alloc/efi_low_alloc)
+ *
+ * Simplified quite a bit for use in android-efi.
+ */
+
+static EFI_STATUS allocate_high(UINTN size, EFI_PHYSICAL_ADDRESS max, EFI_PHYSICAL_ADDRESS *addr) {
+    for (UINTN i = free_range_count; i--;) {
+        struct memory_range *range = &free_ranges[i];
+        if (range->end - range->start < size) {
+            continue;
+        }
+
+        *addr = range->end - size;
+        if (*addr > max) {
+            *addr = max;
+        }
+
+        // Make sure we're still in the memory region
+        if (*addr && *addr >= range->start && allocate_pages(size, *addr) == EFI_SUCCESS) {
+            return EFI_SUCCESS;
+        }
     }
 
+    return EFI_NOT_FOUND;
+}
+
+EFI_STATUS malloc_high(UINTN size, EFI_PHYSICAL_ADDRESS *addr) {
     // Align size to EFI_PAGE_SIZE
     size = EFI_PAGE_ALIGN(size);
-    UINTN nr_pages = size / EFI_PAGE_SIZE;
 
-    err = EFI_NOT_FOUND;
+    // Align max to EFI_PAGE_SIZE (round down) and subtract aligned size
+    EFI_PHYSICAL_ADDRESS max = (*addr & ~EFI_PAGE_MASK) - size;
 
-    for (UINTN d = (UINTN) buf, map_end = d + map_size; d < map_end; d += desc_size) {
-        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR*) d;
-        if (desc->Type != EfiConventionalMemory || desc->NumberOfPages < nr_pages) {
+    EFI_STATUS err = load_memory_ranges(FALSE);
+    if (!err) {
+        err = allocate_high(size, max, addr);
+    }
+
+    if (err == EFI_NOT_FOUND) {
+        // Memory map might be outdated
+        err = load_memory_ranges(TRUE);
+        if (!err) {
+            err = allocate_high(size, max, addr);
+        }
+        if (err == EFI_NOT_FOUND) {
+            print_fragmentation(size);
+        }
+    }
+
+    return err;
+}
+
+static EFI_STATUS allocate_low(UINTN size, UINTN align, EFI_PHYSICAL_ADDRESS *addr) {
+    UINTN align_mask = align - 1;
+
+    for (UINTN i = 0; i < free_range_count; ++i) {
+        struct memory_range *range = &free_ranges[i];
+        if (range->end - range->start < size) {
             continue;
         }
 
-        EFI_PHYSICAL_ADDRESS max = desc->PhysicalStart + (desc->NumberOfPages * EFI_PAGE_SIZE) - size;
-        *addr = desc->PhysicalStart;
+        *addr = range->start;
 
         // Avoid allocating at 0x0
         if (*addr == 0x0) {
@@ -126,19 +258,99 @@ EFI_STATUS malloc_low(UINTN size, UINTN align, EFI_PHYSICAL_ADDRESS *addr) {
         }
 
         // Make sure we're still in the memory region
-        if (*addr <= max) {
-            err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, nr_pages, addr);
-            if (err) {
-                Print(L"Cannot allocate at %d: %r\n", *addr, err);
-            }
+        if (*addr + size <= range->end && allocate_pages(size, *addr) == EFI_SUCCESS) {
+            return EFI_SUCCESS;
+        }
+    }
 
-            if (err == EFI_SUCCESS) {
-                goto done;
-            }
+    return EFI_NOT_FOUND;
+}
+
+EFI_STATUS malloc_low(UINTN size, UINTN align, EFI_PHYSICAL_ADDRESS *addr) {
+    if (align < EFI_PAGE_SIZE) {
+        // Need to align to at least the EFI page size
+        align = EFI_PAGE_SIZE;
+    }
+
+    // Align size to EFI_PAGE_SIZE
+    size = EFI_PAGE_ALIGN(size);
+
+    EFI_STATUS err = load_memory_ranges(FALSE);
+    if (!err) {
+        err = allocate_low(size, align, addr);
+    }
+
+    if (err == EFI_NOT_FOUND) {
+        // Memory map might be outdated
+        err = load_memory_ranges(TRUE);
+        if (!err) {
+            err = allocate_low(size, align, addr);
+        }
+        if (err == EFI_NOT_FOUND) {
+            print_fragmentation(size);
         }
     }
 
-done:
-    FreePool(buf);
     return err;
 }
+
+EFI_STATUS malloc_at(UINTN size, EFI_PHYSICAL_ADDRESS addr) {
+    EFI_STATUS err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData,
+                                       EFI_SIZE_TO_PAGES(size), &addr);
+    if (err) {
+        return err;
+    }
+
+    if (free_ranges) {
+        reserve_memory_range(addr, EFI_PAGE_ALIGN(size));
+    }
+    return EFI_SUCCESS;
+}
+
+/*
+ * Small allocations that live until the kernel is started are made from a simple
+ * arena, so they do not need to be freed individually.
+ */
+
+#define ARENA_CHUNK_SIZE  EFI_PAGE_SIZE
+#define ARENA_ALIGN(a)    (((a) + 7) & ~7)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    UINTN used;
+    UINTN size;
+    UINT8 data[];
+};
+
+static struct arena_chunk *arena;
+
+VOID *malloc_pool(UINTN size) {
+    size = ARENA_ALIGN(size);
+
+    if (!arena || arena->size - arena->used < size) {
+        UINTN chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk *chunk = AllocatePool(sizeof(*chunk) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+
+        chunk->next = arena;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena = chunk;
+    }
+
+    VOID *p = &arena->data[arena->used];
+    arena->used += size;
+    return p;
+}
+
+VOID malloc_release(VOID) {
+    free_memory_ranges();
+
+    while (arena) {
+        struct arena_chunk *next = arena->next;
+        FreePool(arena);
+        arena = next;
+    }
+}
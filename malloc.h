@@ -8,5 +8,10 @@
 
 EFI_STATUS malloc_high(UINTN size, EFI_PHYSICAL_ADDRESS *addr);
 EFI_STATUS malloc_low(UINTN size, UINTN align, EFI_PHYSICAL_ADDRESS *addr);
+EFI_STATUS malloc_at(UINTN size, EFI_PHYSICAL_ADDRESS addr);
+
+// Small allocations, released all at once using malloc_release()
+VOID *malloc_pool(UINTN size);
+VOID malloc_release(VOID);
 
 #endif //ANDROID_EFI_MALLOC_H
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "mp.h"
+#include <efilib.h>
+
+#define MP_MAX_PROCESSORS  16
+
+static EFI_GUID MpServicesProtocol = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+/*
+ * The firmware only checks for completed processors periodically (e.g. every 10 ms),
+ * so the job reports its completion itself. The processor can be used again once the
+ * firmware has signaled its event.
+ */
+
+struct mp_processor {
+    UINTN number;
+    EFI_EVENT event;
+    BOOLEAN busy;
+};
+
+static struct {
+    BOOLEAN initialized;
+    struct efi_mp_services *mp;
+    struct mp_processor processors[MP_MAX_PROCESSORS]; // Enabled application processors
+    UINTN count;
+} aps;
+
+static VOID mp_init(VOID) {
+    aps.initialized = TRUE;
+    if (LibLocateProtocol(&MpServicesProtocol, (VOID**) &aps.mp)) {
+        return;
+    }
+
+    UINTN total, enabled;
+    EFI_STATUS err = uefi_call_wrapper(aps.mp->get_number_of_processors, 3, aps.mp, &total, &enabled);
+    if (err) {
+        return;
+    }
+
+    for (UINTN i = 0; i < total && aps.count < MP_MAX_PROCESSORS; ++i) {
+        struct efi_processor_information info;
+        err = uefi_call_wrapper(aps.mp->get_processor_info, 3, aps.mp, i, &info);
+        if (err || (info.status_flag & (PROCESSOR_AS_BSP_BIT | PROCESSOR_ENABLED_BIT)) != PROCESSOR_ENABLED_BIT) {
+            continue;
+        }
+
+        struct mp_processor *processor = &aps.processors[aps.count];
+        err = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL, &processor->event);
+        if (err) {
+            break;
+        }
+
+        processor->number = i;
+        processor->busy = FALSE;
+        ++aps.count;
+    }
+}
+
+static VOID EFIAPI mp_run(VOID *argument) {
+    struct mp_job *job = argument;
+    job->procedure(job->argument);
+    __atomic_store_n(&job->finished, TRUE, __ATOMIC_RELEASE);
+}
+
+static BOOLEAN mp_available(struct mp_processor *processor) {
+    if (processor->busy && !uefi_call_wrapper(BS->CheckEvent, 1, processor->event)) {
+        processor->busy = FALSE;
+    }
+    return !processor->busy;
+}
+
+VOID mp_start(struct mp_job *job, efi_ap_procedure procedure, VOID *argument) {
+    if (!aps.initialized) {
+        mp_init();
+    }
+
+    job->procedure = procedure;
+    job->argument = argument;
+    job->finished = FALSE;
+
+    for (UINTN i = 0; i < aps.count; ++i) {
+        struct mp_processor *processor = &aps.processors[i];
+        if (!mp_available(processor)) {
+            continue;
+        }
+
+        // Non-blocking: The event is signaled by the firmware once the processor has finished
+        EFI_STATUS err = uefi_call_wrapper(aps.mp->startup_this_ap, 7, aps.mp, mp_run, processor->number,
+                                           processor->event, 0, job, NULL);
+        if (!err) {
+            processor->busy = TRUE;
+            return;
+        }
+
+        if (err == EFI_UNSUPPORTED) {
+            // Non-blocking mode is not supported, do not try again
+            aps.count = 0;
+            break;
+        }
+    }
+
+    mp_run(job);
+}
+
+VOID mp_wait(struct mp_job *job) {
+    while (!__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_MP_H
+#define ANDROID_EFI_MP_H
+
+#include <efi.h>
+#include "protocol.h"
+
+/*
+ * Run CPU-bound work on the application processors while the BSP keeps the firmware busy with I/O.
+ * Jobs run synchronously on the BSP if the firmware does not provide EFI_MP_SERVICES_PROTOCOL or
+ * all processors are busy.
+ *
+ * Note: Jobs must not use any boot services (including Print() and logging).
+ */
+
+struct mp_job {
+    efi_ap_procedure procedure;
+    VOID *argument;
+    BOOLEAN finished;
+};
+
+static inline VOID mp_job_init(struct mp_job *job) {
+    job->finished = TRUE;
+}
+
+VOID mp_start(struct mp_job *job, efi_ap_procedure procedure, VOID *argument);
+// Wait until the job has completed (returns immediately if it was never started)
+VOID mp_wait(struct mp_job *job);
+
+#endif //ANDROID_EFI_MP_H
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "partition.h"
+#include "guid.h"
+#include "malloc.h"
+#include "log.h"
+#include <efilib.h>
+
+/*
+ * Searching the partition requires reading the partition tables of all disks. The device path
+ * of the partition is stored in an EFI variable so it can be found directly on the next boot.
+ */
+
+#define PARTITION_VARIABLE_NAME  L"PartitionDevicePath-%g"
+#define PARTITION_VARIABLE_SIZE  64
+#define PARTITION_VARIABLE_ATTRIBUTES  (EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS)
+
+static BOOLEAN device_path_valid(const EFI_DEVICE_PATH *path, UINTN size) {
+    for (UINTN offset = 0; size - offset >= sizeof(*path);) {
+        const EFI_DEVICE_PATH *node = (const EFI_DEVICE_PATH*) ((const UINT8*) path + offset);
+        UINTN length = DevicePathNodeLength(node);
+        if (length < sizeof(*node) || length > size - offset) {
+            return FALSE;
+        }
+
+        offset += length;
+        if (IsDevicePathEnd(node)) {
+            return offset == size;
+        }
+    }
+
+    return FALSE;
+}
+
+// The GPT partition node of the device path (the last one, for nested partitions)
+static const HARDDRIVE_DEVICE_PATH *partition_device_path(EFI_HANDLE handle) {
+    EFI_DEVICE_PATH *path = DevicePathFromHandle(handle);
+    if (!path) {
+        return NULL;
+    }
+
+    const HARDDRIVE_DEVICE_PATH *partition = NULL;
+    for (; !IsDevicePathEnd(path); path = NextDevicePathNode(path)) {
+        if (DevicePathType(path) == MEDIA_DEVICE_PATH && DevicePathSubType(path) == MEDIA_HARDDRIVE_DP) {
+            partition = (const HARDDRIVE_DEVICE_PATH*) path;
+        }
+    }
+
+    if (partition && partition->SignatureType == SIGNATURE_TYPE_GUID) {
+        return partition;
+    }
+    return NULL;
+}
+
+// Check that the handle is (still) the partition with the GUID
+static BOOLEAN partition_matches(EFI_HANDLE handle, const EFI_GUID *guid) {
+    const HARDDRIVE_DEVICE_PATH *partition = partition_device_path(handle);
+    return partition && CompareMem(partition->Signature, guid, sizeof(*guid)) == 0;
+}
+
+static BOOLEAN partition_find_cached(CHAR16 *name, EFI_GUID *guid, EFI_HANDLE *handle) {
+    UINTN size;
+    EFI_DEVICE_PATH *path = LibGetVariableAndSize(name, &AndroidEfiVendorGuid, &size);
+    if (!path) {
+        return FALSE;
+    }
+
+    BOOLEAN found = FALSE;
+    if (device_path_valid(path, size)) {
+        // The device path must match completely
+        EFI_DEVICE_PATH *remaining = path;
+        EFI_STATUS err = uefi_call_wrapper(BS->LocateDevicePath, 3, &BlockIoProtocol, &remaining, handle);
+        found = !err && IsDevicePathEnd(remaining) && partition_matches(*handle, guid);
+    }
+
+    FreePool(path);
+    return found;
+}
+
+static VOID partition_cache(CHAR16 *name, EFI_HANDLE handle) {
+    EFI_DEVICE_PATH *path = DevicePathFromHandle(handle);
+    if (path) {
+        uefi_call_wrapper(RT->SetVariable, 5, name, &AndroidEfiVendorGuid, PARTITION_VARIABLE_ATTRIBUTES,
+                          DevicePathSize(path), path);
+    }
+}
+
+EFI_STATUS partition_find(EFI_GUID *guid, EFI_HANDLE *handle) {
+    CHAR16 name[PARTITION_VARIABLE_SIZE];
+    SPrint(name, sizeof(name), PARTITION_VARIABLE_NAME, guid);
+    if (partition_find_cached(name, guid, handle)) {
+        return EFI_SUCCESS;
+    }
+
+    UINTN handle_count;
+    EFI_HANDLE *handles;
+    EFI_STATUS err = LibLocateHandleByDiskSignature(MBR_TYPE_EFI_PARTITION_TABLE_HEADER, SIGNATURE_TYPE_GUID,
+                                                    guid, &handle_count, &handles);
+    if (err) {
+        goto out;
+    }
+
+    if (handle_count != 1) {
+        if (handle_count == 0) {
+            log_error(L"Partition not found: %g\n", guid);
+            err = EFI_NO_MEDIA;
+        } else {
+            log_error(L"Ambiguous partition GUID: %g\n", guid);
+            err = EFI_VOLUME_CORRUPTED;
+        }
+
+        goto out;
+    }
+
+    *handle = handles[0];
+    partition_cache(name, *handle);
+
+    out:
+    FreePool(handles);
+    return err;
+}
+
+/*
+ * The partition index is built from a single enumeration of all block devices: The partition
+ * tables of all disks are read once (for the labels), then the partitions are matched to the
+ * handles of the firmware using their GUID.
+ */
+
+#define GPT_HEADER_SIGNATURE  0x5452415020494645ULL // "EFI PART"
+#define GPT_MAX_ENTRIES_SIZE  (1024 * 1024)
+#define GPT_HEADER_MIN_SIZE   92
+#define GPT_HEADER_MAX_SIZE   512 // The smallest block size
+
+struct gpt_header {
+    UINT64 signature;
+    UINT32 revision;
+    UINT32 header_size;
+    UINT32 header_crc32;
+    UINT32 reserved;
+    UINT64 my_lba;
+    UINT64 alternate_lba;
+    UINT64 first_usable_lba;
+    UINT64 last_usable_lba;
+    EFI_GUID disk_guid;
+    UINT64 entry_lba;
+    UINT32 entry_count;
+    UINT32 entry_size;
+    UINT32 entries_crc32;
+};
+
+struct gpt_entry {
+    EFI_GUID type_guid;
+    EFI_GUID unique_guid;
+    UINT64 starting_lba;
+    UINT64 ending_lba;
+    UINT64 attributes;
+    CHAR16 name[PARTITION_LABEL_LENGTH];
+};
+
+static struct partition_entry *index_add(struct partition_index *index, const EFI_GUID *guid) {
+    struct partition_entry *entry = malloc_pool(sizeof(*entry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->next = index->entries;
+    entry->guid = *guid;
+    entry->label[0] = 0;
+    entry->handle = NULL;
+    entry->ambiguous = FALSE;
+    index->entries = entry;
+    return entry;
+}
+
+static BOOLEAN guid_empty(const EFI_GUID *guid) {
+    static const EFI_GUID empty;
+    return CompareMem(guid, &empty, sizeof(empty)) == 0;
+}
+
+static EFI_STATUS index_add_disk(struct partition_index *index, EFI_HANDLE handle, const EFI_BLOCK_IO_MEDIA *media) {
+    EFI_DISK_IO *disk_io;
+    EFI_STATUS err = uefi_call_wrapper(BS->HandleProtocol, 3, handle, &DiskIoProtocol, (VOID**) &disk_io);
+    if (err) {
+        return err;
+    }
+
+    // The primary header is in the second block of the disk
+    UINT8 block[GPT_HEADER_MAX_SIZE];
+    err = uefi_call_wrapper(disk_io->ReadDisk, 5, disk_io, media->MediaId, media->BlockSize, sizeof(block), block);
+    if (err) {
+        return err;
+    }
+
+    struct gpt_header header;
+    CopyMem(&header, block, sizeof(header));
+    if (header.signature != GPT_HEADER_SIGNATURE
+            || header.header_size < GPT_HEADER_MIN_SIZE || header.header_size > sizeof(block)) {
+        return EFI_UNSUPPORTED;
+    }
+
+    // The checksum of the header is calculated with the header_crc32 field set to zero
+    UINT32 crc;
+    ((struct gpt_header*) block)->header_crc32 = 0;
+    err = uefi_call_wrapper(BS->CalculateCrc32, 3, block, header.header_size, &crc);
+    if (err || crc != header.header_crc32) {
+        return EFI_CRC_ERROR;
+    }
+
+    // The size of the entries is a multiple of 128 bytes, so they are always aligned
+    if (header.entry_size < sizeof(struct gpt_entry) || header.entry_size % sizeof(struct gpt_entry)
+            || header.entry_count > GPT_MAX_ENTRIES_SIZE / header.entry_size) {
+        return EFI_UNSUPPORTED;
+    }
+
+    UINTN size = header.entry_count * header.entry_size;
+    UINT8 *entries = AllocatePool(size);
+    if (!entries) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    err = uefi_call_wrapper(disk_io->ReadDisk, 5, disk_io, media->MediaId,
+                            MultU64x32(header.entry_lba, media->BlockSize), size, entries);
+    if (err) {
+        goto out;
+    }
+
+    err = uefi_call_wrapper(BS->CalculateCrc32, 3, entries, size, &crc);
+    if (err || crc != header.entries_crc32) {
+        err = EFI_CRC_ERROR;
+        goto out;
+    }
+
+    for (UINTN i = 0; i < size; i += header.entry_size) {
+        const struct gpt_entry *gpt = (const struct gpt_entry*) &entries[i];
+        if (guid_empty(&gpt->type_guid)) {
+            continue;
+        }
+
+        struct partition_entry *entry = index_add(index, &gpt->unique_guid);
+        if (!entry) {
+            err = EFI_OUT_OF_RESOURCES;
+            goto out;
+        }
+
+        CopyMem(entry->label, gpt->name, sizeof(gpt->name));
+        entry->label[PARTITION_LABEL_LENGTH] = 0;
+    }
+
+out:
+    FreePool(entries);
+    return err;
+}
+
+EFI_STATUS partition_index_build(struct partition_index *index) {
+    index->entries = NULL;
+
+    UINTN handle_count;
+    EFI_HANDLE *handles;
+    EFI_STATUS err = LibLocateHandle(ByProtocol, &BlockIoProtocol, NULL, &handle_count, &handles);
+    if (err) {
+        log_error(L"Failed to locate block devices: %r\n", err);
+        return err;
+    }
+
+    // Disks without (valid) GPT are skipped
+    for (UINTN i = 0; i < handle_count; ++i) {
+        EFI_BLOCK_IO *block_io;
+        err = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i], &BlockIoProtocol, (VOID**) &block_io);
+        if (err || block_io->Media->LogicalPartition || !block_io->Media->MediaPresent) {
+            continue;
+        }
+
+        if (index_add_disk(index, handles[i], block_io->Media) == EFI_OUT_OF_RESOURCES) {
+            err = EFI_OUT_OF_RESOURCES;
+            goto out;
+        }
+    }
+
+    err = EFI_SUCCESS;
+    for (UINTN i = 0; i < handle_count; ++i) {
+        const HARDDRIVE_DEVICE_PATH *partition = partition_device_path(handles[i]);
+        if (!partition) {
+            continue;
+        }
+
+        const EFI_GUID *guid = (const EFI_GUID*) partition->Signature;
+        struct partition_entry *entry = (struct partition_entry*) partition_index_find(index, guid);
+        if (!entry) {
+            // The partition table of the disk could not be read, the partition is still usable by GUID
+            entry = index_add(index, guid);
+            if (!entry) {
+                err = EFI_OUT_OF_RESOURCES;
+                goto out;
+            }
+        }
+
+        if (entry->handle) {
+            entry->ambiguous = TRUE;
+        }
+        entry->handle = handles[i];
+    }
+
+out:
+    FreePool(handles);
+    return err;
+}
+
+const struct partition_entry *partition_index_find(const struct partition_index *index, const EFI_GUID *guid) {
+    for (const struct partition_entry *entry = index->entries; entry; entry = entry->next) {
+        if (CompareMem(&entry->guid, guid, sizeof(*guid)) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const struct partition_entry *partition_index_find_label(const struct partition_index *index,
+                                                         const CHAR16 *label, UINTN length) {
+    const struct partition_entry *found = NULL;
+    for (const struct partition_entry *entry = index->entries; entry; entry = entry->next) {
+        if (StrLen(entry->label) == length && CompareMem(entry->label, label, length * sizeof(CHAR16)) == 0) {
+            if (found) {
+                return NULL; // Ambiguous
+            }
+            found = entry;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_PARTITION_H
+#define ANDROID_EFI_PARTITION_H
+
+#include <efi.h>
+
+#define PARTITION_LABEL_LENGTH  36
+
+struct partition_entry {
+    struct partition_entry *next;
+    EFI_GUID guid;
+    CHAR16 label[PARTITION_LABEL_LENGTH + 1]; // Empty if the partition table could not be read
+    EFI_HANDLE handle; // NULL if the firmware does not provide a handle for the partition
+    BOOLEAN ambiguous; // Multiple handles for the same GUID
+};
+
+// All GPT partitions of all disks, collected in a single pass (allocated using malloc_pool())
+struct partition_index {
+    struct partition_entry *entries;
+};
+
+// Find a single partition (using the device path cached in an EFI variable if possible)
+EFI_STATUS partition_find(EFI_GUID *guid, EFI_HANDLE *handle);
+
+EFI_STATUS partition_index_build(struct partition_index *index);
+const struct partition_entry *partition_index_find(const struct partition_index *index, const EFI_GUID *guid);
+// Returns NULL if there are multiple partitions with the label
+const struct partition_entry *partition_index_find_label(const struct partition_index *index,
+                                                         const CHAR16 *label, UINTN length);
+
+#endif //ANDROID_EFI_PARTITION_H
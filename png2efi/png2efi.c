@@ -3,57 +3,271 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
 #include <png.h>
 
-static int write_image(const char *identifier, const char *filename, png_image *image, png_bytep buffer) {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
+/*
+ * Each image is stored as palette (up to 256 colors) and run-length encoded
+ * palette indices (see graphics.h for details on the format). Images with more
+ * colors are stored as run-length encoded BGR colors without a palette.
+ *
+ * The data of all images is written into a binary file that is included using .incbin,
+ * the C file only contains the descriptors for struct graphics_image.
+ */
+
+#define MAX_PALETTE_SIZE  256
+#define MAX_RUN_LENGTH    128
+#define RUN_FLAG          0x80
+#define PIXEL_SIZE        4 // EFI_GRAPHICS_OUTPUT_BLT_PIXEL
+#define COLOR_SIZE        3 // BGR
+
+// Open addressing hash table from colors to palette indices, kept at most half full
+#define PALETTE_HASH_SIZE  (MAX_PALETTE_SIZE * 2)
+#define PALETTE_HASH_EMPTY 0xFFFFFFFF
+
+struct palette {
+    unsigned int size;
+    png_byte colors[MAX_PALETTE_SIZE][COLOR_SIZE];
+    uint32_t hash_colors[PALETTE_HASH_SIZE];
+    png_byte hash_indices[PALETTE_HASH_SIZE];
+};
+
+static void palette_init(struct palette *palette) {
+    palette->size = 0;
+    for (unsigned int i = 0; i < PALETTE_HASH_SIZE; ++i) {
+        palette->hash_colors[i] = PALETTE_HASH_EMPTY;
+    }
+}
+
+static int palette_index(struct palette *palette, png_const_bytep pixel) {
+    uint32_t color = pixel[0] | (uint32_t) pixel[1] << 8 | (uint32_t) pixel[2] << 16;
+    unsigned int slot = (color * 2654435761u) >> 23; // Fibonacci hashing to 9 bits
+
+    while (palette->hash_colors[slot] != PALETTE_HASH_EMPTY) {
+        if (palette->hash_colors[slot] == color) {
+            return palette->hash_indices[slot];
+        }
+        slot = (slot + 1) % PALETTE_HASH_SIZE;
+    }
+
+    if (palette->size == MAX_PALETTE_SIZE) {
+        return -1;
+    }
+
+    memcpy(palette->colors[palette->size], pixel, COLOR_SIZE);
+    palette->hash_colors[slot] = color;
+    palette->hash_indices[slot] = (png_byte) palette->size;
+    return (int) palette->size++;
+}
+
+struct writer {
+    FILE *file;
+    size_t size;
+};
+
+static void write_byte(struct writer *writer, unsigned int b) {
+    fputc((int) b, writer->file);
+    ++writer->size;
+}
+
+static void write_bytes(struct writer *writer, const png_byte *bytes, size_t size) {
+    fwrite(bytes, 1, size, writer->file);
+    writer->size += size;
+}
+
+// Pixels are either palette indices (size 1) or BGR colors (size 3)
+static void write_literal(struct writer *writer, const png_byte *pixels, unsigned int count, size_t size) {
+    while (count) {
+        unsigned int n = count < MAX_RUN_LENGTH ? count : MAX_RUN_LENGTH;
+        write_byte(writer, n - 1);
+        write_bytes(writer, pixels, n * size);
+
+        pixels += n * size;
+        count -= n;
+    }
+}
+
+// Runs never span multiple rows
+static void write_row(struct writer *writer, const png_byte *pixels, unsigned int width, size_t size) {
+    unsigned int literal = 0;
+
+    for (unsigned int x = 0; x < width;) {
+        const png_byte *pixel = &pixels[x * size];
+        unsigned int run = 1;
+        while (x + run < width && run < MAX_RUN_LENGTH && memcmp(&pixel[run * size], pixel, size) == 0) {
+            ++run;
+        }
+
+        // Short runs are cheaper as part of a literal
+        if (run < 3) {
+            ++literal;
+            ++x;
+            continue;
+        }
+
+        write_literal(writer, &pixels[(x - literal) * size], literal, size);
+        literal = 0;
+
+        write_byte(writer, RUN_FLAG | (run - 1));
+        write_bytes(writer, pixel, size);
+        x += run;
+    }
+
+    write_literal(writer, &pixels[(width - literal) * size], literal, size);
+}
+
+struct image_offsets {
+    int has_palette;
+    size_t palette;
+    size_t data;
+};
+
+static void write_direct(struct writer *writer, png_image *image, png_bytep buffer, struct image_offsets *offsets) {
+    offsets->has_palette = 0;
+    offsets->data = writer->size;
+    for (png_uint_32 y = 0; y < image->height; ++y) {
+        write_row(writer, &buffer[y * image->width * COLOR_SIZE], image->width, COLOR_SIZE);
+    }
+}
+
+static int write_image(struct writer *writer, png_image *image, png_bytep buffer, struct image_offsets *offsets) {
+    static struct palette palette;
+    palette_init(&palette);
+
+    png_byte *indices = malloc(image->width * image->height);
+    if (!indices) {
         return EXIT_FAILURE;
     }
 
-    fprintf(file,
-            "#include \"graphics.h\"\n"
-            "static EFI_GRAPHICS_OUTPUT_BLT_PIXEL %s_blt[] = {", identifier);
+    for (png_uint_32 i = 0; i < image->width * image->height; ++i) {
+        int index = palette_index(&palette, &buffer[i * COLOR_SIZE]);
+        if (index < 0) {
+            // Too many colors for a palette, fall back to storing the colors directly
+            free(indices);
+            write_direct(writer, image, buffer, offsets);
+            return EXIT_SUCCESS;
+        }
+        indices[i] = (png_byte) index;
+    }
 
-    for (png_bytep end = buffer + PNG_IMAGE_SIZE(*image); buffer < end; buffer += 3) {
-        fprintf(file, "{%d,%d,%d,0}, ", buffer[0], buffer[1], buffer[2]);
+    // Align palette to the size of a pixel
+    while (writer->size % PIXEL_SIZE) {
+        write_byte(writer, 0);
     }
 
-    fprintf(file, "};\n");
-    fprintf(file, "const struct graphics_image %s_image = {%u, %u, %s_blt};\n",
-            identifier, image->width, image->height, identifier);
+    offsets->has_palette = 1;
+    offsets->palette = writer->size;
+    for (unsigned int i = 0; i < palette.size; ++i) {
+        write_byte(writer, palette.colors[i][0]);
+        write_byte(writer, palette.colors[i][1]);
+        write_byte(writer, palette.colors[i][2]);
+        write_byte(writer, 0);
+    }
+
+    offsets->data = writer->size;
+    for (png_uint_32 y = 0; y < image->height; ++y) {
+        write_row(writer, &indices[y * image->width], image->width, 1);
+    }
 
-    return fclose(file);
+    free(indices);
+    return EXIT_SUCCESS;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: png2efi <identifier> <input.png> <output.c>\n");
+static int read_image(const char *filename, png_image *image, png_bytep *buffer) {
+    memset(image, 0, sizeof(*image));
+    image->version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_file(image, filename)) {
+        fprintf(stderr, "Failed to open PNG file %s: %s\n", filename, image->message);
         return EXIT_FAILURE;
     }
 
-    png_image image = {
-        .version = PNG_IMAGE_VERSION
-    };
+    image->format = PNG_FORMAT_BGR;
 
-    if (!png_image_begin_read_from_file(&image, argv[2])) {
-        fprintf(stderr, "Failed to open PNG file: %s\n", image.message);
+    *buffer = malloc(PNG_IMAGE_SIZE(*image));
+    if (!*buffer) {
+        png_image_free(image);
         return EXIT_FAILURE;
     }
 
-    image.format = PNG_FORMAT_BGR;
+    if (!png_image_finish_read(image, NULL, *buffer, 0, NULL)) {
+        fprintf(stderr, "Failed to read PNG file %s: %s\n", filename, image->message);
+        free(*buffer);
+        return EXIT_FAILURE;
+    }
 
-    png_byte buffer[PNG_IMAGE_SIZE(image)];
-    if (!png_image_finish_read(&image, NULL, buffer, 0, NULL)) {
-        fprintf(stderr, "Failed to read PNG file: %s\n", image.message);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "Usage: png2efi <identifier> <output.c> <output.bin> <input.png>...\n");
         return EXIT_FAILURE;
     }
 
-    if (write_image(argv[1], argv[3], &image, buffer)) {
+    const char *identifier = argv[1];
+    int count = argc - 4;
+
+    struct writer writer = { fopen(argv[3], "wb"), 0 };
+    if (!writer.file) {
+        perror("Failed to open binary file");
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[2], "w");
+    if (!file) {
+        perror("Failed to open C file");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(file,
+            "#include \"graphics.h\"\n"
+            "asm(\".section .rodata\\n\"\n"
+            "    \".balign %d\\n\"\n"
+            "    \".globl %s_blob\\n\"\n"
+            "    \".hidden %s_blob\\n\"\n"
+            "    \"%s_blob: .incbin \\\"%s\\\"\\n\"\n"
+            "    \".previous\");\n"
+            "extern UINT8 %s_blob[] __attribute__((visibility(\"hidden\")));\n"
+            "const struct graphics_image %s_images[] = {\n",
+            PIXEL_SIZE, identifier, identifier, identifier, argv[3], identifier, identifier);
+
+    for (int i = 0; i < count; ++i) {
+        png_image image;
+        png_bytep buffer;
+        if (read_image(argv[4 + i], &image, &buffer)) {
+            return EXIT_FAILURE;
+        }
+
+        struct image_offsets offsets;
+        int err = write_image(&writer, &image, buffer, &offsets);
+        free(buffer);
+        png_image_free(&image);
+        if (err) {
+            return EXIT_FAILURE;
+        }
+
+        if (offsets.has_palette) {
+            fprintf(file, "    {%u, %u, (EFI_GRAPHICS_OUTPUT_BLT_PIXEL*) &%s_blob[%zu], &%s_blob[%zu]},\n",
+                    image.width, image.height, identifier, offsets.palette, identifier, offsets.data);
+        } else {
+            fprintf(file, "    {%u, %u, NULL, &%s_blob[%zu]},\n",
+                    image.width, image.height, identifier, offsets.data);
+        }
+    }
+
+    fprintf(file, "};\n");
+    fprintf(file, "const UINTN %s_image_count = %d;\n", identifier, count);
+
+    if (fclose(writer.file)) {
+        perror("Failed to write binary file");
+        return EXIT_FAILURE;
+    }
+    if (fclose(file)) {
         perror("Failed to write C file");
         return EXIT_FAILURE;
     }
 
-    png_image_free(&image);
-    return 0;
+    return EXIT_SUCCESS;
 }
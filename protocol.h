@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_PROTOCOL_H
+#define ANDROID_EFI_PROTOCOL_H
+
+#include <efi.h>
+
+/*
+ * Definitions for UEFI protocols that are not provided by (all versions of) gnu-efi.
+ *
+ * Taken from the UEFI Specification, Version 2.7
+ */
+
+// EFI_DISK_IO2_TOKEN and EFI_BLOCK_IO2_TOKEN have the same layout
+struct efi_io2_token {
+    EFI_EVENT   event;
+    EFI_STATUS  transaction_status;
+};
+
+// 13.8 Disk I/O 2 Protocol
+
+#define EFI_DISK_IO2_PROTOCOL_GUID \
+    { 0x151c8eae, 0x7f2c, 0x472c, { 0x9e, 0x54, 0x98, 0x28, 0x19, 0x4f, 0x6a, 0x88 } }
+
+struct efi_disk_io2 {
+    UINT64 revision;
+    EFI_STATUS (EFIAPI *cancel)(struct efi_disk_io2 *this);
+    EFI_STATUS (EFIAPI *read_disk_ex)(struct efi_disk_io2 *this, UINT32 media_id, UINT64 offset,
+                                      struct efi_io2_token *token, UINTN buffer_size, VOID *buffer);
+    EFI_STATUS (EFIAPI *write_disk_ex)(struct efi_disk_io2 *this, UINT32 media_id, UINT64 offset,
+                                       struct efi_io2_token *token, UINTN buffer_size, VOID *buffer);
+    EFI_STATUS (EFIAPI *flush_disk_ex)(struct efi_disk_io2 *this, struct efi_io2_token *token);
+};
+
+// 13.10 Block I/O 2 Protocol
+
+#define EFI_BLOCK_IO2_PROTOCOL_GUID \
+    { 0xa77b2472, 0xe282, 0x4e9f, { 0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1 } }
+
+struct efi_block_io2 {
+    EFI_BLOCK_IO_MEDIA *media;
+    EFI_STATUS (EFIAPI *reset)(struct efi_block_io2 *this, BOOLEAN extended_verification);
+    EFI_STATUS (EFIAPI *read_blocks_ex)(struct efi_block_io2 *this, UINT32 media_id, EFI_LBA lba,
+                                        struct efi_io2_token *token, UINTN buffer_size, VOID *buffer);
+    EFI_STATUS (EFIAPI *write_blocks_ex)(struct efi_block_io2 *this, UINT32 media_id, EFI_LBA lba,
+                                         struct efi_io2_token *token, UINTN buffer_size, VOID *buffer);
+    EFI_STATUS (EFIAPI *flush_blocks_ex)(struct efi_block_io2 *this, struct efi_io2_token *token);
+};
+
+// 13.5 File Protocol (revision 2)
+
+#define EFI_FILE_PROTOCOL_REVISION2  0x00020000
+
+struct efi_file_io_token {
+    EFI_EVENT   event;
+    EFI_STATUS  status;
+    UINTN       buffer_size;
+    VOID        *buffer;
+};
+
+struct efi_file2 {
+    UINT64 revision;
+    VOID *file_protocol[10]; // Open ... Flush, see EFI_FILE_PROTOCOL
+    EFI_STATUS (EFIAPI *open_ex)(struct efi_file2 *this, struct efi_file2 **new_handle, CHAR16 *file_name,
+                                 UINT64 open_mode, UINT64 attributes, struct efi_file_io_token *token);
+    EFI_STATUS (EFIAPI *read_ex)(struct efi_file2 *this, struct efi_file_io_token *token);
+    EFI_STATUS (EFIAPI *write_ex)(struct efi_file2 *this, struct efi_file_io_token *token);
+    EFI_STATUS (EFIAPI *flush_ex)(struct efi_file2 *this, struct efi_file_io_token *token);
+};
+
+// 13.2 Load File 2 Protocol
+
+#define EFI_LOAD_FILE2_PROTOCOL_GUID \
+    { 0x4006c0c1, 0xfcb3, 0x403e, { 0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d } }
+
+struct efi_load_file2 {
+    EFI_STATUS (EFIAPI *load_file)(struct efi_load_file2 *this, EFI_DEVICE_PATH *file_path, BOOLEAN boot_policy,
+                                   UINTN *buffer_size, VOID *buffer);
+};
+
+// PI Specification, Volume 2: 13.4 MP Services Protocol
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+#define PROCESSOR_AS_BSP_BIT         0x00000001
+#define PROCESSOR_ENABLED_BIT        0x00000002
+#define PROCESSOR_HEALTH_STATUS_BIT  0x00000004
+
+struct efi_processor_information {
+    UINT64 processor_id;
+    UINT32 status_flag;
+    UINT32 location[3]; // Package, core, thread
+    UINT32 extended_information[9]; // Only filled in if requested
+};
+
+typedef VOID (EFIAPI *efi_ap_procedure)(VOID *argument);
+
+struct efi_mp_services {
+    EFI_STATUS (EFIAPI *get_number_of_processors)(struct efi_mp_services *this, UINTN *number_of_processors,
+                                                  UINTN *number_of_enabled_processors);
+    EFI_STATUS (EFIAPI *get_processor_info)(struct efi_mp_services *this, UINTN processor_number,
+                                            struct efi_processor_information *processor_info_buffer);
+    EFI_STATUS (EFIAPI *startup_all_aps)(struct efi_mp_services *this, efi_ap_procedure procedure,
+                                         BOOLEAN single_thread, EFI_EVENT wait_event, UINTN timeout_in_microseconds,
+                                         VOID *procedure_argument, UINTN **failed_cpu_list);
+    EFI_STATUS (EFIAPI *startup_this_ap)(struct efi_mp_services *this, efi_ap_procedure procedure,
+                                         UINTN processor_number, EFI_EVENT wait_event, UINTN timeout_in_microseconds,
+                                         VOID *procedure_argument, BOOLEAN *finished);
+    EFI_STATUS (EFIAPI *switch_bsp)(struct efi_mp_services *this, UINTN processor_number, BOOLEAN enable_old_bsp);
+    EFI_STATUS (EFIAPI *enable_disable_ap)(struct efi_mp_services *this, UINTN processor_number,
+                                           BOOLEAN enable_ap, UINT32 *health_flag);
+    EFI_STATUS (EFIAPI *who_am_i)(struct efi_mp_services *this, UINTN *processor_number);
+};
+
+#endif //ANDROID_EFI_PROTOCOL_H
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "ramdisk_cache.h"
+#include <efilib.h>
+#include "timing.h"
+#include "trace.h"
+#include "log.h"
+
+#define RAMDISK_CACHE_MAGIC    "AEFIINRD"
+#define RAMDISK_CACHE_VERSION  1
+
+// FNV-1a
+#define PATH_HASH_BASIS  0x811c9dc5
+#define PATH_HASH_PRIME  0x01000193
+
+VOID ramdisk_cache_init_key(struct ramdisk_cache_key *key, const VOID *id, UINT32 flags, UINT64 size) {
+    ZeroMem(key, sizeof(*key));
+    CopyMem(key->id, id, sizeof(key->id));
+    key->flags = flags;
+    key->path_hash = PATH_HASH_BASIS;
+    key->size = size;
+}
+
+BOOLEAN ramdisk_cache_add_input(struct ramdisk_cache_key *key, const CHAR8 *path, UINTN length,
+                                UINT64 size, const EFI_TIME *modification_time) {
+    if (key->input_count >= RAMDISK_CACHE_MAX_INPUTS) {
+        return FALSE;
+    }
+
+    struct ramdisk_cache_input *input = &key->inputs[key->input_count++];
+    input->size = size;
+    CopyMem(&input->modification_time, modification_time, sizeof(input->modification_time));
+
+    // Include the separator so "a b" and "ab" are different
+    for (UINTN i = 0; i <= length; ++i) {
+        key->path_hash ^= i < length ? path[i] : 0;
+        key->path_hash *= PATH_HASH_PRIME;
+    }
+
+    return TRUE;
+}
+
+VOID ramdisk_cache_open(struct ramdisk_cache *cache, EFI_FILE_HANDLE dir, const struct ramdisk_cache_key *key) {
+    cache->hit = FALSE;
+
+    struct ramdisk_cache_header *header = &cache->header;
+    CopyMem(header->magic, RAMDISK_CACHE_MAGIC, sizeof(header->magic));
+    header->version = RAMDISK_CACHE_VERSION;
+    header->header_size = sizeof(*header);
+    CopyMem(&header->key, key, sizeof(header->key));
+
+    EFI_STATUS err = uefi_call_wrapper(dir->Open, 5, dir, &cache->file, RAMDISK_CACHE_FILE_NAME,
+                                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+    if (err) {
+        log_warning(L"Failed to open ramdisk cache: %r\n", err);
+        cache->file = NULL;
+        return;
+    }
+
+    // Newly created files are empty, so the header cannot be read completely
+    struct ramdisk_cache_header existing;
+    UINTN size = sizeof(existing);
+    err = uefi_call_wrapper(cache->file->Read, 3, cache->file, &size, &existing);
+    cache->hit = !err && size == sizeof(existing) && CompareMem(&existing, header, sizeof(existing)) == 0;
+}
+
+VOID ramdisk_cache_close(struct ramdisk_cache *cache) {
+    if (cache->file) {
+        uefi_call_wrapper(cache->file->Close, 1, cache->file);
+        cache->file = NULL;
+    }
+}
+
+EFI_STATUS ramdisk_cache_read(struct ramdisk_cache *cache, VOID *buffer) {
+    UINT64 start = timing_read_tsc();
+
+    // Seek behind the header, the cache may be read multiple times (--initrd-media)
+    UINTN size = 0;
+    EFI_STATUS err = uefi_call_wrapper(cache->file->SetPosition, 2, cache->file, sizeof(cache->header));
+    if (!err) {
+        size = cache->header.key.size;
+        err = uefi_call_wrapper(cache->file->Read, 3, cache->file, &size, buffer);
+    }
+    if (!err && size != cache->header.key.size) {
+        err = EFI_END_OF_FILE;
+    }
+
+    UINT64 ticks = timing_read_tsc() - start;
+    timing_record_read(TIMING_SOURCE_INITRD, 1, size, ticks);
+    trace_read(TIMING_SOURCE_INITRD, 0, buffer, size, start, ticks);
+
+    if (err) {
+        // Rewrite the cache after loading the ramdisk normally
+        log_warning(L"Failed to read ramdisk cache: %r\n", err);
+        cache->hit = FALSE;
+    }
+    return err;
+}
+
+static EFI_STATUS write_file(EFI_FILE_HANDLE file, const VOID *buffer, UINTN size) {
+    return uefi_call_wrapper(file->Write, 3, file, &size, (VOID*) buffer);
+}
+
+VOID ramdisk_cache_write(struct ramdisk_cache *cache, const VOID *buffer) {
+    if (!cache->file || cache->hit) {
+        return;
+    }
+
+    // Invalidate the header first so a partially written cache is never used
+    struct ramdisk_cache_header invalid = {0};
+    EFI_STATUS err = uefi_call_wrapper(cache->file->SetPosition, 2, cache->file, 0);
+    if (!err) {
+        err = write_file(cache->file, &invalid, sizeof(invalid));
+    }
+    if (!err) {
+        err = write_file(cache->file, buffer, cache->header.key.size);
+    }
+    if (!err) {
+        err = uefi_call_wrapper(cache->file->SetPosition, 2, cache->file, 0);
+    }
+    if (!err) {
+        err = write_file(cache->file, &cache->header, sizeof(cache->header));
+    }
+    if (!err) {
+        err = uefi_call_wrapper(cache->file->Flush, 1, cache->file);
+    }
+
+    if (err) {
+        log_warning(L"Failed to write ramdisk cache: %r\n", err);
+    }
+}
@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_RAMDISK_CACHE_H
+#define ANDROID_EFI_RAMDISK_CACHE_H
+
+#include <efi.h>
+
+/*
+ * Cache file on the EFI system partition that contains the concatenated initrd files and ramdisk,
+ * so they can be loaded with a single sequential read. The cache is only validated using
+ * the metadata of its inputs (see struct ramdisk_cache_key), the contents are never compared.
+ */
+
+#define RAMDISK_CACHE_FILE_NAME   L"\\android-efi.initrd"
+#define RAMDISK_CACHE_MAX_INPUTS  16
+
+#define RAMDISK_CACHE_SECOND  (1 << 0) // Second stage is included behind the ramdisk
+
+struct ramdisk_cache_input {
+    UINT64 size;
+    EFI_TIME modification_time;
+} __attribute__((packed));
+
+struct ramdisk_cache_key {
+    UINT32 id[8]; // id[] of the boot image header (SHA-1 of kernel, ramdisk and second)
+    UINT32 flags;
+    UINT32 path_hash; // Hash of all initrd paths (in order)
+    UINT32 input_count;
+    UINT32 reserved;
+    UINT64 size; // Total size of the ramdisk
+    struct ramdisk_cache_input inputs[RAMDISK_CACHE_MAX_INPUTS];
+} __attribute__((packed));
+
+struct ramdisk_cache_header {
+    CHAR8 magic[8];
+    UINT32 version;
+    UINT32 header_size; // The ramdisk follows directly behind the header
+    struct ramdisk_cache_key key;
+} __attribute__((packed));
+
+struct ramdisk_cache {
+    EFI_FILE_HANDLE file; // NULL if the cache is not used
+    BOOLEAN hit;
+    struct ramdisk_cache_header header;
+};
+
+VOID ramdisk_cache_init_key(struct ramdisk_cache_key *key, const VOID *id, UINT32 flags, UINT64 size);
+// Returns FALSE if there are too many inputs to cache
+BOOLEAN ramdisk_cache_add_input(struct ramdisk_cache_key *key, const CHAR8 *path, UINTN length,
+                                UINT64 size, const EFI_TIME *modification_time);
+
+// Opens (or creates) the cache file and checks if it matches the key
+VOID ramdisk_cache_open(struct ramdisk_cache *cache, EFI_FILE_HANDLE dir, const struct ramdisk_cache_key *key);
+VOID ramdisk_cache_close(struct ramdisk_cache *cache);
+
+static inline BOOLEAN ramdisk_cache_hit(const struct ramdisk_cache *cache) {
+    return cache->file && cache->hit;
+}
+
+// Read the cached ramdisk (only on cache hits)
+EFI_STATUS ramdisk_cache_read(struct ramdisk_cache *cache, VOID *buffer);
+// Update the cache with the loaded ramdisk (does nothing on cache hits)
+VOID ramdisk_cache_write(struct ramdisk_cache *cache, const VOID *buffer);
+
+#endif //ANDROID_EFI_RAMDISK_CACHE_H
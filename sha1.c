@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "sha1.h"
+#include <efilib.h>
+#include <cpuid.h>
+
+// Avoid including stdlib.h through mm_malloc.h (not needed and not available in freestanding builds)
+#define _MM_MALLOC_H_INCLUDED
+#include <immintrin.h>
+
+typedef VOID (*sha1_transform_f)(UINT32 state[5], const UINT8 *data, UINTN blocks);
+
+static inline UINT32 rol32(UINT32 x, UINTN n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline UINT32 load_be32(const UINT8 *p) {
+    return (UINT32) p[0] << 24 | (UINT32) p[1] << 16 | (UINT32) p[2] << 8 | p[3];
+}
+
+static VOID sha1_transform_generic(UINT32 state[5], const UINT8 *data, UINTN blocks) {
+    UINT32 w[16];
+
+    for (; blocks--; data += SHA1_BLOCK_SIZE) {
+        UINT32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        for (UINTN i = 0; i < 80; ++i) {
+            if (i < 16) {
+                w[i] = load_be32(&data[i * 4]);
+            } else {
+                w[i & 15] = rol32(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+            }
+
+            UINT32 f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            UINT32 t = rol32(a, 5) + f + e + k + w[i & 15];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = t;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+/*
+ * Implementation using the Intel SHA extensions (SHA-NI).
+ * Based on the public domain implementation by Sean Gulley (Intel) and Jeffrey Walton.
+ */
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+// Four rounds, additionally computing the message schedule for the following rounds
+#define SHA1_ROUNDS4(e_next, e_prev, m0, m1, m2, m3, f) \
+    e_next = _mm_sha1nexte_epu32(e_next, m0); \
+    e_prev = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_next, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+SHA_NI_TARGET
+static VOID sha1_transform_shani(UINT32 state[5], const UINT8 *data, UINTN blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; blocks--; data += SHA1_BLOCK_SIZE) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        // Rounds 0-3
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        // Rounds 4-7
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        // Rounds 8-11
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        // Rounds 12-79
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), mask);
+        SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 0)
+        SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 0)
+        SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 1)
+        SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 1)
+        SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 1)
+        SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1)
+        SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 2)
+        SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 2)
+        SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 2)
+        SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2)
+        SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 3)
+        SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 3)
+        SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 3)
+        SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 3)
+        SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 3)
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static sha1_transform_f sha1_transform;
+
+static sha1_transform_f sha1_select_transform(VOID) {
+    UINT32 eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return sha1_transform_generic;
+    }
+
+    __cpuid(1, eax, ebx, ecx, edx);
+    if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return sha1_transform_generic;
+    }
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & bit_SHA ? sha1_transform_shani : sha1_transform_generic;
+}
+
+VOID sha1_init(struct sha1_ctx *ctx) {
+    if (!sha1_transform) {
+        sha1_transform = sha1_select_transform();
+    }
+
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xEFCDAB89;
+    ctx->state[2] = 0x98BADCFE;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xC3D2E1F0;
+    ctx->length = 0;
+}
+
+VOID sha1_update(struct sha1_ctx *ctx, const VOID *data, UINTN size) {
+    const UINT8 *p = data;
+    UINTN used = ctx->length & (SHA1_BLOCK_SIZE - 1);
+    ctx->length += size;
+
+    if (used) {
+        UINTN n = SHA1_BLOCK_SIZE - used;
+        if (n > size) {
+            n = size;
+        }
+
+        CopyMem(&ctx->buffer[used], p, n);
+        p += n;
+        size -= n;
+
+        if (used + n < SHA1_BLOCK_SIZE) {
+            return;
+        }
+        sha1_transform(ctx->state, ctx->buffer, 1);
+    }
+
+    // Hash complete blocks directly from the input
+    UINTN blocks = size / SHA1_BLOCK_SIZE;
+    if (blocks) {
+        sha1_transform(ctx->state, p, blocks);
+        p += blocks * SHA1_BLOCK_SIZE;
+        size -= blocks * SHA1_BLOCK_SIZE;
+    }
+
+    if (size) {
+        CopyMem(ctx->buffer, p, size);
+    }
+}
+
+VOID sha1_final(struct sha1_ctx *ctx, UINT8 digest[SHA1_DIGEST_SIZE]) {
+    UINT64 bits = ctx->length << 3;
+    UINTN used = ctx->length & (SHA1_BLOCK_SIZE - 1);
+
+    // Padding: 0x80, zeros and the message length in bits (big endian)
+    ctx->buffer[used++] = 0x80;
+    if (used > SHA1_BLOCK_SIZE - sizeof(bits)) {
+        ZeroMem(&ctx->buffer[used], SHA1_BLOCK_SIZE - used);
+        sha1_transform(ctx->state, ctx->buffer, 1);
+        used = 0;
+    }
+
+    ZeroMem(&ctx->buffer[used], SHA1_BLOCK_SIZE - sizeof(bits) - used);
+    for (UINTN i = 0; i < sizeof(bits); ++i) {
+        ctx->buffer[SHA1_BLOCK_SIZE - 1 - i] = (UINT8) (bits >> (i * 8));
+    }
+    sha1_transform(ctx->state, ctx->buffer, 1);
+
+    for (UINTN i = 0; i < 5; ++i) {
+        digest[i * 4 + 0] = (UINT8) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (UINT8) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (UINT8) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (UINT8) ctx->state[i];
+    }
+}
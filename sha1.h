@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_SHA1_H
+#define ANDROID_EFI_SHA1_H
+
+#include <efi.h>
+
+#define SHA1_DIGEST_SIZE  20
+#define SHA1_BLOCK_SIZE   64
+
+struct sha1_ctx {
+    UINT32 state[5];
+    UINT64 length;
+    UINT8 buffer[SHA1_BLOCK_SIZE];
+};
+
+VOID sha1_init(struct sha1_ctx *ctx);
+VOID sha1_update(struct sha1_ctx *ctx, const VOID *data, UINTN size);
+VOID sha1_final(struct sha1_ctx *ctx, UINT8 digest[SHA1_DIGEST_SIZE]);
+
+#endif //ANDROID_EFI_SHA1_H
@@ -26,6 +26,12 @@ CHAR8 *str_utf16_to_utf8(CHAR8 *dst, const CHAR16 *src, UINTN n) {
 
     while (n--) {
         c = *src++;
+        if (c < 0x80) {
+            // Fast path for ASCII characters
+            *dst++ = c;
+            continue;
+        }
+
         if (n && c >= 0xd800 && c <= 0xdbff && *src >= 0xdc00 && *src <= 0xdfff) {
             c = 0x10000 + ((c & 0x3ff) << 10) + (*src & 0x3ff);
             src++;
@@ -34,10 +40,6 @@ CHAR8 *str_utf16_to_utf8(CHAR8 *dst, const CHAR16 *src, UINTN n) {
         if (c >= 0xd800 && c <= 0xdfff) {
             c = 0xfffd; /* Unmatched surrogate */
         }
-        if (c < 0x80) {
-            *dst++ = c;
-            continue;
-        }
         if (c < 0x800) {
             *dst++ = 0xc0 + (c >> 6);
             goto t1;
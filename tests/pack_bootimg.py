@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2018 lambdadroid
+
+"""
+Packs a kernel and ramdisk into an Android boot image (header version 0), including
+the SHA-1 digest in id[] that is checked by android-efi with --verify.
+"""
+
+import argparse
+import hashlib
+import struct
+
+BOOT_MAGIC = b'ANDROID!'
+BOOT_NAME_SIZE = 16
+BOOT_ARGS_SIZE = 512
+BOOT_EXTRA_ARGS_SIZE = 1024
+
+# magic, kernel/ramdisk/second size and address, tags_addr, page_size, header_version, os_version
+HEADER_FORMAT = '<8s10I%ds%ds32s%ds' % (BOOT_NAME_SIZE, BOOT_ARGS_SIZE, BOOT_EXTRA_ARGS_SIZE)
+
+
+def _pad(data, page_size):
+    return data + b'\0' * (-len(data) % page_size)
+
+
+def image_id(kernel, ramdisk, second=b''):
+    sha1 = hashlib.sha1()
+    for data in (kernel, ramdisk, second):
+        sha1.update(data)
+        sha1.update(struct.pack('<I', len(data)))
+    return sha1.digest()
+
+
+def pack(kernel, ramdisk, page_size=2048, cmdline='', second=b'', name=''):
+    if page_size & (page_size - 1) or page_size < 2048:
+        raise ValueError('Invalid page size: %d' % page_size)
+
+    cmdline = cmdline.encode()
+    if len(cmdline) >= BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE:
+        raise ValueError('Command line too long')
+
+    header = struct.pack(HEADER_FORMAT, BOOT_MAGIC,
+                         len(kernel), 0x10008000, len(ramdisk), 0x11000000, len(second), 0x10f00000,
+                         0x10000100, page_size, 0, 0,
+                         name.encode()[:BOOT_NAME_SIZE - 1], cmdline[:BOOT_ARGS_SIZE - 1],
+                         image_id(kernel, ramdisk, second), cmdline[BOOT_ARGS_SIZE - 1:])
+
+    return b''.join(_pad(data, page_size) for data in (header, kernel, ramdisk, second))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--kernel', required=True, type=argparse.FileType('rb'))
+    parser.add_argument('--ramdisk', type=argparse.FileType('rb'))
+    parser.add_argument('--second', type=argparse.FileType('rb'))
+    parser.add_argument('--page-size', type=int, default=2048)
+    parser.add_argument('--cmdline', default='')
+    parser.add_argument('-o', '--output', required=True, type=argparse.FileType('wb'))
+    args = parser.parse_args()
+
+    args.output.write(pack(args.kernel.read(), args.ramdisk.read() if args.ramdisk else b'',
+                           args.page_size, args.cmdline, args.second.read() if args.second else b''))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,352 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2018 lambdadroid
+
+"""
+Boots android.efi under QEMU/OVMF with the stub kernel (see stub/stub.c) and boot images
+with different ramdisk and page sizes, loaded from GPT partitions or from files on the ESP.
+
+The ESP is a directory exposed as FAT drive by QEMU. The UEFI Shell runs android.efi once
+for each boot image from startup.nsh: the stub records what was loaded to the serial port
+and returns to the loader. The recorded kernel, ramdisk and command line are compared with
+the boot images, and the loader time (sum of LoaderStageTimeUSec) is checked against the
+threshold. Without KVM the loader time is only reported: software emulation (TCG) is far
+too slow for hashing and copying the images to give meaningful timings.
+
+Exits with 77 (skipped) if QEMU or OVMF cannot be found.
+"""
+
+import argparse
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import uuid
+import zlib
+
+# Do not write bytecode into the source directory
+sys.dont_write_bytecode = True
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import pack_bootimg  # noqa: E402
+
+EXIT_SKIP = 77
+
+STUB_PREFIX = 'android-efi-stub: '
+TEST_PARAM = 'android_efi_test='
+ANDROID_EFI_LOADER_ID = 0xff
+
+OVMF_SEARCH_PATHS = [
+    ('/usr/share/OVMF/OVMF_CODE.fd', '/usr/share/OVMF/OVMF_VARS.fd'),
+    ('/usr/share/OVMF/OVMF_CODE_4M.fd', '/usr/share/OVMF/OVMF_VARS_4M.fd'),
+    ('/usr/share/edk2/ovmf/OVMF_CODE.fd', '/usr/share/edk2/ovmf/OVMF_VARS.fd'),
+    ('/usr/share/edk2-ovmf/x64/OVMF_CODE.fd', '/usr/share/edk2-ovmf/x64/OVMF_VARS.fd'),
+    ('/usr/share/qemu/edk2-x86_64-code.fd', '/usr/share/qemu/edk2-i386-vars.fd'),
+    ('/usr/share/ovmf/OVMF.fd', None),
+    ('/usr/share/qemu/OVMF.fd', None),
+]
+
+SECTOR_SIZE = 512
+PARTITION_ALIGN = 1024 * 1024
+GPT_ENTRIES = 128
+GPT_ENTRY_SIZE = 128
+GPT_ENTRY_SECTORS = GPT_ENTRIES * GPT_ENTRY_SIZE // SECTOR_SIZE
+ANDROID_BOOT_TYPE = uuid.UUID('49a4d17f-93a3-45c1-a0de-f50b2ebe2599')
+
+# vvfat uses FAT16 for hard disks, keep some space for the other files
+MAX_ESP_SIZE = 400 * 1024 * 1024
+
+
+class BootImage:
+    def __init__(self, name, ramdisk_size, page_size, stub):
+        self.name = name
+        self.page_size = page_size
+        self.cmdline = 'console=ttyS0 %s%s' % (TEST_PARAM, name)
+        self.ramdisk = random.Random(ramdisk_size).getrandbits(ramdisk_size * 8).to_bytes(ramdisk_size, 'little')
+        self.data = pack_bootimg.pack(stub, self.ramdisk, page_size, self.cmdline, name=name)
+        self.partition_guid = uuid.uuid5(uuid.NAMESPACE_URL, 'android-efi-test:' + name)
+
+
+def find_ovmf(code, variables):
+    if code:
+        return (code, variables) if os.path.exists(code) else (None, None)
+    for code, variables in OVMF_SEARCH_PATHS:
+        if os.path.exists(code) and (not variables or os.path.exists(variables)):
+            return code, variables
+    return None, None
+
+
+def stub_kernel(path):
+    with open(path, 'rb') as f:
+        stub = f.read()
+
+    # Protected-mode part as loaded by android-efi (checksummed by the stub in units of 16 bytes)
+    setup_sects, _, syssize = struct.unpack_from('<BHI', stub, 0x1f1)
+    kernel = stub[(setup_sects + 1) * SECTOR_SIZE:]
+    if len(kernel) != syssize * 16:
+        raise ValueError('Unexpected size of stub kernel: %d (syssize: %d)' % (len(kernel), syssize))
+    return stub, zlib.crc32(kernel)
+
+
+def gpt_header(lba, alternate, entries_lba, last_lba, disk_guid, entries_crc):
+    def pack(crc):
+        return struct.pack('<8sIIIIQQQQ16sQIII', b'EFI PART', 0x10000, 92, crc, 0, lba, alternate,
+                           2 + GPT_ENTRY_SECTORS, last_lba - 1 - GPT_ENTRY_SECTORS,
+                           disk_guid.bytes_le, entries_lba, GPT_ENTRIES, GPT_ENTRY_SIZE, entries_crc)
+    return pack(zlib.crc32(pack(0)))
+
+
+def write_gpt_disk(path, images):
+    # Each boot image is placed in its own partition, aligned to 1 MiB
+    offset = PARTITION_ALIGN
+    layout = []
+    for image in images:
+        layout.append((image, offset))
+        offset += -(-len(image.data) // PARTITION_ALIGN) * PARTITION_ALIGN
+    disk_size = offset + PARTITION_ALIGN
+    last_lba = disk_size // SECTOR_SIZE - 1
+
+    entries = bytearray(GPT_ENTRIES * GPT_ENTRY_SIZE)
+    for i, (image, offset) in enumerate(layout):
+        first = offset // SECTOR_SIZE
+        last = first + -(-len(image.data) // SECTOR_SIZE) - 1
+        struct.pack_into('<16s16sQQQ72s', entries, i * GPT_ENTRY_SIZE, ANDROID_BOOT_TYPE.bytes_le,
+                         image.partition_guid.bytes_le, first, last, 0, image.name.encode('utf-16-le'))
+    entries_crc = zlib.crc32(entries)
+
+    disk_guid = uuid.uuid5(uuid.NAMESPACE_URL, 'android-efi-test:disk')
+    mbr = bytearray(SECTOR_SIZE)
+    struct.pack_into('<B3sB3sII', mbr, 446, 0, b'\x00\x02\x00', 0xee, b'\xff\xff\xff', 1, min(last_lba, 0xffffffff))
+    mbr[510:512] = b'\x55\xaa'
+
+    with open(path, 'wb') as f:
+        f.truncate(disk_size)
+        f.write(mbr)
+        f.write(gpt_header(1, last_lba, 2, last_lba, disk_guid, entries_crc))
+        f.seek(2 * SECTOR_SIZE)
+        f.write(entries)
+
+        for image, offset in layout:
+            f.seek(offset)
+            f.write(image.data)
+
+        f.seek((last_lba - GPT_ENTRY_SECTORS) * SECTOR_SIZE)
+        f.write(entries)
+        f.seek(last_lba * SECTOR_SIZE)
+        f.write(gpt_header(last_lba, 1, last_lba - GPT_ENTRY_SECTORS, last_lba, disk_guid, entries_crc))
+
+
+def write_startup_script(path, images, source, loader_args):
+    lines = ['@echo -off', 'fs0:']
+    for image in images:
+        target = str(image.partition_guid) if source == 'partition' else '/%s.img' % image.name
+        lines.append(' '.join(['android.efi'] + loader_args + [target]))
+    lines.append('reset -s')
+
+    with open(path, 'w', newline='\r\n') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def parse_serial(output):
+    # One record per boot, from "begin" to "end"
+    output = re.sub(r'\x1b\[[0-9;?]*[A-Za-z]', '', output)
+    records = []
+    record = None
+    for line in output.splitlines():
+        index = line.find(STUB_PREFIX)
+        if index < 0:
+            continue
+
+        key, _, value = line[index + len(STUB_PREFIX):].rstrip('\r').partition(' ')
+        if key == 'begin':
+            record = {'stage': {}, 'read': []}
+        elif record is None:
+            continue
+        elif key == 'end':
+            records.append(record)
+            record = None
+        elif key == 'stage':
+            name, _, usec = value.partition(' ')
+            if usec:
+                record['stage'][name] = int(usec)
+        elif key == 'read':
+            record['read'].append(value)
+        elif key == 'cmdline':
+            record[key] = value
+        else:
+            record[key] = int(value, 0)
+    return records
+
+
+def check_record(record, image, kernel_crc):
+    errors = []
+    if record.get('loader') != ANDROID_EFI_LOADER_ID:
+        errors.append('type_of_loader is %s' % record.get('loader'))
+    if record.get('kernel_crc') != kernel_crc:
+        errors.append('kernel checksum mismatch')
+    if record.get('ramdisk_size') != len(image.ramdisk):
+        errors.append('ramdisk size is %s, expected %d' % (record.get('ramdisk_size'), len(image.ramdisk)))
+    elif record.get('ramdisk_crc') != zlib.crc32(image.ramdisk):
+        errors.append('ramdisk checksum mismatch')
+    if image.cmdline not in record.get('cmdline', ''):
+        errors.append('command line does not contain "%s"' % image.cmdline)
+    if not record['stage']:
+        errors.append('LoaderStageTimeUSec is missing')
+    return errors
+
+
+def run_qemu(args, workdir, esp, disk):
+    vars_copy = None
+    if args.ovmf_vars:
+        vars_copy = os.path.join(workdir, 'OVMF_VARS.fd')
+        shutil.copyfile(args.ovmf_vars, vars_copy)
+
+    command = [args.qemu, '-machine', 'q35', '-m', str(args.memory), '-smp', str(args.smp),
+               '-display', 'none', '-monitor', 'none', '-serial', 'stdio', '-nic', 'none', '-no-reboot']
+
+    command += ['-accel', args.accel]
+
+    if vars_copy:
+        command += ['-drive', 'if=pflash,format=raw,readonly=on,file=' + args.ovmf,
+                    '-drive', 'if=pflash,format=raw,file=' + vars_copy]
+    else:
+        command += ['-bios', args.ovmf]
+
+    command += ['-drive', 'format=raw,file=fat:' + esp]
+    if disk:
+        command += ['-drive', 'format=raw,if=virtio,file=' + disk]
+
+    try:
+        result = subprocess.run(command, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                                stderr=subprocess.STDOUT, timeout=args.timeout)
+        return result.returncode, result.stdout.decode(errors='replace')
+    except subprocess.TimeoutExpired as e:
+        return None, (e.stdout or b'').decode(errors='replace')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--loader', required=True, help='android.efi')
+    parser.add_argument('--stub', required=True, help='stub kernel (bzImage)')
+    parser.add_argument('--source', choices=['partition', 'file'], default='partition')
+    parser.add_argument('--qemu', default='qemu-system-x86_64')
+    parser.add_argument('--ovmf', default='', help='OVMF firmware (code), searched if not specified')
+    parser.add_argument('--ovmf-vars', default='', help='OVMF variable store template')
+    parser.add_argument('--shell', default='', help='UEFI Shell, if not built into the firmware')
+    parser.add_argument('--accel', default='auto', help='QEMU accelerator (kvm if available, tcg otherwise)')
+    parser.add_argument('--memory', type=int, default=1024, help='memory size (MiB)')
+    parser.add_argument('--smp', type=int, default=2)
+    parser.add_argument('--ramdisk-sizes', default='64,4096,32768', help='ramdisk sizes (KiB)')
+    parser.add_argument('--page-sizes', default='2048,4096,16384')
+    parser.add_argument('--loader-args', default='', help='additional arguments for android.efi')
+    parser.add_argument('--threshold', type=float, default=0,
+                        help='maximum loader time (ms) with KVM, 0 to disable')
+    parser.add_argument('--timeout', type=int, default=1200, help='timeout for QEMU (s)')
+    parser.add_argument('--workdir', help='keep the generated files in this directory')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    qemu = shutil.which(args.qemu)
+    if not qemu:
+        print('%s not found, skipping' % args.qemu)
+        return EXIT_SKIP
+    args.qemu = qemu
+
+    ovmf, ovmf_vars = find_ovmf(args.ovmf, args.ovmf_vars)
+    if not ovmf:
+        print('OVMF not found (%s), skipping' % (args.ovmf or 'set the ovmf option'))
+        return EXIT_SKIP
+    args.ovmf = ovmf
+    args.ovmf_vars = args.ovmf_vars or ovmf_vars
+
+    stub, kernel_crc = stub_kernel(args.stub)
+    images = [BootImage('r%dk-p%d' % (size, page_size), size * 1024, page_size, stub)
+              for size in map(int, args.ramdisk_sizes.split(','))
+              for page_size in map(int, args.page_sizes.split(','))]
+
+    if args.workdir:
+        os.makedirs(args.workdir, exist_ok=True)
+        workdir = args.workdir
+    else:
+        tmp = tempfile.TemporaryDirectory(prefix='android-efi-test-')
+        workdir = tmp.name
+
+    # The ESP only contains android.efi (and the boot images when loaded from files)
+    esp = os.path.join(workdir, 'esp')
+    shutil.rmtree(esp, ignore_errors=True)
+    os.makedirs(esp)
+    shutil.copyfile(args.loader, os.path.join(esp, 'android.efi'))
+    if args.shell:
+        os.makedirs(os.path.join(esp, 'EFI', 'BOOT'))
+        shutil.copyfile(args.shell, os.path.join(esp, 'EFI', 'BOOT', 'BOOTX64.EFI'))
+    write_startup_script(os.path.join(esp, 'startup.nsh'), images, args.source, args.loader_args.split())
+
+    disk = None
+    if args.source == 'partition':
+        disk = os.path.join(workdir, 'disk.img')
+        write_gpt_disk(disk, images)
+    else:
+        if sum(len(image.data) for image in images) > MAX_ESP_SIZE:
+            print('Boot images do not fit on the ESP (maximum: %d MiB)' % (MAX_ESP_SIZE // 1024 // 1024))
+            return 1
+        for image in images:
+            with open(os.path.join(esp, image.name + '.img'), 'wb') as f:
+                f.write(image.data)
+
+    if args.accel == 'auto':
+        args.accel = 'kvm' if os.access('/dev/kvm', os.R_OK | os.W_OK) else 'tcg'
+    check_time = args.threshold and args.accel == 'kvm'
+    if args.threshold and not check_time:
+        print('Not checking the loader time against the threshold without KVM (accel: %s)' % args.accel)
+
+    returncode, output = run_qemu(args, workdir, esp, disk)
+    if args.verbose or args.workdir:
+        with open(os.path.join(workdir, 'serial.log'), 'w') as f:
+            f.write(output)
+
+    records = {}
+    for record in parse_serial(output):
+        name = record.get('cmdline', '').partition(TEST_PARAM)[2].split(' ')[0]
+        records[name] = record
+
+    failed = returncode is None or returncode != 0
+    if returncode is None:
+        print('QEMU timed out after %d s (is the UEFI Shell available? Use --shell otherwise)' % args.timeout)
+    elif returncode != 0:
+        print('QEMU exited with %d' % returncode)
+
+    print('%-16s %-9s %10s %6s %10s %10s %10s %8s' % ('image', 'source', 'ramdisk', 'page', 'loader ms',
+                                                     'kernel ms', 'ramdisk ms', 'MB/s'))
+    for image in images:
+        record = records.get(image.name)
+        if not record:
+            print('%-16s no output from the stub kernel (failed to boot)' % image.name)
+            failed = True
+            continue
+
+        stages = record['stage']
+        loader_ms = sum(stages.values()) / 1000
+        load_usec = stages.get('load-kernel', 0) + stages.get('load-ramdisk', 0)
+        throughput = len(image.data) / load_usec if load_usec else 0
+        print('%-16s %-9s %10d %6d %10.1f %10.1f %10.1f %8.1f' % (
+            image.name, args.source, len(image.ramdisk), image.page_size, loader_ms,
+            stages.get('load-kernel', 0) / 1000, stages.get('load-ramdisk', 0) / 1000, throughput))
+        if args.verbose:
+            for line in record['read']:
+                print('    read %s' % line)
+
+        errors = check_record(record, image, kernel_crc)
+        if check_time and loader_ms > args.threshold:
+            errors.append('loader time %.1f ms exceeds threshold of %.1f ms' % (loader_ms, args.threshold))
+        for error in errors:
+            print('%-16s FAIL: %s' % (image.name, error))
+        failed = failed or bool(errors)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
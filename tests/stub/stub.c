@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include <efi.h>
+
+/*
+ * Stub kernel for the QEMU boot tests: Records what the loader passed in the boot parameters
+ * (kernel, ramdisk and command line with their CRC32) and the timing variables of android-efi
+ * to the serial port (COM1), one "android-efi-stub: <key> <value>" line per value.
+ *
+ * Boot services are still available (the real kernel exits them itself), so the stub returns
+ * to the loader afterwards. This allows booting multiple images from a single startup.nsh.
+ * The code must be position independent and must not have any writable data, since the
+ * kernel is checksummed as loaded.
+ */
+
+#define SERIAL_PORT      0x3f8
+#define SERIAL_LSR       (SERIAL_PORT + 5)
+#define SERIAL_LSR_THRE  0x20
+
+#define EXT_RAMDISK_IMAGE    0x0c0
+#define EXT_RAMDISK_SIZE     0x0c4
+#define EXT_CMD_LINE_PTR     0x0c8
+
+// Offsets in the setup header
+#define HEADER_SYSSIZE         0x1f4
+#define HEADER_TYPE_OF_LOADER  0x210
+#define HEADER_CODE32_START    0x214
+#define HEADER_RAMDISK_IMAGE   0x218
+#define HEADER_RAMDISK_SIZE    0x21c
+#define HEADER_CMD_LINE_PTR    0x228
+
+#define PREFIX "android-efi-stub: "
+#define MAX_VARIABLE_SIZE  4096
+
+static const EFI_GUID AndroidEfiVendorGuid =
+    { 0x519f7227, 0x0d7f, 0x4826, { 0xb2, 0xf8, 0x17, 0x0e, 0x6f, 0x99, 0x15, 0xd3 } };
+
+// Declared by the compiler for struct copies
+void *memset(void *s, int c, __SIZE_TYPE__ n);
+void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n);
+VOID stub_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *system_table, UINT8 *boot_params);
+
+void *memset(void *s, int c, __SIZE_TYPE__ n) {
+    UINT8 *p = s;
+    while (n--) {
+        *p++ = (UINT8) c;
+    }
+    return s;
+}
+
+void *memcpy(void *dest, const void *src, __SIZE_TYPE__ n) {
+    UINT8 *d = dest;
+    const UINT8 *s = src;
+    while (n--) {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+static inline VOID outb(UINT16 port, UINT8 value) {
+    asm volatile ("outb %0, %1" : : "a" (value), "Nd" (port));
+}
+
+static inline UINT8 inb(UINT16 port) {
+    UINT8 value;
+    asm volatile ("inb %1, %0" : "=a" (value) : "Nd" (port));
+    return value;
+}
+
+static inline UINT64 read_tsc(VOID) {
+    UINT32 low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return (UINT64) high << 32 | low;
+}
+
+// The serial port was already initialized by the firmware
+static VOID serial_putc(CHAR8 c) {
+    while (!(inb(SERIAL_LSR) & SERIAL_LSR_THRE)) {
+    }
+    outb(SERIAL_PORT, (UINT8) c);
+}
+
+static VOID serial_puts(const CHAR8 *s) {
+    for (; *s; ++s) {
+        serial_putc(*s);
+    }
+}
+
+static VOID serial_put_number(UINT64 value, UINTN base) {
+    CHAR8 buffer[24];
+    UINTN i = sizeof(buffer);
+    buffer[--i] = 0;
+    do {
+        UINTN digit = value % base;
+        buffer[--i] = (CHAR8) (digit < 10 ? '0' + digit : 'a' + digit - 10);
+        value /= base;
+    } while (value);
+
+    if (base == 16) {
+        buffer[--i] = 'x';
+        buffer[--i] = '0';
+    }
+    serial_puts(&buffer[i]);
+}
+
+static VOID record(const CHAR8 *key, UINT64 value, UINTN base) {
+    serial_puts((const CHAR8*) PREFIX);
+    serial_puts(key);
+    serial_putc(' ');
+    serial_put_number(value, base);
+    serial_puts((const CHAR8*) "\r\n");
+}
+
+static UINT32 crc32(EFI_SYSTEM_TABLE *system_table, const VOID *data, UINT64 size) {
+    UINT32 crc = 0;
+    if (size) {
+        uefi_call_wrapper(system_table->BootServices->CalculateCrc32, 3, (VOID*) data, (UINTN) size, &crc);
+    }
+    return crc;
+}
+
+// Variables contain one "<name> <values...>" line per entry
+static VOID record_variable(EFI_SYSTEM_TABLE *system_table, const CHAR8 *key, CHAR16 *name) {
+    CHAR16 value[MAX_VARIABLE_SIZE / sizeof(CHAR16)];
+    UINTN size = sizeof(value) - sizeof(CHAR16);
+    EFI_STATUS err = uefi_call_wrapper(system_table->RuntimeServices->GetVariable, 5, name,
+                                       (EFI_GUID*) &AndroidEfiVendorGuid, NULL, &size, value);
+    if (err) {
+        record(key, 0, 10);
+        return;
+    }
+
+    BOOLEAN line_start = TRUE;
+    for (UINTN i = 0; i < size / sizeof(CHAR16) && value[i]; ++i) {
+        if (line_start) {
+            serial_puts((const CHAR8*) PREFIX);
+            serial_puts(key);
+            serial_putc(' ');
+            line_start = FALSE;
+        }
+
+        if (value[i] == L'\n') {
+            serial_puts((const CHAR8*) "\r\n");
+            line_start = TRUE;
+        } else {
+            serial_putc(value[i] < 0x80 ? (CHAR8) value[i] : '?');
+        }
+    }
+    if (!line_start) {
+        serial_puts((const CHAR8*) "\r\n");
+    }
+}
+
+static inline UINT32 boot_params_u32(const UINT8 *boot_params, UINTN offset) {
+    return *(const UINT32*) (boot_params + offset);
+}
+
+static inline UINT64 boot_params_ext(const UINT8 *boot_params, UINTN ext_offset, UINTN offset) {
+    return (UINT64) boot_params_u32(boot_params, ext_offset) << 32 | boot_params_u32(boot_params, offset);
+}
+
+VOID stub_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *system_table, UINT8 *boot_params) {
+    UINT64 tsc = read_tsc();
+    (VOID) image;
+
+    serial_puts((const CHAR8*) "\r\n" PREFIX "begin\r\n");
+    record((const CHAR8*) "tsc", tsc, 10);
+    record((const CHAR8*) "loader", boot_params[HEADER_TYPE_OF_LOADER], 16);
+
+    const UINT8 *kernel = (const UINT8*) (UINTN) boot_params_u32(boot_params, HEADER_CODE32_START);
+    UINT64 kernel_size = (UINT64) boot_params_u32(boot_params, HEADER_SYSSIZE) * 16;
+    record((const CHAR8*) "kernel", (UINTN) kernel, 16);
+    record((const CHAR8*) "kernel_size", kernel_size, 10);
+    record((const CHAR8*) "kernel_crc", crc32(system_table, kernel, kernel_size), 16);
+
+    const UINT8 *ramdisk = (const UINT8*) (UINTN) boot_params_ext(boot_params, EXT_RAMDISK_IMAGE, HEADER_RAMDISK_IMAGE);
+    UINT64 ramdisk_size = boot_params_ext(boot_params, EXT_RAMDISK_SIZE, HEADER_RAMDISK_SIZE);
+    record((const CHAR8*) "ramdisk", (UINTN) ramdisk, 16);
+    record((const CHAR8*) "ramdisk_size", ramdisk_size, 10);
+    record((const CHAR8*) "ramdisk_crc", crc32(system_table, ramdisk, ramdisk_size), 16);
+
+    const CHAR8 *cmdline = (const CHAR8*) (UINTN) boot_params_ext(boot_params, EXT_CMD_LINE_PTR, HEADER_CMD_LINE_PTR);
+    if (cmdline) {
+        UINTN length = 0;
+        while (cmdline[length]) {
+            ++length;
+        }
+        record((const CHAR8*) "cmdline_crc", crc32(system_table, cmdline, length), 16);
+
+        serial_puts((const CHAR8*) PREFIX "cmdline ");
+        serial_puts(cmdline);
+        serial_puts((const CHAR8*) "\r\n");
+    }
+
+    record_variable(system_table, (const CHAR8*) "stage", L"LoaderStageTimeUSec");
+    record_variable(system_table, (const CHAR8*) "read", L"LoaderReadStats");
+    serial_puts((const CHAR8*) PREFIX "end\r\n");
+
+    // The loader disabled interrupts before calling the kernel
+    asm volatile ("sti");
+}
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "timing.h"
+#include "guid.h"
+#include <efilib.h>
+
+// Variables compatible with systemd-boot (see https://systemd.io/BOOT_LOADER_INTERFACE/)
+static EFI_GUID LoaderInterfaceGuid =
+    { 0x4a67b082, 0x0a4c, 0x41cf, { 0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f } };
+
+#define LOADER_TIME_INIT_VARIABLE  L"LoaderTimeInitUSec"
+#define LOADER_TIME_EXEC_VARIABLE  L"LoaderTimeExecUSec"
+#define STAGE_TIME_VARIABLE        L"LoaderStageTimeUSec"
+#define READ_STATS_VARIABLE        L"LoaderReadStats"
+
+#define VARIABLE_ATTRIBUTES        (EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS)
+
+static const CHAR16 *stage_names[TIMING_STAGE_COUNT] = {
+    [TIMING_PARSE_COMMAND_LINE] = L"parse-command-line",
+    [TIMING_DISPLAY_SPLASH]     = L"display-splash",
+    [TIMING_OPEN_IMAGE]         = L"open-image",
+    [TIMING_READ_HEADER]        = L"read-header",
+    [TIMING_LOAD_KERNEL]        = L"load-kernel",
+    [TIMING_PREPARE_CMDLINE]    = L"prepare-cmdline",
+    [TIMING_LOAD_RAMDISK]       = L"load-ramdisk",
+    [TIMING_HANDOVER]           = L"handover",
+};
+
+static const CHAR16 *source_names[TIMING_SOURCE_COUNT] = {
+    [TIMING_SOURCE_PARTITION]   = L"partition",
+    [TIMING_SOURCE_FILE]        = L"file",
+    [TIMING_SOURCE_LZ4]         = L"lz4",
+    [TIMING_SOURCE_INITRD]      = L"initrd",
+    [TIMING_SOURCE_VENDOR_BOOT] = L"vendor_boot",
+};
+
+static struct {
+    UINTN calls;
+    UINT64 bytes;
+    UINT64 ticks;
+} read_stats[TIMING_SOURCE_COUNT];
+
+static UINTN cache_hits, cache_misses;
+
+static UINT64 init_tsc;
+static UINT64 stage_start[TIMING_STAGE_COUNT];
+static UINT64 stage_ticks[TIMING_STAGE_COUNT];
+
+VOID timing_init(VOID) {
+    init_tsc = timing_read_tsc();
+}
+
+VOID timing_start(enum timing_stage stage) {
+    stage_start[stage] = timing_read_tsc();
+}
+
+VOID timing_end(enum timing_stage stage) {
+    stage_ticks[stage] += timing_read_tsc() - stage_start[stage];
+}
+
+VOID timing_record_read(enum timing_source source, UINTN calls, UINTN size, UINT64 ticks) {
+    read_stats[source].calls += calls;
+    read_stats[source].bytes += size;
+    read_stats[source].ticks += ticks;
+}
+
+VOID timing_record_cache(UINTN hits, UINTN misses) {
+    cache_hits += hits;
+    cache_misses += misses;
+}
+
+// Measure TSC frequency (ticks per millisecond), like systemd-boot
+UINTN timing_tsc_khz(VOID) {
+    UINT64 start = timing_read_tsc();
+    uefi_call_wrapper(BS->Stall, 1, 1000);
+    return (UINTN) (timing_read_tsc() - start);
+}
+
+static inline UINT64 ticks_to_usec(UINT64 ticks, UINTN khz) {
+    return DivU64x32(MultU64x32(ticks, 1000), khz, NULL);
+}
+
+static VOID set_usec_variable(CHAR16 *name, UINT64 usec) {
+    CHAR16 value[32];
+    UINTN len = SPrint(value, sizeof(value), L"%ld", usec);
+    uefi_call_wrapper(RT->SetVariable, 5, name, &LoaderInterfaceGuid, VARIABLE_ATTRIBUTES,
+                      (len + 1) * sizeof(*value), value);
+}
+
+VOID timing_export(VOID) {
+    UINT64 exec_tsc = timing_read_tsc();
+    stage_ticks[TIMING_HANDOVER] += exec_tsc - stage_start[TIMING_HANDOVER];
+
+    UINTN khz = timing_tsc_khz();
+    if (!khz) {
+        return;
+    }
+
+    // Keep the init time if we were started by another boot loader (e.g. systemd-boot)
+    UINTN size = 0;
+    EFI_STATUS err = uefi_call_wrapper(RT->GetVariable, 5, LOADER_TIME_INIT_VARIABLE, &LoaderInterfaceGuid,
+                                       NULL, &size, NULL);
+    if (err == EFI_NOT_FOUND) {
+        set_usec_variable(LOADER_TIME_INIT_VARIABLE, ticks_to_usec(init_tsc, khz));
+    }
+    set_usec_variable(LOADER_TIME_EXEC_VARIABLE, ticks_to_usec(exec_tsc, khz));
+
+    // Time of each stage, one "<stage> <usec>" line per stage
+    CHAR16 stages[TIMING_STAGE_COUNT * 48];
+    UINTN len = 0;
+    for (UINTN i = 0; i < TIMING_STAGE_COUNT; ++i) {
+        len += SPrint(&stages[len], sizeof(stages) - len * sizeof(*stages), L"%s %ld\n",
+                      stage_names[i], ticks_to_usec(stage_ticks[i], khz));
+    }
+
+    uefi_call_wrapper(RT->SetVariable, 5, STAGE_TIME_VARIABLE, &AndroidEfiVendorGuid, VARIABLE_ATTRIBUTES,
+                      (len + 1) * sizeof(*stages), stages);
+
+    // Read statistics, one "<source> <reads> <bytes> <usec> <MB/s> <usec/read>" line per used source
+    CHAR16 reads[TIMING_SOURCE_COUNT * 96 + 48];
+    len = 0;
+    for (UINTN i = 0; i < TIMING_SOURCE_COUNT; ++i) {
+        if (!read_stats[i].calls) {
+            continue;
+        }
+
+        UINT64 usec = ticks_to_usec(read_stats[i].ticks, khz);
+        UINTN divisor = usec ? (UINTN) usec : 1;
+        len += SPrint(&reads[len], sizeof(reads) - len * sizeof(*reads), L"%s %d %ld %ld %ld %ld\n",
+                      source_names[i], read_stats[i].calls, read_stats[i].bytes, usec,
+                      DivU64x32(read_stats[i].bytes, divisor, NULL), DivU64x32(usec, read_stats[i].calls, NULL));
+    }
+
+    // Cache statistics: "cache <hits> <misses>"
+    len += SPrint(&reads[len], sizeof(reads) - len * sizeof(*reads), L"cache %d %d\n", cache_hits, cache_misses);
+
+    uefi_call_wrapper(RT->SetVariable, 5, READ_STATS_VARIABLE, &AndroidEfiVendorGuid, VARIABLE_ATTRIBUTES,
+                      (len + 1) * sizeof(*reads), reads);
+}
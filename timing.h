@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_TIMING_H
+#define ANDROID_EFI_TIMING_H
+
+#include <efi.h>
+
+enum timing_stage {
+    TIMING_PARSE_COMMAND_LINE,
+    TIMING_DISPLAY_SPLASH,
+    TIMING_OPEN_IMAGE,
+    TIMING_READ_HEADER,
+    TIMING_LOAD_KERNEL,
+    TIMING_PREPARE_CMDLINE,
+    TIMING_LOAD_RAMDISK,
+    TIMING_HANDOVER,
+
+    TIMING_STAGE_COUNT
+};
+
+enum timing_source {
+    TIMING_SOURCE_PARTITION,
+    TIMING_SOURCE_FILE,
+    TIMING_SOURCE_LZ4,
+    TIMING_SOURCE_INITRD,
+    TIMING_SOURCE_VENDOR_BOOT, // Partition reads from vendor_boot
+
+    TIMING_SOURCE_COUNT
+};
+
+static inline UINT64 timing_read_tsc(VOID) {
+    UINT32 low, high;
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return (UINT64) high << 32 | low;
+}
+
+VOID timing_init(VOID);
+
+// Time spent in a stage is accumulated if it is started multiple times
+VOID timing_start(enum timing_stage stage);
+VOID timing_end(enum timing_stage stage);
+
+// Record time spent reading from a source (calls is 0 when waiting for asynchronous reads)
+VOID timing_record_read(enum timing_source source, UINTN calls, UINTN size, UINT64 ticks);
+// Record hits/misses of the image read cache
+VOID timing_record_cache(UINTN hits, UINTN misses);
+
+// Measures the TSC frequency (ticks per millisecond, takes 1 ms)
+UINTN timing_tsc_khz(VOID);
+
+// Ends the handover stage and stores the results in EFI variables
+VOID timing_export(VOID);
+
+#endif //ANDROID_EFI_TIMING_H
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#include "trace.h"
+#include "log.h"
+#include <efilib.h>
+
+#define MAX_ALIGN  4096
+
+// Ring buffer, allocated once so recording a read is cheap
+static struct trace_entry *entries;
+static UINT32 count;
+
+VOID trace_enable(VOID) {
+    entries = AllocatePool(TRACE_ENTRIES * sizeof(*entries));
+    if (!entries) {
+        log_warning(L"Failed to allocate trace buffer\n");
+    }
+}
+
+static VOID trace_add(enum timing_source source, UINT32 flags, UINT64 offset, const VOID *buffer, UINTN size,
+                      UINT64 start, UINT64 ticks) {
+    if (!entries) {
+        return;
+    }
+
+    UINTN addr = (UINTN) buffer | MAX_ALIGN;
+    struct trace_entry *entry = &entries[count++ % TRACE_ENTRIES];
+    entry->source = source;
+    entry->align = (UINT32) (addr & -addr);
+    entry->offset = offset;
+    entry->size = size;
+    entry->start = start;
+    entry->ticks = ticks;
+    entry->end = start + ticks;
+    entry->flags = flags;
+    entry->reserved = 0;
+}
+
+VOID trace_read(enum timing_source source, UINT64 offset, const VOID *buffer, UINTN size,
+                UINT64 start, UINT64 ticks) {
+    trace_add(source, 0, offset, buffer, size, start, ticks);
+}
+
+VOID trace_cache_hit(enum timing_source source, UINT64 offset, const VOID *buffer, UINTN size,
+                     UINT64 start, UINT64 ticks) {
+    trace_add(source, TRACE_FLAG_CACHED, offset, buffer, size, start, ticks);
+}
+
+UINT32 trace_next_id(VOID) {
+    return entries ? count : TRACE_NONE;
+}
+
+VOID trace_complete(UINT32 id, UINT64 end) {
+    // The entry may not be recorded yet (the read is still being submitted), or already overwritten
+    if (!entries || id == TRACE_NONE || count - id > TRACE_ENTRIES) {
+        return;
+    }
+    entries[id % TRACE_ENTRIES].end = end;
+}
+
+static EFI_STATUS write_file(EFI_FILE_HANDLE file, VOID *buffer, UINTN size) {
+    return uefi_call_wrapper(file->Write, 3, file, &size, buffer);
+}
+
+static EFI_STATUS open_trace_file(EFI_FILE_HANDLE root, EFI_FILE_HANDLE *file) {
+    // Delete the previous trace (it might be longer)
+    EFI_STATUS err = uefi_call_wrapper(root->Open, 5, root, file, TRACE_FILE_NAME,
+                                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!err) {
+        uefi_call_wrapper((*file)->Delete, 1, *file);
+    }
+
+    return uefi_call_wrapper(root->Open, 5, root, file, TRACE_FILE_NAME,
+                             EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+}
+
+VOID trace_export(EFI_HANDLE device) {
+    if (!entries) {
+        return;
+    }
+
+    EFI_FILE_HANDLE root = LibOpenRoot(device);
+    if (!root) {
+        log_warning(L"Failed to open root directory for trace\n");
+        return;
+    }
+
+    EFI_FILE_HANDLE file;
+    EFI_STATUS err = open_trace_file(root, &file);
+    if (err) {
+        log_warning(L"Failed to create trace file: %r\n", err);
+        goto out;
+    }
+
+    // Oldest entries first
+    UINT32 stored = count < TRACE_ENTRIES ? count : TRACE_ENTRIES;
+    UINT32 first = count < TRACE_ENTRIES ? 0 : count % TRACE_ENTRIES;
+
+    struct trace_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .entry_size = sizeof(struct trace_entry),
+        .count = count,
+        .entries = stored,
+        .tsc_khz = timing_tsc_khz(),
+    };
+
+    err = write_file(file, &header, sizeof(header));
+    if (!err) {
+        err = write_file(file, &entries[first], (stored - first) * sizeof(*entries));
+    }
+    if (!err && first) {
+        err = write_file(file, entries, first * sizeof(*entries));
+    }
+    if (err) {
+        log_warning(L"Failed to write trace file: %r\n", err);
+    }
+
+    uefi_call_wrapper(file->Close, 1, file);
+
+out:
+    uefi_call_wrapper(root->Close, 1, root);
+    FreePool(entries);
+    entries = NULL;
+}
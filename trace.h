@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#ifndef ANDROID_EFI_TRACE_H
+#define ANDROID_EFI_TRACE_H
+
+#include <efi.h>
+#include "timing.h"
+
+/*
+ * Optional trace of the image and initrd reads, written to a file on the EFI system partition before handover.
+ * Only the most recent TRACE_ENTRIES reads are kept. See tracereplay for a host tool that
+ * replays the trace against a disk image.
+ *
+ * File format (little endian): struct trace_header, followed by the entries in the order
+ * the reads were started.
+ */
+
+#define TRACE_FILE_NAME  L"\\android-efi.trace"
+#define TRACE_MAGIC      "AEFTRACE"
+#define TRACE_VERSION    2
+#define TRACE_ENTRIES    4096
+#define TRACE_NONE       ((UINT32) -1)
+
+#define TRACE_FLAG_CACHED  (1 << 0) // Copied from the block cache of the image, nothing was read
+
+struct trace_header {
+    CHAR8 magic[8];
+    UINT32 version;
+    UINT32 entry_size;
+    UINT32 count;   // Total number of reads
+    UINT32 entries; // Number of entries in the file
+    UINT64 tsc_khz; // TSC ticks per millisecond
+} __attribute__((packed));
+
+struct trace_entry {
+    UINT32 source; // enum timing_source
+    UINT32 align;  // Alignment of the destination buffer (lowest set bit of its address, up to 4096)
+    UINT64 offset; // Offset in the image (always 0 for initrd files)
+    UINT64 size;
+    UINT64 start;  // TSC when the read was started
+    UINT64 ticks;  // TSC ticks spent in the read call
+    UINT64 end;    // TSC when the data was available (asynchronous partition reads complete later)
+    UINT32 flags;  // TRACE_FLAG_*
+    UINT32 reserved;
+} __attribute__((packed));
+
+VOID trace_enable(VOID);
+VOID trace_read(enum timing_source source, UINT64 offset, const VOID *buffer, UINTN size,
+                UINT64 start, UINT64 ticks);
+VOID trace_cache_hit(enum timing_source source, UINT64 offset, const VOID *buffer, UINTN size,
+                     UINT64 start, UINT64 ticks);
+
+// Identifies the entry of the next read, TRACE_NONE if tracing is disabled
+UINT32 trace_next_id(VOID);
+// Update the end of a read that was completed asynchronously
+VOID trace_complete(UINT32 id, UINT64 end);
+VOID trace_export(EFI_HANDLE device);
+
+#endif //ANDROID_EFI_TRACE_H
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-2.0
+// Copyright (C) 2018 lambdadroid
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * Prints a read trace written by android-efi (--trace), or replays it against a
+ * boot image (file or partition) to compare the I/O pattern with the recorded timings.
+ *
+ * The reads are issued in the recorded order with pread() into buffers with the same
+ * alignment. Reads of initrd files are skipped since their contents are not part of the image.
+ * Reads from the vendor_boot partition are replayed against the vendor_boot image if specified,
+ * and skipped otherwise. Reads served from the block cache of the image did not access the disk
+ * and are not replayed either.
+ * Reads from partitions are asynchronous, so the recorded time until the data was available
+ * (end - start) is compared, not the time spent submitting the request.
+ *
+ * See trace.h for the file format.
+ */
+
+#define TRACE_MAGIC    "AEFTRACE"
+#define TRACE_VERSION  2
+#define MAX_ALIGN      4096
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t count;
+    uint32_t entries;
+    uint64_t tsc_khz;
+} __attribute__((packed));
+
+struct trace_entry {
+    uint32_t source;
+    uint32_t align;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t start;
+    uint64_t ticks;
+    uint64_t end;
+    uint32_t flags;
+    uint32_t reserved;
+} __attribute__((packed));
+
+#define TRACE_FLAG_CACHED  (1 << 0)
+
+enum trace_source {
+    SOURCE_PARTITION,
+    SOURCE_FILE,
+    SOURCE_LZ4,
+    SOURCE_INITRD,
+    SOURCE_VENDOR_BOOT,
+
+    SOURCE_COUNT
+};
+
+static const char *source_names[SOURCE_COUNT] = {
+    [SOURCE_PARTITION]   = "partition",
+    [SOURCE_FILE]        = "file",
+    [SOURCE_LZ4]         = "lz4",
+    [SOURCE_INITRD]      = "initrd",
+    [SOURCE_VENDOR_BOOT] = "vendor_boot",
+};
+
+static const char *source_name(uint32_t source) {
+    return source < SOURCE_COUNT ? source_names[source] : "unknown";
+}
+
+static double ticks_to_usec(const struct trace_header *header, uint64_t ticks) {
+    return header->tsc_khz ? (double) ticks * 1000 / header->tsc_khz : 0;
+}
+
+static double now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static struct trace_entry *read_trace(const char *filename, struct trace_header *header) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror("Failed to open trace file");
+        return NULL;
+    }
+
+    struct trace_entry *entries = NULL;
+    if (fread(header, sizeof(*header), 1, file) != 1) {
+        fprintf(stderr, "Failed to read trace header\n");
+        goto out;
+    }
+
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != TRACE_VERSION || header->entry_size != sizeof(struct trace_entry)) {
+        fprintf(stderr, "Unsupported trace file: %s\n", filename);
+        goto out;
+    }
+
+    entries = calloc(header->entries ? header->entries : 1, sizeof(*entries));
+    if (!entries) {
+        fprintf(stderr, "Failed to allocate memory for %" PRIu32 " entries\n", header->entries);
+        goto out;
+    }
+
+    if (fread(entries, sizeof(*entries), header->entries, file) != header->entries) {
+        fprintf(stderr, "Trace file is truncated\n");
+        free(entries);
+        entries = NULL;
+    }
+
+out:
+    fclose(file);
+    return entries;
+}
+
+static void print_trace(const struct trace_header *header, const struct trace_entry *entries) {
+    printf("%" PRIu32 " reads (%" PRIu32 " recorded), TSC %" PRIu64 " kHz\n",
+           header->count, header->entries, header->tsc_khz);
+    printf("%12s %-11s %12s %10s %6s %10s %10s\n", "start (us)", "source", "offset", "size", "align",
+           "call (us)", "done (us)");
+
+    uint64_t first = header->entries ? entries[0].start : 0;
+    for (uint32_t i = 0; i < header->entries; ++i) {
+        const struct trace_entry *entry = &entries[i];
+        printf("%12.0f %-11s %12" PRIu64 " %10" PRIu64 " %6" PRIu32 " %10.1f %10.1f%s\n",
+               ticks_to_usec(header, entry->start - first), source_name(entry->source),
+               entry->offset, entry->size, entry->align, ticks_to_usec(header, entry->ticks),
+               ticks_to_usec(header, entry->end - entry->start), entry->flags & TRACE_FLAG_CACHED ? " cached" : "");
+    }
+}
+
+static int open_image(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image");
+        return -1;
+    }
+
+    // Start with a cold page cache, like the firmware
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    return fd;
+}
+
+static int replay_trace(const struct trace_header *header, const struct trace_entry *entries,
+                        const char *filename, const char *vendor_filename) {
+    int fd = open_image(filename);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int vendor_fd = -1;
+    if (vendor_filename) {
+        vendor_fd = open_image(vendor_filename);
+        if (vendor_fd < 0) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t max_size = 0;
+    for (uint32_t i = 0; i < header->entries; ++i) {
+        if (entries[i].size > max_size) {
+            max_size = entries[i].size;
+        }
+    }
+
+    // Extra space to reproduce the alignment of each destination buffer
+    uint8_t *buffer;
+    if (posix_memalign((void**) &buffer, MAX_ALIGN * 2, max_size + MAX_ALIGN * 2)) {
+        fprintf(stderr, "Failed to allocate %" PRIu64 " bytes\n", max_size);
+        close(fd);
+        if (vendor_fd >= 0) {
+            close(vendor_fd);
+        }
+        return EXIT_FAILURE;
+    }
+
+    printf("%-11s %12s %10s %6s %13s %13s\n", "source", "offset", "size", "align", "recorded (us)", "replayed (us)");
+
+    int ret = EXIT_SUCCESS;
+    double recorded = 0, replayed = 0;
+    for (uint32_t i = 0; i < header->entries; ++i) {
+        const struct trace_entry *entry = &entries[i];
+        int entry_fd = entry->source == SOURCE_VENDOR_BOOT ? vendor_fd : fd;
+        if (entry->source == SOURCE_INITRD || (entry->flags & TRACE_FLAG_CACHED) || entry_fd < 0 || !entry->size) {
+            continue;
+        }
+
+        uint32_t align = entry->align && entry->align <= MAX_ALIGN ? entry->align : MAX_ALIGN;
+        uint8_t *dest = buffer + (align == MAX_ALIGN ? 0 : align);
+
+        double start = now_usec();
+        ssize_t result = pread(entry_fd, dest, entry->size, (off_t) entry->offset);
+        double time = now_usec() - start;
+        if (result < 0 || (uint64_t) result != entry->size) {
+            fprintf(stderr, "Failed to read %" PRIu64 " bytes at offset %" PRIu64 "\n", entry->size, entry->offset);
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        double entry_recorded = ticks_to_usec(header, entry->end - entry->start);
+        printf("%-11s %12" PRIu64 " %10" PRIu64 " %6" PRIu32 " %13.1f %13.1f\n", source_name(entry->source),
+               entry->offset, entry->size, entry->align, entry_recorded, time);
+
+        recorded += entry_recorded;
+        replayed += time;
+    }
+
+    printf("Total: recorded %.1f us, replayed %.1f us\n", recorded, replayed);
+
+    free(buffer);
+    close(fd);
+    if (vendor_fd >= 0) {
+        close(vendor_fd);
+    }
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: tracereplay <android-efi.trace> [boot.img [vendor_boot.img]]\n");
+        return EXIT_FAILURE;
+    }
+
+    struct trace_header header;
+    struct trace_entry *entries = read_trace(argv[1], &header);
+    if (!entries) {
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+    if (argc >= 3) {
+        ret = replay_trace(&header, entries, argv[2], argc == 4 ? argv[3] : NULL);
+    } else {
+        print_trace(&header, entries);
+    }
+
+    free(entries);
+    return ret;
+}